@@ -35,9 +35,13 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  * */
 #define FASTLZ_PYTHON_MODULE_VERSION "0.1"
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <time.h>
 #include "fastlz.h"
-#define DEBUG
+#ifdef WITH_THREAD
+#include "pythread.h"
+#endif
 
 /*
  * Ensure we have the updated fastlz version
@@ -50,6 +54,8 @@
 #endif
 
 static PyObject *FastlzError;
+/* interned key of the per-thread Compressor, looked up on every compress() */
+static PyObject *ctx_key;
 
 
 #undef PATH_SEPARATOR
@@ -77,24 +83,80 @@ static PyObject *FastlzError;
 #endif
 #endif
 
+/* pack_file(mmap=True) and unpack_file(mmap=True) read through a mapping */
+#if defined(HAVE_MMAP) && defined(HAVE_UNISTD_H)
+#define SIXPACK_MMAP
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+/* unpack_file(threads=n) writes the blocks of a file out of order with pwrite */
+#if defined(WITH_THREAD) && defined(HAVE_UNISTD_H) && defined(HAVE_FTRUNCATE)
+#define SIXPACK_PARALLEL_UNPACK
+#include <unistd.h>
+#endif
+
+/* archives and the files in them can be larger than a long */
+#if defined(_MSC_VER)
+#define SIXPACK_FSEEK(f, offset, origin) _fseeki64(f, (__int64)(offset), origin)
+#define SIXPACK_FTELL(f) ((unsigned long long)_ftelli64(f))
+#elif defined(HAVE_FSEEKO) && defined(HAVE_FTELLO)
+#define SIXPACK_FSEEK(f, offset, origin) fseeko(f, (off_t)(offset), origin)
+#define SIXPACK_FTELL(f) ((unsigned long long)ftello(f))
+#else
+#define SIXPACK_FSEEK(f, offset, origin) fseek(f, (long)(offset), origin)
+#define SIXPACK_FTELL(f) ((unsigned long long)ftell(f))
+#endif
+
 /* magic identifier for 6pack file */
 static unsigned char sixpack_magic[8] = {137, '6', 'P', 'K', 13, 10, 26, 10};
 
 #define BLOCK_SIZE (2*64*1024)
 
+/* room for what any level writes for a block, so it needs no scratch buffer */
+#define PACK_RESULT_SIZE (BLOCK_SIZE + BLOCK_SIZE/16 + 66)
+
+/*
+ * Chunk 18 lists where the blocks of a file are, chunk 19 closes the
+ * archive and points back at the last chunk 18; see read_range().
+ */
+#define SIXPACK_INDEX 18
+#define SIXPACK_FOOTER 19
+
+/*
+ * The archive functions run without the GIL, so they do not print. A
+ * failure is described in a buffer of SIXPACK_ERROR_SIZE bytes instead,
+ * which the binding raises as fastlz.error.
+ */
+#define SIXPACK_ERROR_SIZE 512
+
 /* prototypes */
 static inline unsigned long update_adler32(unsigned long checksum, const void *buf, int len);
+static unsigned long update_adler32_scalar(unsigned long checksum, const void *buf, int len);
 int detect_magic(FILE *f);
 void write_magic(FILE *f);
 void write_chunk_header(FILE* f, int id, int options, unsigned long size,
                         unsigned long checksum, unsigned long extra);
 unsigned long block_compress(const unsigned char* input, unsigned long length, unsigned char* output);
-int pack_file_compressed(const char* input_file, int method, int level, FILE* f);
-int pack_file(int compress_level, const char* input_file, const char* output_file);
+int pack_file_compressed(const char* input_file, int method, int level, int nworkers,
+                         int inflight, int use_mmap, int with_index, FILE* f, char* error);
+int pack_file(int compress_level, const char* input_file, const char* output_file,
+              int nworkers, int inflight, int use_mmap, int with_index, char* error);
 
 /* for Adler-32 checksum algorithm, see RFC 1950 Section 8.2 */
 #define ADLER32_BASE 65521
+#define ADLER32_NMAX 5552
+
+/* picked in initfastlz, together with the fastlz kernel */
+static unsigned long (*update_adler32_kernel)(unsigned long checksum, const void *buf, int len) = update_adler32_scalar;
+
 static inline unsigned long update_adler32(unsigned long checksum, const void *buf, int len)
+{
+    return update_adler32_kernel(checksum, buf, len);
+}
+
+static unsigned long update_adler32_scalar(unsigned long checksum, const void *buf, int len)
 {
     const unsigned char* ptr = (const unsigned char*)buf;
     unsigned long s1 = checksum & 0xffff;
@@ -102,7 +164,7 @@ static inline unsigned long update_adler32(unsigned long checksum, const void *b
 
     while(len>0)
     {
-        unsigned k = len < 5552 ? len : 5552;
+        unsigned k = len < ADLER32_NMAX ? len : ADLER32_NMAX;
         len -= k;
 
         while(k >= 8)
@@ -137,6 +199,107 @@ static inline unsigned long update_adler32(unsigned long checksum, const void *b
     return (s2 << 16) + s1;
 }
 
+#if !defined(FASTLZ_NO_DISPATCH) && (defined(__x86_64__) || defined(__i386__))
+#if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 5))
+#define ADLER32_SIMD
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(ADLER32_SIMD)
+/*
+ * Vectorized Adler-32, 32 bytes per step. Over n steps, s2 grows by
+ * 32 * n * s1 plus 32 times the sum of s1 after each step (kept in ps),
+ * plus every byte weighted by its distance from the end of its step
+ * (the taps). Remainder and tail are left to the scalar version.
+ */
+__attribute__((target("ssse3")))
+static unsigned long update_adler32_ssse3(unsigned long checksum, const void *buf, int len)
+{
+    const unsigned char* ptr = (const unsigned char*)buf;
+    unsigned long s1 = checksum & 0xffff;
+    unsigned long s2 = (checksum >> 16) & 0xffff;
+    int steps = len / 32;
+    const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+
+    len -= steps * 32;
+    while (steps > 0) {
+        int n = (steps < ADLER32_NMAX / 32) ? steps : ADLER32_NMAX / 32;
+        __m128i ps = _mm_set_epi32(0, 0, 0, (int)(s1 * n));
+        __m128i v2 = _mm_set_epi32(0, 0, 0, (int)s2);
+        __m128i v1 = zero;
+        steps -= n;
+        do {
+            const __m128i a = _mm_loadu_si128((const __m128i*)ptr);
+            const __m128i b = _mm_loadu_si128((const __m128i*)(ptr + 16));
+            ps = _mm_add_epi32(ps, v1);
+            v1 = _mm_add_epi32(v1, _mm_sad_epu8(a, zero));
+            v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_maddubs_epi16(a, tap1), ones));
+            v1 = _mm_add_epi32(v1, _mm_sad_epu8(b, zero));
+            v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_maddubs_epi16(b, tap2), ones));
+            ptr += 32;
+        } while (--n);
+        v2 = _mm_add_epi32(v2, _mm_slli_epi32(ps, 5));
+
+        v1 = _mm_add_epi32(v1, _mm_shuffle_epi32(v1, _MM_SHUFFLE(2, 3, 0, 1)));
+        v1 = _mm_add_epi32(v1, _mm_shuffle_epi32(v1, _MM_SHUFFLE(1, 0, 3, 2)));
+        s1 += (unsigned int)_mm_cvtsi128_si32(v1);
+        v2 = _mm_add_epi32(v2, _mm_shuffle_epi32(v2, _MM_SHUFFLE(2, 3, 0, 1)));
+        v2 = _mm_add_epi32(v2, _mm_shuffle_epi32(v2, _MM_SHUFFLE(1, 0, 3, 2)));
+        s2 = (unsigned int)_mm_cvtsi128_si32(v2);
+        s1 %= ADLER32_BASE;
+        s2 %= ADLER32_BASE;
+    }
+    return update_adler32_scalar((s2 << 16) + s1, ptr, len);
+}
+
+__attribute__((target("avx2")))
+static unsigned long update_adler32_avx2(unsigned long checksum, const void *buf, int len)
+{
+    const unsigned char* ptr = (const unsigned char*)buf;
+    unsigned long s1 = checksum & 0xffff;
+    unsigned long s2 = (checksum >> 16) & 0xffff;
+    int steps = len / 32;
+    const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                         16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+
+    len -= steps * 32;
+    while (steps > 0) {
+        int n = (steps < ADLER32_NMAX / 32) ? steps : ADLER32_NMAX / 32;
+        __m256i ps = _mm256_set_epi32(0, 0, 0, 0, 0, 0, 0, (int)(s1 * n));
+        __m256i v2 = _mm256_set_epi32(0, 0, 0, 0, 0, 0, 0, (int)s2);
+        __m256i v1 = zero;
+        __m128i h1, h2;
+        steps -= n;
+        do {
+            const __m256i a = _mm256_loadu_si256((const __m256i*)ptr);
+            ps = _mm256_add_epi32(ps, v1);
+            v1 = _mm256_add_epi32(v1, _mm256_sad_epu8(a, zero));
+            v2 = _mm256_add_epi32(v2, _mm256_madd_epi16(_mm256_maddubs_epi16(a, tap), ones));
+            ptr += 32;
+        } while (--n);
+        v2 = _mm256_add_epi32(v2, _mm256_slli_epi32(ps, 5));
+
+        h1 = _mm_add_epi32(_mm256_castsi256_si128(v1), _mm256_extracti128_si256(v1, 1));
+        h1 = _mm_add_epi32(h1, _mm_shuffle_epi32(h1, _MM_SHUFFLE(2, 3, 0, 1)));
+        h1 = _mm_add_epi32(h1, _mm_shuffle_epi32(h1, _MM_SHUFFLE(1, 0, 3, 2)));
+        s1 += (unsigned int)_mm_cvtsi128_si32(h1);
+        h2 = _mm_add_epi32(_mm256_castsi256_si128(v2), _mm256_extracti128_si256(v2, 1));
+        h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, _MM_SHUFFLE(2, 3, 0, 1)));
+        h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, _MM_SHUFFLE(1, 0, 3, 2)));
+        s2 = (unsigned int)_mm_cvtsi128_si32(h2);
+        s1 %= ADLER32_BASE;
+        s2 %= ADLER32_BASE;
+    }
+    return update_adler32_scalar((s2 << 16) + s1, ptr, len);
+}
+#endif
+
 
 /* return non-zero if magic sequence is detected */
 /* warning: reset the read pointer to the beginning of the file */
@@ -189,36 +352,213 @@ void write_chunk_header(FILE* f, int id, int options, unsigned long size,
     fwrite(buffer, 16, 1, f);
 }
 
-int pack_file_compressed(const char* input_file, int method, int level, FILE* f)
+/*
+ * Maps a whole file to read it, NULL when it is empty or can not be mapped
+ * and stdio has to do. The file must not shrink while it is mapped.
+ */
+static const unsigned char* map_file(FILE* f, unsigned long long size)
+{
+#ifdef SIXPACK_MMAP
+    void* map;
+
+    if(size == 0 || (size_t)size != size)
+        return 0;
+    map = mmap(0, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if(map == MAP_FAILED)
+        return 0;
+#ifdef MADV_SEQUENTIAL
+    madvise(map, size, MADV_SEQUENTIAL);
+#endif
+    return (const unsigned char*)map;
+#else
+    return 0;
+#endif
+}
+
+static void unmap_file(const unsigned char* map, unsigned long long size)
+{
+#ifdef SIXPACK_MMAP
+    if(map)
+        munmap((void*)map, size);
+#endif
+}
+
+/* both 6pack paths read their input front to back */
+static void advise_sequential(FILE* f)
+{
+#if defined(SIXPACK_MMAP) && defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+/* a block of the input file on its way into a chunk 17 */
+typedef struct {
+    const unsigned char* input;
+    unsigned char* buffer;
+    unsigned char* result;
+    size_t result_size;
+    unsigned long bytes_read;
+    int method;
+    int chunk_size;
+    unsigned long checksum;
+} pack_block;
+
+/* compresses a block, or leaves it to be stored, and checksums the chunk */
+static void pack_block_compress(pack_block* block, int method, int level)
+{
+    block->method = method;
+
+    /* too small, don't bother to compress */
+    if(block->bytes_read < 32)
+        block->method = 0;
+
+    /* store it if it does not get smaller, this gives up early */
+    if(block->method == 1)
+    {
+        block->chunk_size = fastlz_compress_bounded_room(level, block->input, block->bytes_read,
+                                                         block->result, block->bytes_read - 1,
+                                                         block->result_size);
+        if(block->chunk_size == 0)
+            block->method = 0;
+    }
+
+    switch(block->method)
+    {
+        /* FastLZ */
+    case 1:
+        block->checksum = update_adler32(1L, block->result, block->chunk_size);
+        break;
+
+        /* uncompressed, also fallback method */
+    case 0:
+    default:
+        block->method = 0;
+        block->chunk_size = block->bytes_read;
+        block->checksum = update_adler32(1L, block->input, block->bytes_read);
+        break;
+    }
+}
+
+/*
+ * Where the blocks of a file went, 16 bytes per block: its offset in the
+ * file and the offset of its chunk 17 in the archive, 64-bit little endian.
+ */
+typedef struct {
+    unsigned char* entries;
+    unsigned long count;
+    unsigned long capacity;
+    unsigned long long file_offset;
+    unsigned long long archive_offset;
+    int failed;
+} pack_index;
+
+static void writeU64(unsigned char* ptr, unsigned long long value)
+{
+    int c;
+
+    for(c = 0; c < 8; c++)
+        ptr[c] = (value >> (8 * c)) & 255;
+}
+
+static void pack_index_add(pack_index* index, const pack_block* block)
+{
+    if(index->count == index->capacity && !index->failed)
+    {
+        unsigned long grown = index->capacity ? 2 * index->capacity : 64;
+        unsigned char* entries = (unsigned char*)realloc(index->entries, grown * 16);
+        if(entries)
+        {
+            index->entries = entries;
+            index->capacity = grown;
+        }
+        else
+            index->failed = 1;
+    }
+    if(!index->failed)
+    {
+        writeU64(index->entries + 16 * index->count, index->file_offset);
+        writeU64(index->entries + 16 * index->count + 8, index->archive_offset);
+        index->count++;
+    }
+    index->file_offset += block->bytes_read;
+    index->archive_offset += 16 + block->chunk_size;
+}
+
+/* chunk 18 for the file entry at entry, then chunk 19 pointing at it */
+static void pack_index_write(FILE* f, const pack_index* index, unsigned long long entry)
+{
+    unsigned char buffer[8];
+    unsigned long checksum;
+
+    writeU64(buffer, entry);
+    checksum = update_adler32(1L, buffer, 8);
+    checksum = update_adler32(checksum, index->entries, 16 * index->count);
+    write_chunk_header(f, SIXPACK_INDEX, 0, 8 + 16 * index->count, checksum, index->count);
+    fwrite(buffer, 8, 1, f);
+    fwrite(index->entries, 16, index->count, f);
+
+    writeU64(buffer, index->archive_offset);
+    checksum = update_adler32(1L, buffer, 8);
+    write_chunk_header(f, SIXPACK_FOOTER, 0, 8, checksum, 0);
+    fwrite(buffer, 8, 1, f);
+}
+
+static void pack_block_write(FILE* f, const pack_block* block, pack_index* index)
+{
+    if(index)
+        pack_index_add(index, block);
+    write_chunk_header(f, 17, block->method, block->chunk_size, block->checksum,
+                       block->bytes_read);
+    fwrite(block->method ? block->result : block->input, 1, block->chunk_size, f);
+}
+
+#ifdef WITH_THREAD
+static int pack_blocks_threads(FILE* in, const unsigned char* map, unsigned long long fsize,
+                               FILE* f, pack_index* index, int method, int level, int nworkers,
+                               int inflight, unsigned long long* total_read, char* error);
+#endif
+
+int pack_file_compressed(const char* input_file, int method, int level, int nworkers,
+                         int inflight, int use_mmap, int with_index, FILE* f, char* error)
 {
     FILE* in;
-    unsigned long fsize;
+    unsigned long long fsize;
     unsigned long checksum;
     const char* shown_name;
-    unsigned char buffer[BLOCK_SIZE];
-    unsigned char result[BLOCK_SIZE*2]; /* FIXME twice is too large */
-    unsigned char progress[20];
-    int c;
-    unsigned long percent;
-    unsigned long total_read;
-    unsigned long total_compressed;
-    int chunk_size;
+    unsigned char* buffer;
+    unsigned char* result;
+    unsigned long long total_read;
+    const unsigned char* map;
+    pack_block block;
+    pack_index index;
+    unsigned long long entry;
+    int status;
 
     /* sanity check */
     in = fopen(input_file, "rb");
     if (!in) {
-        printf("Error: could not open %s\n", input_file);
+        snprintf(error, SIXPACK_ERROR_SIZE, "could not open %s", input_file);
         return -1;
     }
 
     /* find size of the file */
-    fseek(in, 0, SEEK_END);
-    fsize = ftell(in);
-    fseek(in, 0, SEEK_SET);
+    SIXPACK_FSEEK(in, 0, SEEK_END);
+    fsize = SIXPACK_FTELL(in);
+    SIXPACK_FSEEK(in, 0, SEEK_SET);
 
     /* already a 6pack archive? */
     if (detect_magic(in)) {
-        printf("Error: file %s is already a 6pack archive!\n", input_file);
+        snprintf(error, SIXPACK_ERROR_SIZE, "file %s is already a 6pack archive", input_file);
+        fclose(in);
+        return -1;
+    }
+
+    buffer = (unsigned char*)malloc(BLOCK_SIZE);
+    result = (unsigned char*)malloc(PACK_RESULT_SIZE);
+    if (!buffer || !result) {
+        snprintf(error, SIXPACK_ERROR_SIZE, "out of memory");
+        free(buffer);
+        free(result);
         fclose(in);
         return -1;
     }
@@ -236,145 +576,104 @@ int pack_file_compressed(const char* input_file, int method, int level, FILE* f)
     buffer[1] = (fsize >> 8) & 255;
     buffer[2] = (fsize >> 16) & 255;
     buffer[3] = (fsize >> 24) & 255;
-#if 0
     buffer[4] = (fsize >> 32) & 255;
     buffer[5] = (fsize >> 40) & 255;
     buffer[6] = (fsize >> 48) & 255;
     buffer[7] = (fsize >> 56) & 255;
-#else
-    /* because fsize is only 32-bit */
-    buffer[4] = 0;
-    buffer[5] = 0;
-    buffer[6] = 0;
-    buffer[7] = 0;
-#endif
     buffer[8] = (strlen(shown_name)+1) & 255;
     buffer[9] = (strlen(shown_name)+1) >> 8;
     checksum = 1L;
     checksum = update_adler32(checksum, buffer, 10);
     checksum = update_adler32(checksum, shown_name, strlen(shown_name)+1);
+    entry = SIXPACK_FTELL(f);
     write_chunk_header(f, 1, 0, 10+strlen(shown_name)+1, checksum, 0);
     fwrite(buffer, 10, 1, f);
     fwrite(shown_name, strlen(shown_name)+1, 1, f);
-    total_compressed = 16 + 10 + strlen(shown_name)+1;
 
-    /* for progress status */
-    memset(progress, ' ', 20);
-    if(strlen(shown_name) < 16)
-        for(c = 0; c < (int)strlen(shown_name); c++)
-            progress[c] = shown_name[c];
-    else {
-        for(c = 0; c < 13; c++)
-            progress[c] = shown_name[c];
-        progress[13] = '.';
-        progress[14] = '.';
-        progress[15] = ' ';
-    }
-    progress[16] = '[';
-    progress[17] = 0;
-    printf("%s", progress);
-    for(c = 0; c < 50; c++)
-        printf(".");
-    printf("]\r");
-    printf("%s", progress);
-
-    /* read file and place in archive */
+    /* the blocks are counted as they are written */
+    memset(&index, 0, sizeof(index));
+    index.archive_offset = entry + 16 + 10 + strlen(shown_name) + 1;
+
+    /* read file and place in archive, straight from a mapping if asked to */
     total_read = 0;
-    percent = 0;
+    status = 0;
+    map = use_mmap ? map_file(in, fsize) : 0;
+    advise_sequential(in);
+    block.buffer = buffer;
+    block.result = result;
+    block.result_size = PACK_RESULT_SIZE;
+#ifdef WITH_THREAD
+    if(nworkers > 0)
+        status = pack_blocks_threads(in, map, fsize, f, with_index ? &index : 0, method, level,
+                                     nworkers, inflight, &total_read, error);
+    else
+#endif
     for(;;)
     {
-        int compress_method = method;
-        int last_percent = (int)percent;
-        size_t bytes_read = fread(buffer, 1, BLOCK_SIZE, in);
-        if(bytes_read == 0)
-            break;
-        total_read += bytes_read;
-
-        /* for progress */
-        if(fsize < (1<<24))
-            percent = total_read * 100 / fsize;
-        else
-            percent = total_read/256 * 100 / (fsize >>8);
-        percent >>= 1;
-        while(last_percent < (int)percent)
+        if(map)
         {
-            printf("#");
-            last_percent++;
+            block.input = map + total_read;
+            block.bytes_read = (fsize - total_read < BLOCK_SIZE) ? fsize - total_read : BLOCK_SIZE;
         }
-
-        /* too small, don't bother to compress */
-        if(bytes_read < 32)
-            compress_method = 0;
-
-        /* write to output */
-        switch(compress_method)
+        else
         {
-            /* FastLZ */
-        case 1:
-            chunk_size = fastlz_compress_level(level, buffer, bytes_read, result);
-            checksum = update_adler32(1L, result, chunk_size);
-            write_chunk_header(f, 17, 1, chunk_size, checksum, bytes_read);
-            fwrite(result, 1, chunk_size, f);
-            total_compressed += 16;
-            total_compressed += chunk_size;
-            break;
-
-            /* uncompressed, also fallback method */
-        case 0:
-        default:
-            checksum = 1L;
-            checksum = update_adler32(checksum, buffer, bytes_read);
-            write_chunk_header(f, 17, 0, bytes_read, checksum, bytes_read);
-            fwrite(buffer, 1, bytes_read, f);
-            total_compressed += 16;
-            total_compressed += bytes_read;
-            break;
+            block.input = buffer;
+            block.bytes_read = fread(buffer, 1, BLOCK_SIZE, in);
         }
+        if(block.bytes_read == 0)
+            break;
+        total_read += block.bytes_read;
+        pack_block_compress(&block, method, level);
+        pack_block_write(f, &block, with_index ? &index : 0);
     }
 
+    unmap_file(map, fsize);
     fclose(in);
-    if(total_read != fsize)
+    free(buffer);
+    free(result);
+    if(status == 0 && total_read != fsize)
     {
-        printf("\n");
-        printf("Error: reading %s failed!\n", input_file);
-        return -1;
+        snprintf(error, SIXPACK_ERROR_SIZE, "reading %s failed", input_file);
+        status = -1;
     }
-    else
+    if(status == 0 && index.failed)
     {
-        printf("] ");
-        if(total_compressed < fsize)
-        {
-            if(fsize < (1<<20))
-                percent = total_compressed * 1000 / fsize;
-            else
-                percent = total_compressed/256 * 1000 / (fsize >>8);
-            percent = 1000 - percent;
-            printf("%2d.%d%% saved", (int)percent/10, (int)percent%10);
-        }
-        printf("\n");
+        snprintf(error, SIXPACK_ERROR_SIZE, "out of memory");
+        status = -1;
     }
+    if(status == 0 && with_index)
+        pack_index_write(f, &index, entry);
+    free(index.entries);
 
-    return 0;
+    return status != 0 ? -1 : 0;
 }
 
-int pack_file(int compress_level, const char* input_file, const char* output_file)
+int pack_file(int compress_level, const char* input_file, const char* output_file,
+              int nworkers, int inflight, int use_mmap, int with_index, char* error)
 {
     FILE* f;
     int result;
     f = fopen(output_file, "rb");
     if (f) {
         fclose(f);
-        printf("Error: file %s already exists. Aborted.\n\n", output_file);
+        snprintf(error, SIXPACK_ERROR_SIZE, "file %s already exists", output_file);
         return -1;
     }
     f = fopen(output_file, "wb");
     if (!f) {
-        printf("Error: could not create %s. Aborted.\n\n", output_file);
+        snprintf(error, SIXPACK_ERROR_SIZE, "could not create %s", output_file);
         return -1;
     }
     write_magic(f);
-    result = pack_file_compressed(input_file, 1, compress_level, f);
-    fclose(f);
+    result = pack_file_compressed(input_file, 1, compress_level, nworkers, inflight, use_mmap,
+                                  with_index, f, error);
+    if (fclose(f) != 0 && result == 0) {
+        snprintf(error, SIXPACK_ERROR_SIZE, "writing %s failed", output_file);
+        result = -1;
+    }
+    /* do not leave a partial archive behind */
+    if (result != 0)
+        remove(output_file);
     return result;
 }
 
@@ -390,9 +689,15 @@ int pack_file(int compress_level, const char* input_file, const char* output_fil
 /* prototypes */
 static inline unsigned long readU16(const unsigned char* ptr);
 static inline unsigned long readU32(const unsigned char* ptr);
+static inline unsigned long long readU64(const unsigned char* ptr);
 void read_chunk_header(FILE* f, int* id, int* options, unsigned long* size,
                        unsigned long* checksum, unsigned long* extra);
-int unpack_file(const char* archive_file);
+int unpack_file(const char* archive_file, int nworkers, int use_mmap, char* error);
+#ifdef SIXPACK_PARALLEL_UNPACK
+static int unpack_chunks_threads(FILE* in, const unsigned char* map, unsigned long long fsize,
+                                 unsigned long long* pos, unsigned long* chunk_size, FILE* f,
+                                 const char* output_file, int nworkers, char* error);
+#endif
 
 
 
@@ -406,10 +711,19 @@ static inline unsigned long readU32( const unsigned char* ptr )
     return ptr[0]+(ptr[1]<<8)+(ptr[2]<<16)+(ptr[3]<<24);
 }
 
+static inline unsigned long long readU64( const unsigned char* ptr )
+{
+    /* readU32 sign extends its top bit, like read_chunk_header masks it */
+    return (readU32(ptr) & 0xffffffff)+((unsigned long long)(readU32(ptr+4) & 0xffffffff)<<32);
+}
+
 void read_chunk_header(FILE* f, int* id, int* options, unsigned long* size,
                        unsigned long* checksum, unsigned long* extra)
 {
     unsigned char buffer[16];
+
+    /* a header cut short by the end of the archive reads as chunk 0 */
+    memset(buffer, 0, 16);
     fread(buffer, 1, 16, f);
 
     *id = readU16(buffer) & 0xffff;
@@ -419,23 +733,25 @@ void read_chunk_header(FILE* f, int* id, int* options, unsigned long* size,
     *extra = readU32(buffer+12) & 0xffffffff;
 }
 
-int unpack_file(const char* input_file)
+/*
+ * Returns -1 if the archive can not be read, otherwise the number of files
+ * that were skipped, with the reason for the last one in error.
+ */
+int unpack_file(const char* input_file, int nworkers, int use_mmap, char* error)
 {
     FILE* in;
-    unsigned long fsize;
+    unsigned long long fsize;
     int c;
-    unsigned long percent;
-    unsigned char progress[20];
     int chunk_id;
     int chunk_options;
     unsigned long chunk_size;
     unsigned long chunk_checksum;
     unsigned long chunk_extra;
-    unsigned char buffer[BLOCK_SIZE];
+    unsigned char* buffer;
     unsigned long checksum;
+    int skipped;
 
-    unsigned long decompressed_size;
-    unsigned long total_extracted;
+    unsigned long long decompressed_size;
     int name_length;
     char* output_file;
     FILE* f;
@@ -445,38 +761,51 @@ int unpack_file(const char* input_file)
     unsigned long compressed_bufsize;
     unsigned long decompressed_bufsize;
 
+    /* the chunks are used where they lie in a mapped archive */
+    const unsigned char* map;
+    const unsigned char* data;
+    int mapped;
+
     /* sanity check */
     in = fopen(input_file, "rb");
     if(!in)
     {
-        printf("Error: could not open %s\n", input_file);
+        snprintf(error, SIXPACK_ERROR_SIZE, "could not open %s", input_file);
         return -1;
     }
 
     /* find size of the file */
-    fseek(in, 0, SEEK_END);
-    fsize = ftell(in);
-    fseek(in, 0, SEEK_SET);
+    SIXPACK_FSEEK(in, 0, SEEK_END);
+    fsize = SIXPACK_FTELL(in);
+    SIXPACK_FSEEK(in, 0, SEEK_SET);
 
     /* not a 6pack archive? */
     if(!detect_magic(in))
     {
         fclose(in);
-        printf("Error: file %s is not a 6pack archive!\n", input_file);
+        snprintf(error, SIXPACK_ERROR_SIZE, "file %s is not a 6pack archive", input_file);
+        return -1;
+    }
+
+    buffer = (unsigned char*)malloc(BLOCK_SIZE);
+    if(!buffer)
+    {
+        fclose(in);
+        snprintf(error, SIXPACK_ERROR_SIZE, "out of memory");
         return -1;
     }
 
-    printf("Archive: %s", input_file);
+    map = use_mmap ? map_file(in, fsize) : 0;
+    advise_sequential(in);
 
     /* position of first chunk */
-    fseek(in, 8, SEEK_SET);
+    SIXPACK_FSEEK(in, 8, SEEK_SET);
 
     /* initialize */
     output_file = 0;
     f = 0;
-    total_extracted = 0;
+    skipped = 0;
     decompressed_size = 0;
-    percent = 0;
     compressed_buffer = 0;
     decompressed_buffer = 0;
     compressed_bufsize = 0;
@@ -486,7 +815,7 @@ int unpack_file(const char* input_file)
     for(;;)
     {
         /* end of file? */
-        size_t pos = ftell(in);
+        unsigned long long pos = SIXPACK_FTELL(in);
         if(pos >= fsize)
             break;
 
@@ -495,35 +824,40 @@ int unpack_file(const char* input_file)
 
         if((chunk_id == 1) && (chunk_size > 10) && (chunk_size < BLOCK_SIZE))
         {
+            unsigned long entry_size;
+
             /* close current file, if any */
-            printf("\n");
             free(output_file);
             output_file = 0;
             if(f)
                 fclose(f);
+            f = 0;
 
             /* file entry */
-            fread(buffer, 1, chunk_size, in);
-            checksum = update_adler32(1L, buffer, chunk_size);
-            if(checksum != chunk_checksum)
+            entry_size = fread(buffer, 1, chunk_size, in);
+            checksum = update_adler32(1L, buffer, entry_size);
+            if(entry_size != chunk_size || checksum != chunk_checksum)
             {
-                free(output_file);
-                output_file = 0;
-                fclose(in);
-                printf("\nError: checksum mismatch!\n");
-                printf("Got %08lX Expecting %08lX\n", checksum, chunk_checksum);
-                return -1;
+                snprintf(error, SIXPACK_ERROR_SIZE,
+                         "checksum mismatch, got %08lX expecting %08lX",
+                         checksum, chunk_checksum);
+                skipped = -1;
+                break;
             }
 
-            decompressed_size = readU32(buffer);
-            total_extracted = 0;
-            percent = 0;
+            decompressed_size = readU64(buffer);
 
             /* get file to extract */
             name_length = (int)readU16(buffer+8);
             if(name_length > (int)chunk_size - 10)
                 name_length = chunk_size - 10;
             output_file = (char*)malloc(name_length+1);
+            if(!output_file)
+            {
+                snprintf(error, SIXPACK_ERROR_SIZE, "out of memory");
+                skipped = -1;
+                break;
+            }
             memset(output_file, 0, name_length+1);
             for(c = 0; c < name_length; c++)
                 output_file[c] = buffer[10+c];
@@ -533,7 +867,8 @@ int unpack_file(const char* input_file)
             if(f)
             {
                 fclose(f);
-                printf("File %s already exists. Skipped.\n", output_file);
+                snprintf(error, SIXPACK_ERROR_SIZE, "file %s already exists, skipped", output_file);
+                skipped++;
                 free(output_file);
                 output_file = 0;
                 f = 0;
@@ -544,35 +879,12 @@ int unpack_file(const char* input_file)
                 f = fopen(output_file, "wb");
                 if(!f)
                 {
-                    printf("Can't create file %s. Skipped.\n", output_file);
+                    snprintf(error, SIXPACK_ERROR_SIZE, "can not create file %s, skipped", output_file);
+                    skipped++;
                     free(output_file);
                     output_file = 0;
                     f = 0;
                 }
-                else
-                {
-                    /* for progress status */
-                    printf("\n");
-                    memset(progress, ' ', 20);
-                    if(strlen(output_file) < 16)
-                        for(c = 0; c < (int)strlen(output_file); c++)
-                            progress[c] = output_file[c];
-                    else
-                    {
-                        for(c = 0; c < 13; c++)
-                            progress[c] = output_file[c];
-                        progress[13] = '.';
-                        progress[14] = '.';
-                        progress[15] = ' ';
-                    }
-                    progress[16] = '[';
-                    progress[17] = 0;
-                    printf("%s", progress);
-                    for(c = 0; c < 50; c++)
-                        printf(".");
-                    printf("]\r");
-                    printf("%s", progress);
-                }
             }
         }
 
@@ -580,42 +892,73 @@ int unpack_file(const char* input_file)
         {
             unsigned long remaining;
 
+            /* a chunk cut short by the end of the archive is read the old way */
+            mapped = map && pos + 16 <= fsize && chunk_size <= fsize - pos - 16;
+
+#ifdef SIXPACK_PARALLEL_UNPACK
+            /* this chunk and the ones after it go to the pool together */
+            if(nworkers > 0)
+            {
+                int status = unpack_chunks_threads(in, map, fsize, &pos, &chunk_size, f,
+                                               output_file, nworkers, error);
+                if(status < 0)
+                {
+                    skipped = -1;
+                    break;
+                }
+                if(status > 0)
+                {
+                    skipped++;
+                    fclose(f);
+                    f = 0;
+                    free(output_file);
+                    output_file = 0;
+                }
+                SIXPACK_FSEEK(in, pos + 16 + chunk_size, SEEK_SET);
+                continue;
+            }
+#endif
+
             /* uncompressed */
             switch(chunk_options)
             {
                 /* stored, simply copy to output */
             case 0:
                 /* read one block at at time, write and update checksum */
-                total_extracted += chunk_size;
                 remaining = chunk_size;
                 checksum = 1L;
                 for(;;)
                 {
                     unsigned long r = (BLOCK_SIZE < remaining) ? BLOCK_SIZE: remaining;
-                    size_t bytes_read = fread(buffer, 1, r, in);
+                    size_t bytes_read = r;
+                    data = mapped ? map + pos + 16 + (chunk_size - remaining) : buffer;
+                    if(!mapped)
+                        bytes_read = fread(buffer, 1, r, in);
                     if(bytes_read == 0)
                         break;
-                    fwrite(buffer, 1, bytes_read, f);
-                    checksum = update_adler32(checksum, buffer, bytes_read);
+                    fwrite(data, 1, bytes_read, f);
+                    checksum = update_adler32(checksum, data, bytes_read);
                     remaining -= bytes_read;
                 }
 
                 /* verify everything is written correctly */
                 if(checksum != chunk_checksum)
                 {
+                    snprintf(error, SIXPACK_ERROR_SIZE,
+                             "checksum mismatch in %s, got %08lX expecting %08lX",
+                             output_file, checksum, chunk_checksum);
+                    skipped++;
                     fclose(f);
                     f = 0;
                     free(output_file);
                     output_file = 0;
-                    printf("\nError: checksum mismatch. Aborted.\n");
-                    printf("Got %08lX Expecting %08lX\n", checksum, chunk_checksum);
                 }
                 break;
 
                 /* compressed using FastLZ */
             case 1:
                 /* enlarge input buffer if necessary */
-                if(chunk_size > compressed_bufsize)
+                if(!mapped && chunk_size > compressed_bufsize)
                 {
                     compressed_bufsize = chunk_size;
                     free(compressed_buffer);
@@ -630,32 +973,42 @@ int unpack_file(const char* input_file)
                     decompressed_buffer = (unsigned char*)malloc(decompressed_bufsize);
                 }
 
-                /* read and check checksum */
-                fread(compressed_buffer, 1, chunk_size, in);
-                checksum = update_adler32(1L, compressed_buffer, chunk_size);
-                total_extracted += chunk_extra;
+                if((!mapped && !compressed_buffer) || !decompressed_buffer)
+                {
+                    snprintf(error, SIXPACK_ERROR_SIZE, "out of memory");
+                    skipped = -1;
+                    break;
+                }
+
+                /* read and check checksum, of what is there of a chunk cut short */
+                data = mapped ? map + pos + 16 : compressed_buffer;
+                remaining = mapped ? chunk_size : fread(compressed_buffer, 1, chunk_size, in);
+                checksum = update_adler32(1L, data, remaining);
 
                 /* verify that the chunk data is correct */
-                if(checksum != chunk_checksum)
+                if(remaining != chunk_size || checksum != chunk_checksum)
                 {
+                    snprintf(error, SIXPACK_ERROR_SIZE,
+                             "checksum mismatch in %s, got %08lX expecting %08lX",
+                             output_file, checksum, chunk_checksum);
+                    skipped++;
                     fclose(f);
                     f = 0;
                     free(output_file);
                     output_file = 0;
-                    printf("\nError: checksum mismatch. Skipped.\n");
-                    printf("Got %08lX Expecting %08lX\n", checksum, chunk_checksum);
                 }
                 else
                 {
                     /* decompress and verify */
-                    remaining = fastlz_decompress(compressed_buffer, chunk_size, decompressed_buffer, chunk_extra);
+                    remaining = fastlz_decompress_fast(data, chunk_size, decompressed_buffer, chunk_extra);
                     if(remaining != chunk_extra)
                     {
+                        snprintf(error, SIXPACK_ERROR_SIZE, "decompression of %s failed", output_file);
+                        skipped++;
                         fclose(f);
                         f = 0;
                         free(output_file);
                         output_file = 0;
-                        printf("\nError: decompression failed. Skipped.\n");
                     }
                     else
                         fwrite(decompressed_buffer, 1, chunk_extra, f);
@@ -663,37 +1016,26 @@ int unpack_file(const char* input_file)
                 break;
 
             default:
-                printf("\nError: unknown compression method (%d)\n", chunk_options);
+                snprintf(error, SIXPACK_ERROR_SIZE, "unknown compression method (%d) in %s",
+                         chunk_options, output_file);
+                skipped++;
                 fclose(f);
                 f = 0;
                 free(output_file);
                 output_file = 0;
                 break;
             }
-
-            /* for progress, if everything is fine */
-            if(f)
-            {
-                int last_percent = (int)percent;
-                if(decompressed_size < (1<<24))
-                    percent = total_extracted * 100 / decompressed_size;
-                else
-                    percent = total_extracted / 256 * 100 / (decompressed_size >>8);
-                percent >>= 1;
-                while(last_percent < (int)percent)
-                {
-                    printf("#");
-                    last_percent++;
-                }
-            }
+            if(skipped < 0)
+                break;
         }
 
         /* position of next chunk */
-        fseek(in, pos + 16 + chunk_size, SEEK_SET);
+        SIXPACK_FSEEK(in, pos + 16 + chunk_size, SEEK_SET);
     }
-    printf("\n\n");
 
     /* free allocated stuff */
+    unmap_file(map, fsize);
+    free(buffer);
     free(compressed_buffer);
     free(decompressed_buffer);
     free(output_file);
@@ -703,177 +1045,3988 @@ int unpack_file(const char* input_file)
         fclose(f);
     fclose(in);
 
-    /* so far so good */
-    return 0;
+    return skipped;
 }
-/*
- * Compress a block of data in the input buffer and returns the size of
- * compressed block. The size of input buffer is specified by length. The
- * minimum input buffer size is 16.
- *
- * The output buffer must be at least 5% larger than the input buffer
- * and can not be smaller than 66 bytes.
- *
- * If the input is not compressible, the return value might be larger than
- * length (input buffer size).
- *
- * The input buffer and the output buffer can not overlap.
- *
- *
- * int fastlz_compress(const void* input, int length, void* output);
- *
- *
- * */
 
 /*
- * Compress a block of data in the input buffer and returns the size of
- * compressed block. The size of input buffer is specified by length. The
- * minimum input buffer size is 16.
- *
- * The output buffer must be at least 5% larger than the input buffer
- * and can not be smaller than 66 bytes.
- *
- * If the input is not compressible, the return value might be larger than
- * length (input buffer size).
- *
- * The input buffer and the output buffer can not overlap.
- *
- * Compression level can be specified in parameter level. At the moment,
- * only level 1 and level 2 are supported.
- *
- * Level 1 is the fastest compression and generally useful for short data.
- * Level 2 is slightly slower but it gives better compression ratio.
- *
- * Note that the compressed data, regardless of the level, can always be
- * decompressed using the function fastlz_decompress above.
- *
- *
- * int fastlz_compress_level(int level, const void* input, int length, void* output);
- *
- * */
-
-static char fastlz_compress_doc[] =
-    "compress(string) -- Compress string using the default compression level,"
-    "returning a new string containing the compressed data.\n\n"
-    "compress(string, level) -- Compress string, using the chosen compression "
-    "level(currently only level 1 and level 2 are supported). \n"
-    "\tLevel 1 is fastest compression and generally useful for short data.\n"
-    "\tLevel 2 is slightly slower but it gives better compression ratio.\n"
-    "and returning a new string containing the compressed data.\n"
-    ;
+ * A file of an archive opened for read_range(): its size and where its
+ * blocks are, in the layout of chunk 18. The blocks come from the index
+ * that chunk 19 at the end of the archive points to when that index is
+ * for this file, otherwise from walking the chunk headers.
+ */
+typedef struct {
+    FILE* in;
+    unsigned long long fsize;
+    char* name;
+    unsigned long long size;
+    unsigned char* index;
+    const unsigned char* blocks;
+    unsigned long count;
+} sixpack_file;
 
-static PyObject *
-compress(PyObject *self, PyObject *args)
+/* 1 if the chunk at pos is the file entry of name, with its size */
+static int sixpack_entry(FILE* in, unsigned long long fsize, unsigned long long pos,
+                         const char* name, unsigned long long* size)
 {
-    PyObject *result = NULL;
-    const char *input = NULL;
-    unsigned char * output = NULL;
-    int level = -1;
-    int length;
-    int osize;
-    if (!PyArg_ParseTuple(args, "s#|i", &input, &length, &level))
-        return NULL;
-#if defined(DEBUG)
-	printf("input : %s, length : %d, level : %d\n", input, length, level);
-#endif
-    if (length < 0)
-        return NULL;
-    output = (unsigned char *) malloc(sizeof(unsigned char)
-                                      * (length * 6 / 5));
-
-    if (output == NULL)
+    unsigned char* buffer;
+    int chunk_id;
+    int chunk_options;
+    unsigned long chunk_size;
+    unsigned long chunk_checksum;
+    unsigned long chunk_extra;
+    int name_length;
+    int found;
+
+    if(pos + 16 > fsize)
+        return 0;
+    SIXPACK_FSEEK(in, pos, SEEK_SET);
+    read_chunk_header(in, &chunk_id, &chunk_options,
+                      &chunk_size, &chunk_checksum, &chunk_extra);
+    if((chunk_id != 1) || (chunk_size <= 10) || (chunk_size >= BLOCK_SIZE))
+        return 0;
+    buffer = (unsigned char*)malloc(chunk_size);
+    if(!buffer)
+        return 0;
+
+    found = 0;
+    if(fread(buffer, 1, chunk_size, in) == chunk_size &&
+       update_adler32(1L, buffer, chunk_size) == chunk_checksum)
+    {
+        name_length = (int)readU16(buffer+8);
+        if(name_length > (int)chunk_size - 10)
+            name_length = chunk_size - 10;
+        /* the stored name ends with its NUL */
+        found = strlen(name) + 1 == (size_t)name_length &&
+                memcmp(buffer+10, name, name_length) == 0;
+        if(found)
+            *size = readU64(buffer);
+    }
+    free(buffer);
+    return found;
+}
+
+/* 1 if chunk 19 leads to an intact chunk 18 for name */
+static int sixpack_find_index(sixpack_file* sf, const char* name)
+{
+    unsigned char buffer[8];
+    int chunk_id;
+    int chunk_options;
+    unsigned long chunk_size;
+    unsigned long chunk_checksum;
+    unsigned long chunk_extra;
+    unsigned long long pos;
+
+    if(sf->fsize < 8 + 16 + 8 + 24)
+        return 0;
+    SIXPACK_FSEEK(sf->in, sf->fsize - 24, SEEK_SET);
+    read_chunk_header(sf->in, &chunk_id, &chunk_options,
+                      &chunk_size, &chunk_checksum, &chunk_extra);
+    if((chunk_id != SIXPACK_FOOTER) || (chunk_size != 8))
+        return 0;
+    if(fread(buffer, 1, 8, sf->in) != 8 || update_adler32(1L, buffer, 8) != chunk_checksum)
+        return 0;
+
+    pos = readU64(buffer);
+    if(pos < 8 || pos > sf->fsize - 24 - 16 - 8)
+        return 0;
+    SIXPACK_FSEEK(sf->in, pos, SEEK_SET);
+    read_chunk_header(sf->in, &chunk_id, &chunk_options,
+                      &chunk_size, &chunk_checksum, &chunk_extra);
+    if((chunk_id != SIXPACK_INDEX) || (chunk_size > sf->fsize - 24 - pos - 16) ||
+       (chunk_size < 8) || ((chunk_size - 8) / 16 != chunk_extra) || ((chunk_size - 8) % 16))
+        return 0;
+
+    sf->index = (unsigned char*)malloc(chunk_size);
+    if(!sf->index)
+        return 0;
+    if(fread(sf->index, 1, chunk_size, sf->in) != chunk_size ||
+       update_adler32(1L, sf->index, chunk_size) != chunk_checksum ||
+       !sixpack_entry(sf->in, sf->fsize, readU64(sf->index), name, &sf->size))
+    {
+        free(sf->index);
+        sf->index = 0;
+        return 0;
+    }
+
+    sf->blocks = sf->index + 8;
+    sf->count = chunk_extra;
+    return 1;
+}
+
+/* lists the blocks of the first file called name, 0 if there is none */
+static int sixpack_scan(sixpack_file* sf, const char* name, char* error)
+{
+    int chunk_id;
+    int chunk_options;
+    unsigned long chunk_size;
+    unsigned long chunk_checksum;
+    unsigned long chunk_extra;
+    unsigned long long pos;
+    unsigned long long file_offset;
+    unsigned long capacity;
+    int found;
+
+    found = 0;
+    file_offset = 0;
+    capacity = 0;
+    for(pos = 8; pos + 16 <= sf->fsize; pos += 16 + chunk_size)
+    {
+        SIXPACK_FSEEK(sf->in, pos, SEEK_SET);
+        read_chunk_header(sf->in, &chunk_id, &chunk_options,
+                          &chunk_size, &chunk_checksum, &chunk_extra);
+        if(chunk_id == 1)
+        {
+            if(found)
+                break;
+            found = sixpack_entry(sf->in, sf->fsize, pos, name, &sf->size);
+        }
+        if((chunk_id == 17) && found)
+        {
+            if(sf->count == capacity)
+            {
+                unsigned long grown = capacity ? 2 * capacity : 64;
+                unsigned char* index = (unsigned char*)realloc(sf->index, grown * 16);
+                if(!index)
+                {
+                    snprintf(error, SIXPACK_ERROR_SIZE, "out of memory");
+                    return -1;
+                }
+                sf->index = index;
+                capacity = grown;
+            }
+            writeU64(sf->index + 16 * sf->count, file_offset);
+            writeU64(sf->index + 16 * sf->count + 8, pos);
+            sf->count++;
+            file_offset += (chunk_options == 0) ? chunk_size : chunk_extra;
+        }
+    }
+
+    sf->blocks = sf->index;
+    return found;
+}
+
+static int sixpack_open(sixpack_file* sf, const char* archive_file, const char* name,
+                        char* error)
+{
+    int found;
+
+    memset(sf, 0, sizeof(*sf));
+    sf->in = fopen(archive_file, "rb");
+    if(!sf->in)
+    {
+        snprintf(error, SIXPACK_ERROR_SIZE, "could not open %s", archive_file);
+        return -1;
+    }
+
+    SIXPACK_FSEEK(sf->in, 0, SEEK_END);
+    sf->fsize = SIXPACK_FTELL(sf->in);
+    SIXPACK_FSEEK(sf->in, 0, SEEK_SET);
+
+    if(!detect_magic(sf->in))
+    {
+        snprintf(error, SIXPACK_ERROR_SIZE, "file %s is not a 6pack archive", archive_file);
+        fclose(sf->in);
+        return -1;
+    }
+
+    found = sixpack_find_index(sf, name) ? 1 : sixpack_scan(sf, name, error);
+    if(found > 0)
+        sf->name = strdup(name);
+    if(found == 0)
+        snprintf(error, SIXPACK_ERROR_SIZE, "%s is not in %s", name, archive_file);
+    else if(!sf->name)
+        snprintf(error, SIXPACK_ERROR_SIZE, "out of memory");
+    if(!sf->name)
+    {
+        free(sf->index);
+        fclose(sf->in);
+        return -1;
+    }
+    return 0;
+}
+
+static void sixpack_close(sixpack_file* sf)
+{
+    free(sf->name);
+    free(sf->index);
+    fclose(sf->in);
+}
+
+/* output gets the length bytes at offset, which sixpack_open() said are in the file */
+static int sixpack_read(sixpack_file* sf, unsigned long long offset, size_t length,
+                        unsigned char* output, char* error)
+{
+    int chunk_id;
+    int chunk_options;
+    unsigned long chunk_size;
+    unsigned long chunk_checksum;
+    unsigned long chunk_extra;
+    unsigned long checksum;
+    unsigned long lo, hi;
+    unsigned long long file_offset;
+    unsigned long long pos;
+    unsigned char* compressed_buffer;
+    unsigned char* decompressed_buffer;
+    unsigned long compressed_bufsize;
+    unsigned long decompressed_bufsize;
+    const unsigned char* data;
+    unsigned long n;
+    int status;
+
+    /* the last block that starts at or before offset */
+    lo = 0;
+    hi = sf->count;
+    while(hi - lo > 1)
+    {
+        unsigned long mid = lo + (hi - lo) / 2;
+        if(readU64(sf->blocks + 16 * mid) <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    compressed_buffer = 0;
+    decompressed_buffer = 0;
+    compressed_bufsize = 0;
+    decompressed_bufsize = 0;
+    status = 0;
+
+    for(; length > 0; lo++)
+    {
+        if(lo >= sf->count)
+        {
+            snprintf(error, SIXPACK_ERROR_SIZE, "%s is truncated", sf->name);
+            status = -1;
+            break;
+        }
+        file_offset = readU64(sf->blocks + 16 * lo);
+        pos = readU64(sf->blocks + 16 * lo + 8);
+        if(file_offset > offset || pos > sf->fsize - 16)
+        {
+            snprintf(error, SIXPACK_ERROR_SIZE, "block index of %s is damaged", sf->name);
+            status = -1;
+            break;
+        }
+
+        SIXPACK_FSEEK(sf->in, pos, SEEK_SET);
+        read_chunk_header(sf->in, &chunk_id, &chunk_options,
+                          &chunk_size, &chunk_checksum, &chunk_extra);
+        if(chunk_id != 17)
+        {
+            snprintf(error, SIXPACK_ERROR_SIZE, "block index of %s is damaged", sf->name);
+            status = -1;
+            break;
+        }
+
+        /* enlarge buffers if necessary */
+        if(chunk_size > compressed_bufsize)
+        {
+            compressed_bufsize = chunk_size;
+            free(compressed_buffer);
+            compressed_buffer = (unsigned char*)malloc(compressed_bufsize);
+        }
+        if(chunk_options == 1 && chunk_extra > decompressed_bufsize)
+        {
+            decompressed_bufsize = chunk_extra;
+            free(decompressed_buffer);
+            decompressed_buffer = (unsigned char*)malloc(decompressed_bufsize);
+        }
+        if((chunk_size && !compressed_buffer) ||
+           (chunk_options == 1 && !decompressed_buffer))
+        {
+            snprintf(error, SIXPACK_ERROR_SIZE, "out of memory");
+            status = -1;
+            break;
+        }
+
+        /* read and check checksum */
+        n = fread(compressed_buffer, 1, chunk_size, sf->in);
+        checksum = update_adler32(1L, compressed_buffer, n);
+        if(n != chunk_size || checksum != chunk_checksum)
+        {
+            snprintf(error, SIXPACK_ERROR_SIZE,
+                     "checksum mismatch in %s, got %08lX expecting %08lX",
+                     sf->name, checksum, chunk_checksum);
+            status = -1;
+            break;
+        }
+
+        switch(chunk_options)
+        {
+            /* stored */
+        case 0:
+            data = compressed_buffer;
+            break;
+
+            /* compressed using FastLZ */
+        case 1:
+            n = fastlz_decompress_fast(compressed_buffer, chunk_size, decompressed_buffer,
+                                       chunk_extra);
+            if(n != chunk_extra)
+            {
+                snprintf(error, SIXPACK_ERROR_SIZE, "decompression of %s failed", sf->name);
+                status = -1;
+            }
+            data = decompressed_buffer;
+            break;
+
+        default:
+            snprintf(error, SIXPACK_ERROR_SIZE, "unknown compression method (%d) in %s",
+                     chunk_options, sf->name);
+            status = -1;
+            break;
+        }
+        if(status != 0)
+            break;
+
+        /* the part of the block that is in the range */
+        if(offset - file_offset < n)
+        {
+            size_t skip = (size_t)(offset - file_offset);
+            size_t take = (n - skip < length) ? n - skip : length;
+            memcpy(output, data + skip, take);
+            output += take;
+            offset += take;
+            length -= take;
+        }
+    }
+
+    free(compressed_buffer);
+    free(decompressed_buffer);
+    return status;
+}
+
+/*
+ * Compress a block of data in the input buffer and returns the size of
+ * compressed block. The size of input buffer is specified by length. The
+ * minimum input buffer size is 16.
+ *
+ * The output buffer must be at least 5% larger than the input buffer
+ * and can not be smaller than 66 bytes.
+ *
+ * If the input is not compressible, the return value might be larger than
+ * length (input buffer size).
+ *
+ * The input buffer and the output buffer can not overlap.
+ *
+ *
+ * int fastlz_compress(const void* input, int length, void* output);
+ *
+ *
+ * */
+
+/*
+ * Compress a block of data in the input buffer and returns the size of
+ * compressed block. The size of input buffer is specified by length. The
+ * minimum input buffer size is 16.
+ *
+ * The output buffer must be at least 5% larger than the input buffer
+ * and can not be smaller than 66 bytes.
+ *
+ * If the input is not compressible, the return value might be larger than
+ * length (input buffer size).
+ *
+ * The input buffer and the output buffer can not overlap.
+ *
+ * Compression level can be specified in parameter level. At the moment,
+ * level 1 to level 4 are supported.
+ *
+ * Level 1 is the fastest compression and generally useful for short data.
+ * Level 2 is slightly slower but it gives better compression ratio.
+ * Level 3 and level 4 are much slower, compress better and produce level 2
+ * data.
+ *
+ * Note that the compressed data, regardless of the level, can always be
+ * decompressed using the function fastlz_decompress above.
+ *
+ *
+ * int fastlz_compress_level(int level, const void* input, int length, void* output);
+ *
+ * */
+
+static char fastlz_compress_doc[] =
+    "compress(string) -- Compress string using the default compression level,"
+    "returning a new string containing the compressed data.\n\n"
+    "compress(string, level) -- Compress string, using the chosen compression "
+    "level(currently level 1 to level 4 are supported, others raise ValueError). \n"
+    "\tLevel 1 is fastest compression and generally useful for short data.\n"
+    "\tLevel 2 is slightly slower but it gives better compression ratio.\n"
+    "\tLevel 3 and 4 are much slower but compress better still, the result "
+    "decompresses as fast as level 2.\n"
+    "and returning a new string containing the compressed data.\n"
+    "Data that does not compress is stored as it is, one byte longer.\n"
+    "Any object with the buffer interface (str, bytearray, memoryview, mmap, "
+    "array) can be passed instead of a string, here and in decompress().\n"
+    "Strings larger than 1 MB without a dict are cut into independently "
+    "compressed blocks, so there is no limit on their size.\n"
+    "compress(string, level, dict, frame=True[, checksum=True]) -- Put a "
+    "small header with the decompressed size (and an Adler-32 of the data) in "
+    "front, so decompress() and decompressed_size() need not guess. It also "
+    "records which dict was used, so decompressing without it or with "
+    "another one raises instead of returning wrong data.\n"
+    "compress(string, threads=n) -- Compress the blocks of a string larger "
+    "than 1 MB on up to n threads. The result is the same.\n"
+    "compress(string, block_size=n) -- Cut a string larger than n bytes into "
+    "blocks of n bytes instead of 1 MB, a power of two from 4096 on. Smaller "
+    "blocks compress a little worse but make decompress_range() cheaper.\n"
+    "compress(array, shuffle=True) -- Group the bytes of a typed array by "
+    "their position in each item before compressing, which helps numeric "
+    "data a lot. shuffle=n sets the item size of any buffer. The result is "
+    "framed and decompress() undoes the shuffle.\n"
+    ;
+
+/*
+ * The codec runs without the GIL, on buffers pinned with "s*". Like hashlib
+ * it keeps the GIL for small inputs, where dropping it costs more than the
+ * work. The compressor objects have a lock of their own, the same way the
+ * zlib module does it, so they can be shared between threads.
+ * */
+#define GIL_MINSIZE 2048
+
+#define BEGIN_CODEC(length) \
+    { PyThreadState *_save = ((length) >= GIL_MINSIZE) ? PyEval_SaveThread() : NULL;
+#define END_CODEC \
+    if (_save) PyEval_RestoreThread(_save); }
+
+#ifdef WITH_THREAD
+#define ENTER_OBJECT(obj) \
+    if (!PyThread_acquire_lock((obj)->lock, 0)) { \
+        Py_BEGIN_ALLOW_THREADS \
+        PyThread_acquire_lock((obj)->lock, 1); \
+        Py_END_ALLOW_THREADS \
+    }
+#define LEAVE_OBJECT(obj) PyThread_release_lock((obj)->lock);
+#define OBJECT_LOCK PyThread_type_lock lock;
+#define INIT_OBJECT_LOCK(obj) (((obj)->lock = PyThread_allocate_lock()) != NULL)
+#define FREE_OBJECT_LOCK(obj) if ((obj)->lock) PyThread_free_lock((obj)->lock);
+#else
+#define ENTER_OBJECT(obj)
+#define LEAVE_OBJECT(obj)
+#define OBJECT_LOCK
+#define INIT_OBJECT_LOCK(obj) 1
+#define FREE_OBJECT_LOCK(obj)
+#endif
+
+/*
+ * A Compressor owns a fastlz_ctx, so its hash table is set up only once
+ * instead of on every call.
+ * */
+typedef struct {
+    PyObject_HEAD
+    fastlz_ctx *ctx;
+    int level;
+    int has_dict;
+    OBJECT_LOCK
+} CompressorObject;
+
+static PyTypeObject CompressorType;
+
+/* level -1 picks the level the same way fastlz_compress does */
+static int
+compress_level(int level, Py_ssize_t length)
+{
+    if ((level < 1) || (level > 4))
+        level = (length < 65536) ? 1 : 2;
+    return level;
+}
+
+/* levels 1 to 4, and -1 where the caller may leave it to compress_level */
+static int
+check_level(int level, int allow_default)
+{
+    if ((level >= 1 && level <= 4) || (allow_default && level == -1))
+        return 1;
+    PyErr_SetString(PyExc_ValueError, "level must be 1 to 4");
+    return 0;
+}
+
+/*
+ * Process-wide codec statistics for fastlz.stats(), per entry point and
+ * compression level. The thread that made a call counts it once it has the
+ * GIL back, the pool workers never do, so the GIL guards the counters.
+ * Timing reads the clock twice per call, more than the counting costs, so
+ * it waits for stats_timing(True). -DFASTLZ_NO_STATS leaves the counting
+ * out.
+ * */
+enum {
+    STAT_COMPRESS,
+    STAT_DECOMPRESS,
+    STAT_COMPRESS_INTO,
+    STAT_DECOMPRESS_INTO,
+    STAT_COMPRESS_BATCH,
+    STAT_DECOMPRESS_BATCH,
+    STAT_DECOMPRESS_RANGE,
+    STAT_FUNCTIONS
+};
+
+static const char *stats_names[STAT_FUNCTIONS] = {
+    "compress", "decompress", "compress_into", "decompress_into",
+    "compress_batch", "decompress_batch", "decompress_range"
+};
+
+/* level 0 is decompression, or a batch left to pick its levels */
+#define STAT_LEVELS 5
+/* bucket i of the latency histogram counts the calls of 2^i to 2^(i+1) - 1 ns */
+#define STAT_BUCKETS 32
+
+typedef struct {
+    unsigned long long calls;
+    unsigned long long failures;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long nanoseconds;
+    unsigned long long histogram[STAT_BUCKETS];
+} codec_stats;
+
+static codec_stats stats_table[STAT_FUNCTIONS][STAT_LEVELS];
+static int stats_timing_on = 0;
+
+#ifndef FASTLZ_NO_STATS
+static unsigned long long
+stats_clock(void)
+{
+#if defined(SIXPACK_BENCHMARK_WIN32)
+    LARGE_INTEGER now, frequency;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+    return (unsigned long long)((double)now.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+#endif
+}
+
+/* when a call started, 0 with timing off; read with the GIL held */
+#define STATS_START() (stats_timing_on ? stats_clock() : 0)
+
+/* bytes count only for calls that succeed, so the ratio stays meaningful; hold the GIL */
+static void
+stats_record(int function, int level, Py_ssize_t bytes_in, Py_ssize_t bytes_out, int failed,
+             unsigned long long start)
+{
+    codec_stats *stats = &stats_table[function][(level > 0 && level < STAT_LEVELS) ? level : 0];
+    unsigned long long elapsed;
+    int bucket;
+
+    stats->calls++;
+    if (failed)
+        stats->failures++;
+    else {
+        stats->bytes_in += (unsigned long long)bytes_in;
+        stats->bytes_out += (unsigned long long)bytes_out;
+    }
+    if (start != 0) {
+        elapsed = stats_clock() - start;
+        for (bucket = 0; bucket < STAT_BUCKETS - 1 && (elapsed >> (bucket + 1)) != 0; bucket++)
+            ;
+        stats->nanoseconds += elapsed;
+        stats->histogram[bucket]++;
+    }
+}
+#else
+#define STATS_START() 0
+
+static inline void
+stats_record(int function, int level, Py_ssize_t bytes_in, Py_ssize_t bytes_out, int failed,
+             unsigned long long start)
+{
+}
+#endif
+
+/* the size of a result string, for stats_record */
+#define RESULT_SIZE(result) ((result) != NULL ? PyString_GET_SIZE(result) : 0)
+
+/*
+ * Data that does not compress is stored as it is, behind a marker byte.
+ * Compressed data starts with level 1 or 2 in the top 3 bits, never 7.
+ * */
+#define STORED_MARKER 0xe0
+
+/* from this size on fastlz_compress_bounded pays for its own table setup */
+#define BOUNDED_MIN 8192
+
+/* the container magic, its 'F' can not start a block or a stored string */
+#define IS_BLOCKS(input, isize) \
+    ((isize) >= FASTLZ_BLOCKS_HEADER && memcmp((input), "FLZB", 4) == 0)
+
+/* no format expands more than about 255 times, so a larger size is corrupt */
+#define PLAUSIBLE_SIZE(size, isize) ((size) / 256 <= (unsigned long long)(isize))
+
+/*
+ * The result string is allocated once with room for the worst case, the
+ * codec writes straight into it and it is shrunk to fit afterwards. Data
+ * that did not compress is stored in the same string.
+ * */
+#define COMPRESS_BOUND(length) ((size_t)(length) + (length) / 16 + 66)
+
+static PyObject *
+finish_compressed(PyObject *result, Py_ssize_t head, const char *input, Py_ssize_t length,
+                  int osize)
+{
+    if (osize <= 0 || osize > length) {
+        PyString_AS_STRING(result)[head] = (char)STORED_MARKER;
+        memcpy(PyString_AS_STRING(result) + head + 1, input, length);
+        osize = (int)length + 1;
+    }
+    if (_PyString_Resize(&result, head + osize) < 0)
+        return NULL;
+    return result;
+}
+
+/*
+ * The compress helpers below leave the first head bytes of the result
+ * alone, for a frame header.
+ * */
+
+/*
+ * Input larger than one block goes into the block container, which has no
+ * 2 GB limit. Blocks that do not compress are stored inside the container.
+ * */
+static PyObject *
+compress_blocks(int level, size_t block_size, Py_ssize_t head, const char *input,
+                Py_ssize_t length)
+{
+    PyObject *result;
+    size_t bound;
+    size_t osize;
+
+    bound = fastlz_blocks_bound((size_t)length);
+    if (bound > PY_SSIZE_T_MAX - head)
+        return PyErr_NoMemory();
+    result = PyString_FromStringAndSize(NULL, head + (Py_ssize_t)bound);
+    if (result == NULL)
+        return NULL;
+    level = compress_level(level, length);
+    BEGIN_CODEC(length)
+    osize = fastlz_compress_blocks_sized(level, block_size, input, (size_t)length,
+                                         PyString_AS_STRING(result) + head, bound);
+    END_CODEC
+    if (osize == 0) {
+        Py_DECREF(result);
+        PyErr_SetString(FastlzError, "compression failed");
+        return NULL;
+    }
+    if (_PyString_Resize(&result, head + (Py_ssize_t)osize) < 0)
+        return NULL;
+    return result;
+}
+
+/* the same on the worker pool, see compress_blocks_threads */
+static PyObject *compress_blocks_threads(int level, size_t block_size, Py_ssize_t head,
+                                         const char *input, Py_ssize_t length, int nthreads);
+static int decompress_blocks_threads(const char *input, Py_ssize_t isize, char *output,
+                                     size_t content, int nthreads);
+
+/* larger input without a dictionary goes to fastlz_compress_bounded */
+static PyObject *
+compress_with_ctx(fastlz_ctx *ctx, int level, int has_dict, Py_ssize_t head,
+                  const char *input, Py_ssize_t length)
+{
+    PyObject *result;
+    char *output;
+    int osize;
+
+    if (length < 0)
+        return NULL;
+    if (length == 0)
+        return PyString_FromStringAndSize(NULL, head);
+    if (!has_dict && length > FASTLZ_BLOCK_SIZE)
+        return compress_blocks(level, FASTLZ_BLOCK_SIZE, head, input, length);
+    if (length > INT_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "input too large for a dictionary");
+        return NULL;
+    }
+    result = PyString_FromStringAndSize(NULL, head + (Py_ssize_t)COMPRESS_BOUND(length));
+    if (result == NULL)
+        return NULL;
+    output = PyString_AS_STRING(result) + head;
+
+    level = compress_level(level, length);
+    BEGIN_CODEC(length)
+    if (!has_dict && length >= BOUNDED_MIN)
+        osize = fastlz_compress_bounded_room(level, input, (int)length, output, (int)length,
+                                             COMPRESS_BOUND(length));
+    else
+        osize = fastlz_compress_with_ctx(ctx, level, input, (int)length, output);
+    END_CODEC
+    return finish_compressed(result, head, input, length, osize);
+}
+
+/*
+ * compress() keeps one Compressor per thread in the thread state dict, it
+ * goes away together with the thread.
+ * */
+static fastlz_ctx *
+thread_ctx(void)
+{
+    PyObject *tdict;
+    PyObject *obj;
+
+    tdict = PyThreadState_GetDict();
+    if (tdict == NULL) {
+        PyErr_SetString(FastlzError, "no thread state");
+        return NULL;
+    }
+    obj = PyDict_GetItem(tdict, ctx_key);
+    if (obj == NULL) {
+        obj = PyObject_CallObject((PyObject *)&CompressorType, NULL);
+        if (obj == NULL)
+            return NULL;
+        if (PyDict_SetItem(tdict, ctx_key, obj) < 0) {
+            Py_DECREF(obj);
+            return NULL;
+        }
+        Py_DECREF(obj);
+    }
+    return ((CompressorObject *)obj)->ctx;
+}
+
+/* a dictionary is indexed on every call here, Compressor(dict=...) does it once */
+static PyObject *
+compress_dict(int level, const char *dict, int dict_len, Py_ssize_t head,
+              const char *input, Py_ssize_t length)
+{
+    PyObject *result;
+    int osize;
+
+    if (length == 0)
+        return PyString_FromStringAndSize(NULL, head);
+    if (length > INT_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "input too large for a dictionary");
+        return NULL;
+    }
+    result = PyString_FromStringAndSize(NULL, head + (Py_ssize_t)COMPRESS_BOUND(length));
+    if (result == NULL)
+        return NULL;
+
+    level = compress_level(level, length);
+    BEGIN_CODEC(length)
+    osize = fastlz_compress_dict(level, dict, dict_len, input, (int)length,
+                                 PyString_AS_STRING(result) + head);
+    END_CODEC
+    return finish_compressed(result, head, input, length, osize);
+}
+
+/* only the last FASTLZ_DICT_MAX bytes of a dictionary are ever used */
+static int
+dict_tail(const char **dict, Py_ssize_t dict_len)
+{
+    if (*dict == NULL)
+        return 0;
+    if (dict_len > FASTLZ_DICT_MAX) {
+        *dict += dict_len - FASTLZ_DICT_MAX;
+        dict_len = FASTLZ_DICT_MAX;
+    }
+    return (int)dict_len;
+}
+
+static void
+write_u32(unsigned char *ptr, unsigned long v)
+{
+    ptr[0] = v & 255;
+    ptr[1] = (v >> 8) & 255;
+    ptr[2] = (v >> 16) & 255;
+    ptr[3] = (v >> 24) & 255;
+}
+
+/*
+ * The optional frame makes the data self-describing:
+ *
+ *   magic     FRAME_MAGIC, its top bits 100 start no other format
+ *   flags     level in bits 0-2, FRAME_CHECKSUM, FRAME_SHUFFLE, FRAME_DICT,
+ *             the other bits are 0
+ *   size      decompressed size as a LEB128 varint
+ *   itemsize  item size of the byte shuffle, one byte, only with
+ *             FRAME_SHUFFLE
+ *   dict      Adler-32 of the dictionary the body needs, only with
+ *             FRAME_DICT, 32-bit little-endian
+ *   checksum  Adler-32 of the decompressed data, only with FRAME_CHECKSUM,
+ *             32-bit little-endian
+ *   body      what compress() returns without a frame, for the shuffled
+ *             data with FRAME_SHUFFLE
+ *
+ * With the size known, decompress() allocates the result exactly once.
+ * Like zlib's DICTID, the dictionary checksum turns a missing or wrong
+ * dictionary into an error instead of wrong data.
+ * */
+#define FRAME_MAGIC 0x8c
+#define FRAME_CHECKSUM 0x08
+#define FRAME_SHUFFLE 0x10
+#define FRAME_DICT 0x20
+#define FRAME_HEADER_MAX (2 + 10 + 1 + 4 + 4)
+
+typedef struct {
+    unsigned long long size;
+    unsigned long checksum;
+    unsigned long dict_id;
+    int has_checksum;
+    int has_dict;
+    int itemsize;
+    const char *body;
+    Py_ssize_t body_len;
+} frame_info;
+
+/* Adler-32 over any length, the kernels take an int */
+static unsigned long
+frame_checksum(const char *input, Py_ssize_t length)
+{
+    unsigned long checksum = 1L;
+    while (length > 0) {
+        int chunk = (length > (1 << 30)) ? (1 << 30) : (int)length;
+        checksum = update_adler32(checksum, input, chunk);
+        input += chunk;
+        length -= chunk;
+    }
+    return checksum;
+}
+
+/* dict is NULL for data compressed without one */
+static Py_ssize_t
+frame_header(unsigned char *out, int level, int has_checksum, unsigned long long size,
+             unsigned long checksum, int itemsize, const char *dict, int dict_len)
+{
+    Py_ssize_t pos = 2;
+
+    out[0] = FRAME_MAGIC;
+    out[1] = (unsigned char)(level | (has_checksum ? FRAME_CHECKSUM : 0) |
+                             (itemsize > 1 ? FRAME_SHUFFLE : 0) |
+                             (dict != NULL ? FRAME_DICT : 0));
+    do {
+        out[pos] = (unsigned char)(size & 0x7f);
+        size >>= 7;
+        if (size)
+            out[pos] |= 0x80;
+        pos++;
+    } while (size);
+    if (itemsize > 1)
+        out[pos++] = (unsigned char)itemsize;
+    if (dict != NULL) {
+        write_u32(out + pos, frame_checksum(dict, dict_len));
+        pos += 4;
+    }
+    if (has_checksum) {
+        write_u32(out + pos, checksum);
+        pos += 4;
+    }
+    return pos;
+}
+
+/* returns 0 if this is not a well-formed frame header */
+static int
+parse_frame(const char *input, Py_ssize_t isize, frame_info *frame)
+{
+    const unsigned char *ip = (const unsigned char *)input;
+    Py_ssize_t pos = 2;
+    int shift = 0;
+
+    if (isize < 3 || ip[0] != FRAME_MAGIC ||
+        (ip[1] & ~(FRAME_CHECKSUM | FRAME_SHUFFLE | FRAME_DICT | 7)))
+        return 0;
+    frame->size = 0;
+    for (;;) {
+        if (pos >= isize || shift > 63)
+            return 0;
+        frame->size |= (unsigned long long)(ip[pos] & 0x7f) << shift;
+        shift += 7;
+        if (!(ip[pos++] & 0x80))
+            break;
+    }
+    frame->itemsize = 1;
+    if (ip[1] & FRAME_SHUFFLE) {
+        if (pos >= isize || ip[pos] < 2)
+            return 0;
+        frame->itemsize = ip[pos++];
+    }
+    frame->has_dict = (ip[1] & FRAME_DICT) != 0;
+    frame->dict_id = 0;
+    if (frame->has_dict) {
+        if (isize - pos < 4)
+            return 0;
+        frame->dict_id = readU32(ip + pos) & 0xffffffff;
+        pos += 4;
+    }
+    frame->has_checksum = (ip[1] & FRAME_CHECKSUM) != 0;
+    frame->checksum = 0;
+    if (frame->has_checksum) {
+        if (isize - pos < 4)
+            return 0;
+        frame->checksum = readU32(ip + pos) & 0xffffffff;
+        pos += 4;
+    }
+    frame->body = input + pos;
+    frame->body_len = isize - pos;
+    return 1;
+}
+
+/* decodes the body of a frame into output, exactly frame->size bytes */
+static const char *
+decode_body(const frame_info *frame, const char *dict, int dict_len, char *output)
+{
+    const char *body = frame->body;
+    Py_ssize_t body_len = frame->body_len;
+    Py_ssize_t size = (Py_ssize_t)frame->size;
+
+    if (size == 0) {
+        if (body_len != 0)
+            return "corrupt input";
+    }
+    else if (body_len > 0 && (unsigned char)body[0] == STORED_MARKER) {
+        if (body_len - 1 != size)
+            return "corrupt input";
+        memcpy(output, body + 1, size);
+    }
+    else if (IS_BLOCKS(body, body_len)) {
+        if (fastlz_decompress_blocks(body, (size_t)body_len, output, (size_t)size)
+            != (size_t)size)
+            return "corrupt input";
+    }
+    else {
+        int osize;
+        if (body_len > INT_MAX || size > INT_MAX)
+            return "corrupt input";
+        if (dict != NULL)
+            osize = fastlz_decompress_dict(dict, dict_len, body, (int)body_len,
+                                           output, (int)size);
+        else
+            osize = fastlz_decompress_fast(body, (int)body_len, output, (int)size);
+        if (osize != size)
+            return "corrupt input or wrong dictionary";
+    }
+    return NULL;
+}
+
+/*
+ * Decodes a frame into output, which has room for exactly frame->size
+ * bytes. Shuffled data is decoded next to it first. Returns NULL or what
+ * went wrong. Runs without the GIL.
+ * */
+static const char *
+decode_frame(const frame_info *frame, const char *dict, int dict_len, char *output)
+{
+    Py_ssize_t size = (Py_ssize_t)frame->size;
+    const char *error;
+
+    if (frame->has_dict && dict == NULL)
+        return "data needs a dictionary";
+    if (frame->has_dict && frame_checksum(dict, dict_len) != frame->dict_id)
+        return "wrong dictionary";
+    if (frame->itemsize > 1 && size > 0) {
+        char *shuffled = (char *)malloc(size);
+        if (shuffled == NULL)
+            return "out of memory";
+        error = decode_body(frame, dict, dict_len, shuffled);
+        if (error == NULL)
+            fastlz_unshuffle(frame->itemsize, shuffled, (size_t)size, output);
+        free(shuffled);
+    }
+    else
+        error = decode_body(frame, dict, dict_len, output);
+    if (error == NULL && frame->has_checksum && frame_checksum(output, size) != frame->checksum)
+        error = "checksum mismatch";
+    return error;
+}
+
+/* the item size of an array, from its buffer format or its itemsize attribute */
+static Py_ssize_t
+buffer_itemsize(PyObject *obj)
+{
+    Py_buffer view;
+    PyObject *v;
+    Py_ssize_t itemsize = 1;
+
+    if (PyObject_CheckBuffer(obj) &&
+        PyObject_GetBuffer(obj, &view, PyBUF_ND | PyBUF_FORMAT) == 0) {
+        itemsize = view.itemsize;
+        PyBuffer_Release(&view);
+        return itemsize;
+    }
+    PyErr_Clear();
+    /* array.array has only the old buffer interface in Python 2 */
+    v = PyObject_GetAttrString(obj, "itemsize");
+    if (v != NULL) {
+        itemsize = PyInt_AsSsize_t(v);
+        Py_DECREF(v);
+    }
+    if (PyErr_Occurred()) {
+        PyErr_Clear();
+        itemsize = 1;
+    }
+    return itemsize;
+}
+
+static PyObject *
+compress(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"string", "level", "dict", "frame", "checksum", "threads",
+                             "block_size", "shuffle", NULL};
+    PyObject *result = NULL;
+    PyObject *string;
+    PyObject *arg;
+    PyObject *shuffle = NULL;
+    Py_buffer input = {NULL};
+    Py_buffer dict = {NULL};
+    unsigned char header[FRAME_HEADER_MAX];
+    const char *data;
+    char *shuffled = NULL;
+    const char *d = NULL;
+    int dict_len = 0;
+    Py_ssize_t head = 0;
+    Py_ssize_t block_size = 0;
+    Py_ssize_t itemsize = 1;
+    fastlz_ctx *ctx;
+    unsigned long long start = STATS_START();
+    int level = -1;
+    int frame = 0;
+    int checksum = 0;
+    int nthreads = 1;
+
+    /*
+     * compress(str) and compress(str, level) skip the argument parser and the
+     * buffer protocol; for short strings those cost more than compressing.
+     */
+    if (kwds == NULL && PyTuple_GET_SIZE(args) <= 2 && PyTuple_GET_SIZE(args) >= 1 &&
+        PyString_CheckExact(PyTuple_GET_ITEM(args, 0))) {
+        string = PyTuple_GET_ITEM(args, 0);
+        if (PyTuple_GET_SIZE(args) == 2) {
+            arg = PyTuple_GET_ITEM(args, 1);
+            if (!PyInt_CheckExact(arg) || PyInt_AS_LONG(arg) != (int)PyInt_AS_LONG(arg))
+                goto parse;
+            level = (int)PyInt_AS_LONG(arg);
+            if (!check_level(level, 1))
+                return NULL;
+        }
+        if ((ctx = thread_ctx()) == NULL)
+            return NULL;
+        result = compress_with_ctx(ctx, level, 0, 0, PyString_AS_STRING(string),
+                                   PyString_GET_SIZE(string));
+        stats_record(STAT_COMPRESS, compress_level(level, PyString_GET_SIZE(string)),
+                     PyString_GET_SIZE(string), RESULT_SIZE(result), result == NULL, start);
+        return result;
+    }
+parse:
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iz*iiinO", kwlist, &string,
+                                     &level, &dict, &frame, &checksum, &nthreads,
+                                     &block_size, &shuffle))
+        return NULL;
+    if (!check_level(level, 1))
+        goto done;
+    if (!PyArg_Parse(string, "s*;compress() argument 1 must be a string or buffer", &input))
+        goto done;
+    if (block_size != 0 && (block_size < FASTLZ_BLOCK_MIN || block_size > FASTLZ_BLOCK_SIZE ||
+                            (block_size & (block_size - 1)) != 0)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "block_size must be a power of two from 4096 to 1048576");
+        goto done;
+    }
+    if (block_size == 0 || input.len <= block_size)
+        block_size = FASTLZ_BLOCK_SIZE;
+
+    /* shuffle=True takes the item size from the array, the frame records it */
+    if (shuffle != NULL && shuffle != Py_None) {
+        if (PyBool_Check(shuffle))
+            itemsize = (shuffle == Py_True) ? buffer_itemsize(string) : 1;
+        else {
+            itemsize = PyInt_AsSsize_t(shuffle);
+            if (itemsize == -1 && PyErr_Occurred())
+                goto done;
+        }
+        if (itemsize < 1 || itemsize > 255) {
+            PyErr_SetString(PyExc_ValueError, "shuffle item size must be 1 to 255");
+            goto done;
+        }
+    }
+    data = (const char *)input.buf;
+    if (dict.buf != NULL && dict.len > 0) {
+        d = (const char *)dict.buf;
+        dict_len = dict_tail(&d, dict.len);
+    }
+    if (itemsize > 1 && input.len > 0) {
+        shuffled = (char *)PyMem_Malloc(input.len);
+        if (shuffled == NULL) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        BEGIN_CODEC(input.len)
+        fastlz_shuffle((int)itemsize, input.buf, (size_t)input.len, shuffled);
+        END_CODEC
+        data = shuffled;
+        frame = 1;
+    }
+    if (frame) {
+        unsigned long sum = 0;
+        if (checksum) {
+            BEGIN_CODEC(input.len)
+            sum = frame_checksum((const char *)input.buf, input.len);
+            END_CODEC
+        }
+        head = frame_header(header, compress_level(level, input.len), checksum,
+                            (unsigned long long)input.len, sum, (int)itemsize, d, dict_len);
+    }
+    if (d != NULL)
+        result = compress_dict(level, d, dict_len, head, data, input.len);
+    else if (nthreads > 1 && input.len > block_size)
+        result = compress_blocks_threads(level, (size_t)block_size, head, data, input.len,
+                                         nthreads);
+    else if (input.len > block_size)
+        result = compress_blocks(level, (size_t)block_size, head, data, input.len);
+    else if ((ctx = thread_ctx()) != NULL)
+        result = compress_with_ctx(ctx, level, 0, head, data, input.len);
+    if (result != NULL && head > 0)
+        memcpy(PyString_AS_STRING(result), header, head);
+
+done:
+    PyMem_Free(shuffled);
+    if (input.buf != NULL) {
+        stats_record(STAT_COMPRESS, compress_level(level, input.len), input.len,
+                     RESULT_SIZE(result), result == NULL, start);
+        PyBuffer_Release(&input);
+    }
+    PyBuffer_Release(&dict);
+    return result;
+}
+/*
+ * Decompress a block of compressed data and returns the size of the
+ * decompressed block. If error occurs, e.g. the compressed data is
+ * corrupted or the output buffer is not large enough, then 0 (zero)
+ * will be returned instead.
+ *
+ * The input buffer and the output buffer can not overlap.
+ *
+ * Decompression is memory safe and guaranteed not to write the output buffer
+ * more than what is specified in maxout.
+ *
+ *
+ * int fastlz_decompress(const void* input, int length, void* output, int maxout);
+ *
+ *
+ * */
+
+static char fastlz_decompress_doc[] =
+    "decompress(string[, dict]) -- Decompress the string and returning the decompressed data.\n"
+    "Data compressed with a dictionary needs the same dict to decompress. "
+    "Only framed data can tell when the dict is missing or another one.\n"
+    "decompress(string, threads=n) -- Decompress the blocks of data larger "
+    "than 1 MB on up to n threads.\n"
+    ;
+
+/* the container stores its decompressed size, so the result is allocated once */
+static PyObject *
+decompress_blocks(const char *input, Py_ssize_t isize, int nthreads)
+{
+    PyObject *result;
+    size_t content;
+    size_t osize;
+
+    /* compress() never writes an empty container */
+    content = fastlz_blocks_content_size(input, (size_t)isize);
+    if (content == 0) {
+        PyErr_SetString(FastlzError, "corrupt input");
+        return NULL;
+    }
+    if (!PLAUSIBLE_SIZE(content, isize)) {
+        PyErr_SetString(FastlzError, "corrupt input");
+        return NULL;
+    }
+    result = PyString_FromStringAndSize(NULL, (Py_ssize_t)content);
+    if (result == NULL)
+        return NULL;
+    if (nthreads > 1) {
+        if (!decompress_blocks_threads(input, isize, PyString_AS_STRING(result), content,
+                                       nthreads)) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        return result;
+    }
+    BEGIN_CODEC(isize)
+    osize = fastlz_decompress_blocks(input, (size_t)isize, PyString_AS_STRING(result), content);
+    END_CODEC
+    if (osize != content) {
+        Py_DECREF(result);
+        PyErr_SetString(FastlzError, "corrupt input");
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject *
+decompress_frame(const char *input, Py_ssize_t isize, const char *dict, int dict_len,
+                 int nthreads)
+{
+    PyObject *result;
+    frame_info frame;
+    const char *error = NULL;
+
+    if (!parse_frame(input, isize, &frame) || !PLAUSIBLE_SIZE(frame.size, isize)) {
+        PyErr_SetString(FastlzError, "corrupt input");
+        return NULL;
+    }
+    result = PyString_FromStringAndSize(NULL, (Py_ssize_t)frame.size);
+    if (result == NULL)
+        return NULL;
+    if (nthreads > 1 && frame.itemsize < 2 && IS_BLOCKS(frame.body, frame.body_len)) {
+        if (!decompress_blocks_threads(frame.body, frame.body_len, PyString_AS_STRING(result),
+                                       (size_t)frame.size, nthreads)) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        BEGIN_CODEC(isize)
+        if (frame.has_checksum &&
+            frame_checksum(PyString_AS_STRING(result), (Py_ssize_t)frame.size) != frame.checksum)
+            error = "checksum mismatch";
+        END_CODEC
+    }
+    else {
+        BEGIN_CODEC(isize)
+        error = decode_frame(&frame, dict, dict_len, PyString_AS_STRING(result));
+        END_CODEC
+    }
+    if (error != NULL) {
+        Py_DECREF(result);
+        PyErr_SetString(FastlzError, error);
+        return NULL;
+    }
+    return result;
+}
+
+/*
+ * Without a frame the decompressed size is not stored, so start from a
+ * guess and grow the buffer until the data fits. A token can expand at most about 256 times.
+ * */
+static PyObject *
+decompress_raw(const char *input, Py_ssize_t isize, const char *dict, int dict_len)
+{
+    PyObject *result = NULL;
+    unsigned char *output;
+    int osize = 0;
+    double maxout;
+
+    if (isize > INT_MAX) {
+        PyErr_SetString(FastlzError, "corrupt input or wrong dictionary");
+        return NULL;
+    }
+    /* decode straight into the result string and shrink it to fit */
+    for (maxout = (double)isize * 4 + 64; ; maxout *= 2) {
+        if (maxout > (double)isize * 256 + 256)
+            maxout = (double)isize * 256 + 256;
+        if (maxout > INT_MAX)
+            maxout = INT_MAX;
+        result = PyString_FromStringAndSize(NULL, (Py_ssize_t)maxout);
+        if (result == NULL)
+            return NULL;
+        output = (unsigned char *)PyString_AS_STRING(result);
+        BEGIN_CODEC(isize)
+        if (dict != NULL)
+            osize = fastlz_decompress_dict(dict, dict_len, input, (int)isize,
+                                           output, (int)maxout);
+        else
+            osize = fastlz_decompress_fast(input, (int)isize, output, (int)maxout);
+        END_CODEC
+        if (osize > 0 || maxout >= (double)isize * 256 + 256 || maxout >= INT_MAX)
+            break;
+        Py_DECREF(result);
+    }
+    if (osize <= 0) {
+        Py_DECREF(result);
+        PyErr_SetString(FastlzError, "corrupt input or wrong dictionary");
+        return NULL;
+    }
+    if (_PyString_Resize(&result, osize) < 0)
+        return NULL;
+    return result;
+}
+
+static PyObject *
+decompress_any(const char *input, Py_ssize_t isize, const char *dict, int dict_len,
+               int nthreads)
+{
+    if (isize == 0)
+        return PyString_FromStringAndSize(NULL, 0);
+    if ((unsigned char)input[0] == STORED_MARKER)
+        return PyString_FromStringAndSize(input + 1, isize - 1);
+    if ((unsigned char)input[0] == FRAME_MAGIC)
+        return decompress_frame(input, isize, dict, dict_len, nthreads);
+    if (IS_BLOCKS(input, isize))
+        return decompress_blocks(input, isize, nthreads);
+    return decompress_raw(input, isize, dict, dict_len);
+}
+
+static PyObject *
+decompress(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"string", "dict", "threads", NULL};
+    PyObject *result = NULL;
+    PyObject *string;
+    Py_buffer input_buffer;
+    Py_buffer dict_buffer = {NULL};
+    const char *dict;
+    unsigned long long start = STATS_START();
+    int dict_len;
+    int nthreads = 1;
+
+    /* decompress(str) skips the argument parser, like compress() */
+    if (kwds == NULL && PyTuple_GET_SIZE(args) == 1 &&
+        PyString_CheckExact(PyTuple_GET_ITEM(args, 0))) {
+        string = PyTuple_GET_ITEM(args, 0);
+        result = decompress_any(PyString_AS_STRING(string), PyString_GET_SIZE(string),
+                                NULL, 0, 1);
+        stats_record(STAT_DECOMPRESS, 0, PyString_GET_SIZE(string), RESULT_SIZE(result),
+                     result == NULL, start);
+        return result;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s*|z*i", kwlist, &input_buffer,
+                                     &dict_buffer, &nthreads))
+        return NULL;
+    dict = (const char *)dict_buffer.buf;
+    dict_len = dict_tail(&dict, dict_buffer.len);
+    result = decompress_any((const char *)input_buffer.buf, input_buffer.len, dict, dict_len,
+                            nthreads);
+    stats_record(STAT_DECOMPRESS, 0, input_buffer.len, RESULT_SIZE(result), result == NULL,
+                 start);
+    PyBuffer_Release(&input_buffer);
+    PyBuffer_Release(&dict_buffer);
+    return result;
+}
+
+static char fastlz_decompress_range_doc[] =
+    "decompress_range(string, offset, length) -- Return "
+    "decompress(string)[offset:offset + length]. When string is a block "
+    "container, framed or not, only the blocks that hold those bytes are "
+    "decompressed; compress with a smaller block_size to make that cheaper. "
+    "The checksum of a frame covers all of the data and is not checked.\n"
+    ;
+
+/* decodes only the blocks of a container that hold [offset, offset + length) */
+static PyObject *
+decompress_blocks_range(const char *input, Py_ssize_t isize, size_t offset, size_t length)
+{
+    PyObject *result;
+    char *output, *output_end;
+    char *scratch;
+    size_t content = fastlz_blocks_content_size(input, (size_t)isize);
+    size_t block_size = fastlz_blocks_block_size(input, (size_t)isize);
+    size_t block, last, pos;
+    int failed = 0;
+
+    if (content == 0 || block_size == 0) {
+        PyErr_SetString(FastlzError, "corrupt input");
+        return NULL;
+    }
+    if (offset >= content)
+        return PyString_FromStringAndSize(NULL, 0);
+    if (length > content - offset)
+        length = content - offset;
+    if (length == 0)
+        return PyString_FromStringAndSize(NULL, 0);
+    result = PyString_FromStringAndSize(NULL, (Py_ssize_t)length);
+    if (result == NULL)
+        return NULL;
+    /* the first and the last block may be needed only in part */
+    scratch = (char *)PyMem_Malloc(block_size);
+    if (scratch == NULL) {
+        Py_DECREF(result);
+        return PyErr_NoMemory();
+    }
+    output = PyString_AS_STRING(result);
+    output_end = output + length;
+
+    block = offset / block_size;
+    last = (offset + length - 1) / block_size;
+    BEGIN_CODEC(length)
+    pos = fastlz_blocks_locate(input, (size_t)isize, block);
+    failed = (pos == 0);
+    for (; block <= last && !failed; block++) {
+        size_t start = block * block_size;
+        size_t size = (content - start < block_size) ? content - start : block_size;
+        size_t skip = (offset > start) ? offset - start : 0;
+        size_t take = size - skip;
+        size_t used;
+        if (take > (size_t)(output_end - output))
+            take = output_end - output;
+        if (take == size)
+            used = fastlz_decompress_block(input + pos, (size_t)isize - pos, output, size,
+                                           output_end - output);
+        else {
+            used = fastlz_decompress_block(input + pos, (size_t)isize - pos, scratch, size,
+                                           block_size);
+            if (used)
+                memcpy(output, scratch + skip, take);
+        }
+        failed = (used == 0);
+        pos += used;
+        output += take;
+    }
+    END_CODEC
+    PyMem_Free(scratch);
+    if (failed) {
+        Py_DECREF(result);
+        PyErr_SetString(FastlzError, "corrupt input");
+        return NULL;
+    }
+    return result;
+}
+
+/* the other formats are decompressed whole and sliced */
+static PyObject *
+slice_result(PyObject *result, size_t offset, size_t length)
+{
+    PyObject *slice;
+    size_t size;
+
+    if (result == NULL)
+        return NULL;
+    size = (size_t)PyString_GET_SIZE(result);
+    if (offset >= size)
+        offset = length = 0;
+    else if (length > size - offset)
+        length = size - offset;
+    slice = PyString_FromStringAndSize(PyString_AS_STRING(result) + offset, (Py_ssize_t)length);
+    Py_DECREF(result);
+    return slice;
+}
+
+static PyObject *
+decompress_range(PyObject *self, PyObject *args)
+{
+    PyObject *result = NULL;
+    Py_buffer input_buffer;
+    const char *input;
+    Py_ssize_t isize;
+    Py_ssize_t offset;
+    Py_ssize_t length;
+    frame_info frame;
+    unsigned long long start = STATS_START();
+
+    if (!PyArg_ParseTuple(args, "s*nn:decompress_range", &input_buffer, &offset, &length))
+        return NULL;
+    input = (const char *)input_buffer.buf;
+    isize = input_buffer.len;
+    if (offset < 0 || length < 0)
+        PyErr_SetString(PyExc_ValueError, "offset and length must not be negative");
+    else if (isize == 0)
+        result = PyString_FromStringAndSize(NULL, 0);
+    else if ((unsigned char)input[0] == STORED_MARKER)
+        result = slice_result(PyString_FromStringAndSize(input + 1, isize - 1),
+                              (size_t)offset, (size_t)length);
+    else if ((unsigned char)input[0] == FRAME_MAGIC) {
+        if (parse_frame(input, isize, &frame) && frame.itemsize < 2 &&
+            IS_BLOCKS(frame.body, frame.body_len))
+            result = decompress_blocks_range(frame.body, frame.body_len, (size_t)offset,
+                                             (size_t)length);
+        else
+            result = slice_result(decompress_frame(input, isize, NULL, 0, 1),
+                                  (size_t)offset, (size_t)length);
+    }
+    else if (IS_BLOCKS(input, isize))
+        result = decompress_blocks_range(input, isize, (size_t)offset, (size_t)length);
+    else
+        result = slice_result(decompress_raw(input, isize, NULL, 0),
+                              (size_t)offset, (size_t)length);
+    stats_record(STAT_DECOMPRESS_RANGE, 0, isize, RESULT_SIZE(result), result == NULL, start);
+    PyBuffer_Release(&input_buffer);
+    return result;
+}
+
+static char fastlz_validate_doc[] =
+    "validate(string[, dict]) -- Check that string decompresses, without "
+    "decompressing it, and return the decompressed size. Raises fastlz.error "
+    "if it is corrupt. Every token gets the checks decompress() makes, but "
+    "nothing is written, which is several times faster. The checksum of a "
+    "frame is not checked, that needs the data.\n"
+    ;
+
+/* returns the decompressed size, -1 if corrupt; runs without the GIL */
+static Py_ssize_t
+validate_body(const char *input, Py_ssize_t isize, int dict_len)
+{
+    size_t content;
+    int osize;
+
+    if (isize == 0)
+        return 0;
+    if ((unsigned char)input[0] == STORED_MARKER)
+        return isize - 1;
+    if (IS_BLOCKS(input, isize)) {
+        content = fastlz_blocks_validate(input, (size_t)isize);
+        if (content == 0 || content > PY_SSIZE_T_MAX)
+            return -1;
+        return (Py_ssize_t)content;
+    }
+    if (isize > INT_MAX || !fastlz_validate_dict(dict_len, input, (int)isize, &osize))
+        return -1;
+    return osize;
+}
+
+static PyObject *
+_validate(PyObject *self, PyObject *args)
+{
+    Py_buffer input;
+    Py_buffer dict = {NULL};
+    const char *ip;
+    const char *d;
+    frame_info frame;
+    Py_ssize_t size = -1;
+    int dict_len;
+
+    if (!PyArg_ParseTuple(args, "s*|z*:validate", &input, &dict))
+        return NULL;
+    ip = (const char *)input.buf;
+    d = (const char *)dict.buf;
+    dict_len = dict_tail(&d, dict.len);
+    BEGIN_CODEC(input.len)
+    if (input.len > 0 && (unsigned char)ip[0] == FRAME_MAGIC) {
+        if (parse_frame(ip, input.len, &frame) && frame.size <= PY_SSIZE_T_MAX &&
+            (!frame.has_dict || (d != NULL && frame_checksum(d, dict_len) == frame.dict_id))) {
+            size = validate_body(frame.body, frame.body_len, dict_len);
+            if (size != (Py_ssize_t)frame.size)
+                size = -1;
+        }
+    }
+    else
+        size = validate_body(ip, input.len, dict_len);
+    END_CODEC
+    PyBuffer_Release(&input);
+    PyBuffer_Release(&dict);
+    if (size < 0) {
+        PyErr_SetString(FastlzError, "corrupt input");
+        return NULL;
+    }
+    return PyInt_FromSsize_t(size);
+}
+
+static char fastlz_decompressed_size_doc[] =
+    "decompressed_size(string) -- Return the decompressed size of the output "
+    "of compress(), or None if it is not stored: only framed data and data "
+    "larger than 1 MB carry it.\n"
+    ;
+
+static PyObject *
+_decompressed_size(PyObject *self, PyObject *args)
+{
+    PyObject *result = NULL;
+    Py_buffer input;
+    const char *ip;
+    frame_info frame;
+
+    if (!PyArg_ParseTuple(args, "s*", &input))
+        return NULL;
+    ip = (const char *)input.buf;
+    if (input.len == 0)
+        result = PyInt_FromLong(0);
+    else if ((unsigned char)ip[0] == STORED_MARKER)
+        result = PyInt_FromSsize_t(input.len - 1);
+    else if ((unsigned char)ip[0] == FRAME_MAGIC) {
+        if (parse_frame(ip, input.len, &frame))
+            result = PyLong_FromUnsignedLongLong(frame.size);
+        else
+            PyErr_SetString(FastlzError, "corrupt input");
+    }
+    else if (IS_BLOCKS(ip, input.len)) {
+        size_t content = fastlz_blocks_content_size(ip, (size_t)input.len);
+        if (content > 0)
+            result = PyLong_FromSize_t(content);
+        else
+            PyErr_SetString(FastlzError, "corrupt input");
+    }
+    else {
+        Py_INCREF(Py_None);
+        result = Py_None;
+    }
+    PyBuffer_Release(&input);
+    return result;
+}
+
+static char fastlz_compress_bound_doc[] =
+    "compress_bound(length) -- Return the size of a dst buffer that is large "
+    "enough for compress_into() with any input of this length.\n"
+    ;
+
+static char fastlz_compress_into_doc[] =
+    "compress_into(src, dst[, level]) -- Compress src into the writable buffer "
+    "dst, in the same format as compress(), and return the number of bytes "
+    "written. Raises fastlz.error if dst is too small. src and dst must not "
+    "overlap.\n"
+    ;
+
+static char fastlz_decompress_into_doc[] =
+    "decompress_into(src, dst) -- Decompress src into the writable buffer dst "
+    "and return the number of bytes written. Raises fastlz.error if src is "
+    "corrupt or dst is too small.\n"
+    ;
+
+/* with this much room the codec never needs a scratch buffer */
+static size_t
+compress_bound(Py_ssize_t length)
+{
+    if (length > FASTLZ_BLOCK_SIZE)
+        return fastlz_blocks_bound((size_t)length);
+    return COMPRESS_BOUND(length);
+}
+
+static PyObject *
+_compress_bound(PyObject *self, PyObject *args)
+{
+    Py_ssize_t length;
+    size_t bound;
+    if (!PyArg_ParseTuple(args, "n", &length))
+        return NULL;
+    if (length < 0) {
+        PyErr_SetString(PyExc_ValueError, "length must not be negative");
+        return NULL;
+    }
+    bound = compress_bound(length);
+    if (bound > PY_SSIZE_T_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "length is too large");
+        return NULL;
+    }
+    return PyInt_FromSsize_t((Py_ssize_t)bound);
+}
+
+/* short input goes through a context, as in compress() */
+#define USE_CTX(length, out_size) \
+    ((length) < BOUNDED_MIN && (size_t)(out_size) >= COMPRESS_BOUND(length))
+
+/*
+ * Compresses into output the way compress() does, without needing the GIL.
+ * ctx is only used when USE_CTX holds. Returns the size, 0 if out_size is
+ * too small.
+ * */
+static Py_ssize_t
+compress_raw(fastlz_ctx *ctx, int level, const char *input, Py_ssize_t length,
+             char *output, Py_ssize_t out_size)
+{
+    Py_ssize_t osize = 0;
+    int cap;
+
+    if (length == 0)
+        return 0;
+    if (length > FASTLZ_BLOCK_SIZE)
+        return (Py_ssize_t)fastlz_compress_blocks(level, input, (size_t)length,
+                                                  output, (size_t)out_size);
+
+    cap = (out_size < length) ? (int)out_size : (int)length;
+    if (ctx != NULL && USE_CTX(length, out_size))
+        osize = fastlz_compress_with_ctx(ctx, level, input, (int)length, output);
+    else if (cap > 0)
+        osize = fastlz_compress_bounded_room(level, input, (int)length, output, cap,
+                                             (size_t)out_size);
+    if (osize <= 0 || osize > length) {
+        osize = 0;
+        if (out_size > length) {
+            output[0] = (char)STORED_MARKER;
+            memcpy(output + 1, input, length);
+            osize = length + 1;
+        }
+    }
+    return osize;
+}
+
+static PyObject *
+compress_into(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"src", "dst", "level", NULL};
+    Py_buffer src;
+    Py_buffer dst;
+    fastlz_ctx *ctx = NULL;
+    Py_ssize_t osize = 0;
+    unsigned long long start = STATS_START();
+    int level = -1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s*w*|i", kwlist, &src, &dst, &level))
+        return NULL;
+    if (!check_level(level, 1)) {
+        PyBuffer_Release(&src);
+        PyBuffer_Release(&dst);
+        return NULL;
+    }
+    level = compress_level(level, src.len);
+
+    if (USE_CTX(src.len, dst.len))
+        ctx = thread_ctx();
+    if (ctx != NULL || !PyErr_Occurred()) {
+        BEGIN_CODEC(src.len)
+        osize = compress_raw(ctx, level, (const char *)src.buf, src.len,
+                             (char *)dst.buf, dst.len);
+        END_CODEC
+        if (src.len > 0 && osize == 0)
+            PyErr_SetString(FastlzError, "dst is too small");
+    }
+
+    stats_record(STAT_COMPRESS_INTO, level, src.len, osize, PyErr_Occurred() != NULL, start);
+    PyBuffer_Release(&src);
+    PyBuffer_Release(&dst);
+    if (PyErr_Occurred())
+        return NULL;
+    return PyInt_FromSsize_t(osize);
+}
+
+static PyObject *
+decompress_into(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"src", "dst", NULL};
+    Py_buffer src;
+    Py_buffer dst;
+    const char *input;
+    const char *error = NULL;
+    Py_ssize_t osize = 0;
+    unsigned long long start = STATS_START();
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s*w*", kwlist, &src, &dst))
+        return NULL;
+    input = (const char *)src.buf;
+
+    if (src.len == 0)
+        osize = 0;
+    else if ((unsigned char)input[0] == STORED_MARKER) {
+        osize = src.len - 1;
+        if (osize > dst.len)
+            error = "dst is too small";
+        else
+            memcpy(dst.buf, input + 1, osize);
+    }
+    else if ((unsigned char)input[0] == FRAME_MAGIC) {
+        frame_info frame;
+        if (!parse_frame(input, src.len, &frame))
+            error = "corrupt input";
+        else if (frame.size > (unsigned long long)dst.len)
+            error = "dst is too small";
+        else {
+            BEGIN_CODEC(src.len)
+            error = decode_frame(&frame, NULL, 0, dst.buf);
+            END_CODEC
+            osize = (Py_ssize_t)frame.size;
+        }
+    }
+    else if (IS_BLOCKS(input, src.len)) {
+        size_t content = fastlz_blocks_content_size(input, (size_t)src.len);
+        if (content > (size_t)dst.len)
+            error = "dst is too small";
+        else {
+            BEGIN_CODEC(src.len)
+            osize = (Py_ssize_t)fastlz_decompress_blocks(input, (size_t)src.len,
+                                                         dst.buf, (size_t)dst.len);
+            END_CODEC
+            if (content == 0 || (size_t)osize != content)
+                error = "corrupt input";
+        }
+    }
+    else if (src.len > INT_MAX)
+        error = "corrupt input";
+    else {
+        int maxout = (dst.len > INT_MAX) ? INT_MAX : (int)dst.len;
+        BEGIN_CODEC(src.len)
+        osize = fastlz_decompress_fast(input, (int)src.len, dst.buf, maxout);
+        END_CODEC
+        if (osize <= 0)
+            error = "corrupt input or dst is too small";
+    }
+
+    stats_record(STAT_DECOMPRESS_INTO, 0, src.len, osize, error != NULL, start);
+    PyBuffer_Release(&src);
+    PyBuffer_Release(&dst);
+    if (error != NULL) {
+        PyErr_SetString(FastlzError, error);
+        return NULL;
+    }
+    return PyInt_FromSsize_t(osize);
+}
+
+/*
+ * A small pool of worker threads for the batch functions. The threads are
+ * started on first use and then sleep on a lock each. A job runs on the
+ * caller and on as many workers as it asked for; only one job has the
+ * pool at a time, a caller that finds it busy runs its job alone. Every
+ * worker owns a fastlz_ctx, so its hash table is reused across jobs.
+ * The workers never touch Python objects.
+ * */
+#define POOL_MAX 16
+
+typedef void (*pool_fn)(void *arg, int worker);
+
+#ifdef WITH_THREAD
+typedef struct {
+    PyThread_type_lock wake;
+    PyThread_type_lock done;
+    fastlz_ctx *ctx;
+} pool_worker;
+
+static struct {
+    PyThread_type_lock busy;
+    int started;
+    pool_fn fn;
+    void *arg;
+    pool_worker workers[POOL_MAX];
+} pool;
+
+static void
+pool_thread(void *arg)
+{
+    int index = (int)(Py_intptr_t)arg;
+    pool_worker *worker = &pool.workers[index];
+
+    for (;;) {
+        PyThread_acquire_lock(worker->wake, 1);
+        pool.fn(pool.arg, index + 1);
+        PyThread_release_lock(worker->done);
+    }
+}
+
+/*
+ * Takes the pool for a job on up to nthreads threads, the caller
+ * included, starting workers as needed. Returns the number of workers
+ * the job gets, 0 if the pool is busy. Call with the GIL held.
+ * */
+static int
+pool_acquire(int nthreads)
+{
+    int wanted = ((nthreads > POOL_MAX + 1) ? POOL_MAX + 1 : nthreads) - 1;
+
+    if (wanted <= 0)
+        return 0;
+    if (pool.busy == NULL && (pool.busy = PyThread_allocate_lock()) == NULL)
+        return 0;
+    if (!PyThread_acquire_lock(pool.busy, 0))
+        return 0;
+    while (pool.started < wanted) {
+        pool_worker *worker = &pool.workers[pool.started];
+        if (worker->wake == NULL)
+            worker->wake = PyThread_allocate_lock();
+        if (worker->done == NULL)
+            worker->done = PyThread_allocate_lock();
+        if (worker->ctx == NULL)
+            worker->ctx = fastlz_ctx_create();
+        if (worker->wake == NULL || worker->done == NULL || worker->ctx == NULL)
+            break;
+        /* both locks are held while the worker is idle */
+        PyThread_acquire_lock(worker->wake, 1);
+        PyThread_acquire_lock(worker->done, 1);
+        if (PyThread_start_new_thread(pool_thread, (void *)(Py_intptr_t)pool.started) == -1) {
+            PyThread_release_lock(worker->wake);
+            PyThread_release_lock(worker->done);
+            break;
+        }
+        pool.started++;
+    }
+    if (pool.started == 0) {
+        PyThread_release_lock(pool.busy);
+        return 0;
+    }
+    return (wanted < pool.started) ? wanted : pool.started;
+}
+
+/* runs fn on the caller and nworkers workers, the GIL need not be held */
+static void
+pool_run(pool_fn fn, void *arg, int nworkers)
+{
+    int i;
+
+    /* without workers the pool may belong to another job */
+    if (nworkers > 0) {
+        pool.fn = fn;
+        pool.arg = arg;
+    }
+    for (i = 0; i < nworkers; i++)
+        PyThread_release_lock(pool.workers[i].wake);
+    fn(arg, 0);
+    for (i = 0; i < nworkers; i++)
+        PyThread_acquire_lock(pool.workers[i].done, 1);
+}
+
+static void
+pool_release(int nworkers)
+{
+    if (nworkers > 0)
+        PyThread_release_lock(pool.busy);
+}
+
+static fastlz_ctx *
+pool_ctx(int worker)
+{
+    return pool.workers[worker - 1].ctx;
+}
+#else
+#define pool_acquire(nthreads) 0
+#define pool_run(fn, arg, nworkers) (fn)((arg), 0)
+#define pool_release(nworkers)
+#define pool_ctx(worker) NULL
+#endif
+
+/*
+ * The threads of a batch job take chunk items at a time from a shared
+ * counter, BATCH_CHUNK for a batch of buffers.
+ * */
+#define BATCH_CHUNK 16
+
+typedef struct {
+    Py_ssize_t count;
+    Py_buffer *items;
+    Py_ssize_t chunk;
+    Py_ssize_t next;
+#ifdef WITH_THREAD
+    PyThread_type_lock lock;
+#endif
+} batch_job;
+
+static int
+batch_claim(batch_job *job, Py_ssize_t *begin, Py_ssize_t *end)
+{
+#ifdef WITH_THREAD
+    if (job->lock)
+        PyThread_acquire_lock(job->lock, 1);
+#endif
+    *begin = job->next;
+    *end = (job->count - *begin < job->chunk) ? job->count : *begin + job->chunk;
+    job->next = *end;
+#ifdef WITH_THREAD
+    if (job->lock)
+        PyThread_release_lock(job->lock);
+#endif
+    return *begin < *end;
+}
+
+/* pins the buffers of a sequence, returns 0 with an exception set on failure */
+static int
+batch_start(batch_job *job, PyObject *items)
+{
+    PyObject *seq;
+    Py_ssize_t i;
+
+    memset(job, 0, sizeof(*job));
+    job->chunk = BATCH_CHUNK;
+    seq = PySequence_Fast(items, "expected a sequence of buffers");
+    if (seq == NULL)
+        return 0;
+    job->count = PySequence_Fast_GET_SIZE(seq);
+    job->items = PyMem_New(Py_buffer, job->count + 1);
+    if (job->items == NULL) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return 0;
+    }
+    for (i = 0; i < job->count; i++) {
+        if (!PyArg_Parse(PySequence_Fast_GET_ITEM(seq, i), "s*", &job->items[i])) {
+            job->count = i;
+            Py_DECREF(seq);
+            return 0;
+        }
+    }
+    Py_DECREF(seq);
+    return 1;
+}
+
+/* the bytes of the items pinned so far, for stats_record */
+static Py_ssize_t
+batch_bytes(batch_job *job)
+{
+    Py_ssize_t total = 0;
+    Py_ssize_t i;
+
+    if (job->items != NULL)
+        for (i = 0; i < job->count; i++)
+            total += job->items[i].len;
+    return total;
+}
+
+static void
+batch_finish(batch_job *job)
+{
+    Py_ssize_t i;
+
+    if (job->items != NULL)
+        for (i = 0; i < job->count; i++)
+            PyBuffer_Release(&job->items[i]);
+    PyMem_Free(job->items);
+#ifdef WITH_THREAD
+    if (job->lock)
+        PyThread_free_lock(job->lock);
+#endif
+}
+
+/* sets up the pool for a job, returns the number of workers */
+static int
+batch_threads(batch_job *job, int nthreads)
+{
+    int nworkers = 0;
+
+    if (nthreads > 1 && job->count > job->chunk) {
+#ifdef WITH_THREAD
+        job->lock = PyThread_allocate_lock();
+        if (job->lock == NULL)
+            return 0;
+#endif
+        nworkers = pool_acquire(nthreads);
+    }
+    return nworkers;
+}
+
+/* (data, offsets) with the items back to back, or a list of strings */
+static PyObject *
+batch_result(PyObject *data, const Py_ssize_t *offsets, Py_ssize_t count)
+{
+    PyObject *list;
+    PyObject *result;
+    Py_ssize_t i;
+
+    list = PyList_New(count + 1);
+    if (list == NULL) {
+        Py_DECREF(data);
+        return NULL;
+    }
+    for (i = 0; i <= count; i++) {
+        PyObject *v = PyInt_FromSsize_t(offsets[i]);
+        if (v == NULL) {
+            Py_DECREF(list);
+            Py_DECREF(data);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, v);
+    }
+    result = PyTuple_Pack(2, data, list);
+    Py_DECREF(data);
+    Py_DECREF(list);
+    return result;
+}
+
+static PyObject *
+batch_split(PyObject *data, const Py_ssize_t *offsets, Py_ssize_t count)
+{
+    PyObject *list;
+    Py_ssize_t i;
+
+    list = PyList_New(count);
+    if (list != NULL) {
+        for (i = 0; i < count; i++) {
+            PyObject *v = PyString_FromStringAndSize(PyString_AS_STRING(data) + offsets[i],
+                                                     offsets[i + 1] - offsets[i]);
+            if (v == NULL) {
+                Py_CLEAR(list);
+                break;
+            }
+            PyList_SET_ITEM(list, i, v);
+        }
+    }
+    Py_DECREF(data);
+    return list;
+}
+
+typedef struct {
+    batch_job job;
+    int level;
+    char *arena;
+    Py_ssize_t *bounds;
+    Py_ssize_t *sizes;
+    fastlz_ctx *ctx0;
+} compress_batch_job;
+
+static void
+compress_batch_run(void *arg, int worker)
+{
+    compress_batch_job *cj = (compress_batch_job *)arg;
+    fastlz_ctx *ctx = worker ? pool_ctx(worker) : cj->ctx0;
+    Py_ssize_t i, end;
+
+    while (batch_claim(&cj->job, &i, &end)) {
+        for (; i < end; i++) {
+            Py_buffer *item = &cj->job.items[i];
+            int level = compress_level(cj->level, item->len);
+            cj->sizes[i] = compress_raw(ctx, level, (const char *)item->buf, item->len,
+                                        cj->arena + cj->bounds[i],
+                                        cj->bounds[i + 1] - cj->bounds[i]);
+        }
+    }
+}
+
+static char fastlz_compress_batch_doc[] =
+    "compress_batch(items[, level[, threads[, contiguous]]]) -- Compress every "
+    "buffer in the sequence items as compress() would, in one call without "
+    "the GIL. Returns a list of strings, or with contiguous=True a tuple "
+    "(data, offsets) where item i is data[offsets[i]:offsets[i + 1]].\n"
+    "With threads > 1 the batch is spread over up to that many threads.\n"
+    ;
+
+static PyObject *
+compress_batch(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"items", "level", "threads", "contiguous", NULL};
+    compress_batch_job cj;
+    PyObject *items;
+    PyObject *data = NULL;
+    Py_ssize_t total = 0;
+    Py_ssize_t i;
+    unsigned long long start = STATS_START();
+    int nthreads = 1;
+    int contiguous = 0;
+    int nworkers;
+
+    memset(&cj, 0, sizeof(cj));
+    cj.level = -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iii", kwlist, &items, &cj.level,
+                                     &nthreads, &contiguous))
+        return NULL;
+    if (!check_level(cj.level, 1))
+        return NULL;
+    if (!batch_start(&cj.job, items))
+        goto done;
+    cj.ctx0 = thread_ctx();
+    if (cj.ctx0 == NULL)
+        goto done;
+
+    /* one arena, every item gets room for its worst case */
+    cj.bounds = PyMem_New(Py_ssize_t, cj.job.count + 1);
+    cj.sizes = PyMem_New(Py_ssize_t, cj.job.count + 1);
+    if (cj.bounds == NULL || cj.sizes == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (i = 0; i < cj.job.count; i++) {
+        size_t bound = compress_bound(cj.job.items[i].len);
+        cj.bounds[i] = total;
+        if (bound > (size_t)(PY_SSIZE_T_MAX - total)) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        total += (Py_ssize_t)bound;
+        cj.sizes[i] = 0;
+    }
+    cj.bounds[cj.job.count] = total;
+    data = PyString_FromStringAndSize(NULL, total);
+    if (data == NULL)
+        goto done;
+    cj.arena = PyString_AS_STRING(data);
+
+    nworkers = batch_threads(&cj.job, nthreads);
+    BEGIN_CODEC(total)
+    pool_run(compress_batch_run, &cj, nworkers);
+    /* close the gaps, the offsets end up in bounds */
+    total = 0;
+    for (i = 0; i < cj.job.count; i++) {
+        Py_ssize_t size = cj.sizes[i];
+        memmove(cj.arena + total, cj.arena + cj.bounds[i], size);
+        cj.bounds[i] = total;
+        total += size;
+    }
+    cj.bounds[cj.job.count] = total;
+    END_CODEC
+    pool_release(nworkers);
+
+    if (_PyString_Resize(&data, total) < 0)
+        goto done;
+    if (contiguous)
+        data = batch_result(data, cj.bounds, cj.job.count);
+    else
+        data = batch_split(data, cj.bounds, cj.job.count);
+
+done:
+    if (PyErr_Occurred())
+        Py_CLEAR(data);
+    stats_record(STAT_COMPRESS_BATCH, cj.level, batch_bytes(&cj.job), total, data == NULL, start);
+    batch_finish(&cj.job);
+    PyMem_Free(cj.bounds);
+    PyMem_Free(cj.sizes);
+    return data;
+}
+
+typedef struct {
+    batch_job job;
+    frame_info *frames;
+    char **outputs;
+    Py_ssize_t failed;
+    const char *error;
+} decompress_batch_job;
+
+static void
+decompress_batch_run(void *arg, int worker)
+{
+    decompress_batch_job *dj = (decompress_batch_job *)arg;
+    Py_ssize_t i, end;
+
+    while (batch_claim(&dj->job, &i, &end)) {
+        for (; i < end; i++) {
+            const char *error;
+            if (dj->outputs[i] == NULL)
+                continue;
+            error = decode_frame(&dj->frames[i], NULL, 0, dj->outputs[i]);
+            /* any failed item will do for the message */
+            if (error != NULL) {
+#ifdef WITH_THREAD
+                if (dj->job.lock)
+                    PyThread_acquire_lock(dj->job.lock, 1);
+#endif
+                dj->error = error;
+                dj->failed = i;
+#ifdef WITH_THREAD
+                if (dj->job.lock)
+                    PyThread_release_lock(dj->job.lock);
+#endif
+            }
+        }
+    }
+}
+
+/*
+ * Fills in how item i decodes: framed data, stored data and containers
+ * have their size in front, a bare raw block is decoded right away by
+ * the retrying decompress() path and kept in *raw.
+ * */
+static int
+batch_frame(const char *input, Py_ssize_t isize, frame_info *frame, PyObject **raw)
+{
+    memset(frame, 0, sizeof(*frame));
+    frame->body = input;
+    frame->body_len = isize;
+    if (isize == 0)
+        return 1;
+    if ((unsigned char)input[0] == STORED_MARKER) {
+        frame->size = isize - 1;
+        return 1;
+    }
+    if ((unsigned char)input[0] == FRAME_MAGIC) {
+        if (!parse_frame(input, isize, frame) || !PLAUSIBLE_SIZE(frame->size, isize)) {
+            PyErr_SetString(FastlzError, "corrupt input");
+            return 0;
+        }
+        return 1;
+    }
+    if (IS_BLOCKS(input, isize)) {
+        frame->size = fastlz_blocks_content_size(input, (size_t)isize);
+        if (frame->size == 0 || !PLAUSIBLE_SIZE(frame->size, isize)) {
+            PyErr_SetString(FastlzError, "corrupt input");
+            return 0;
+        }
+        return 1;
+    }
+    *raw = decompress_raw(input, isize, NULL, 0);
+    if (*raw == NULL)
+        return 0;
+    frame->size = PyString_GET_SIZE(*raw);
+    return 1;
+}
+
+static char fastlz_decompress_batch_doc[] =
+    "decompress_batch(items[, threads[, contiguous]]) -- Decompress every "
+    "buffer in the sequence items as decompress() would and return the "
+    "results like compress_batch(). Items that carry their size (framed, "
+    "stored or larger than 1 MB) are decoded together without the GIL.\n"
+    ;
+
+static PyObject *
+decompress_batch(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"items", "threads", "contiguous", NULL};
+    decompress_batch_job dj;
+    PyObject *items;
+    PyObject **raws = NULL;
+    PyObject *data = NULL;
+    Py_ssize_t *offsets = NULL;
+    Py_ssize_t total = 0;
+    Py_ssize_t i;
+    unsigned long long start = STATS_START();
+    int nthreads = 1;
+    int contiguous = 0;
+    int nworkers;
+
+    memset(&dj, 0, sizeof(dj));
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|ii", kwlist, &items, &nthreads,
+                                     &contiguous))
+        return NULL;
+    if (!batch_start(&dj.job, items))
+        goto done;
+    dj.frames = PyMem_New(frame_info, dj.job.count + 1);
+    dj.outputs = PyMem_New(char *, dj.job.count + 1);
+    raws = PyMem_New(PyObject *, dj.job.count + 1);
+    offsets = PyMem_New(Py_ssize_t, dj.job.count + 1);
+    if (dj.frames == NULL || dj.outputs == NULL || raws == NULL || offsets == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    memset(raws, 0, sizeof(PyObject *) * (dj.job.count + 1));
+
+    for (i = 0; i < dj.job.count; i++) {
+        if (!batch_frame((const char *)dj.job.items[i].buf, dj.job.items[i].len,
+                         &dj.frames[i], &raws[i]))
+            goto done;
+        offsets[i] = total;
+        if (dj.frames[i].size > (unsigned long long)(PY_SSIZE_T_MAX - total)) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        total += (Py_ssize_t)dj.frames[i].size;
+    }
+    offsets[dj.job.count] = total;
+
+    /* the results go straight to where they belong, raw blocks are done */
+    if (contiguous) {
+        data = PyString_FromStringAndSize(NULL, total);
+        if (data == NULL)
+            goto done;
+        for (i = 0; i < dj.job.count; i++) {
+            dj.outputs[i] = PyString_AS_STRING(data) + offsets[i];
+            if (raws[i] != NULL) {
+                memcpy(dj.outputs[i], PyString_AS_STRING(raws[i]), PyString_GET_SIZE(raws[i]));
+                dj.outputs[i] = NULL;
+            }
+        }
+    }
+    else {
+        data = PyList_New(dj.job.count);
+        if (data == NULL)
+            goto done;
+        for (i = 0; i < dj.job.count; i++) {
+            PyObject *v = raws[i];
+            dj.outputs[i] = NULL;
+            if (v != NULL)
+                raws[i] = NULL;
+            else {
+                v = PyString_FromStringAndSize(NULL, (Py_ssize_t)dj.frames[i].size);
+                if (v == NULL)
+                    goto done;
+                dj.outputs[i] = PyString_AS_STRING(v);
+            }
+            PyList_SET_ITEM(data, i, v);
+        }
+    }
+
+    nworkers = batch_threads(&dj.job, nthreads);
+    BEGIN_CODEC(total)
+    pool_run(decompress_batch_run, &dj, nworkers);
+    END_CODEC
+    pool_release(nworkers);
+
+    if (dj.error != NULL) {
+        PyErr_Format(FastlzError, "item %d: %s", (int)dj.failed, dj.error);
+        goto done;
+    }
+    if (contiguous)
+        data = batch_result(data, offsets, dj.job.count);
+
+done:
+    if (PyErr_Occurred())
+        Py_CLEAR(data);
+    stats_record(STAT_DECOMPRESS_BATCH, 0, batch_bytes(&dj.job), total, data == NULL, start);
+    if (raws != NULL)
+        for (i = 0; i < dj.job.count; i++)
+            Py_XDECREF(raws[i]);
+    batch_finish(&dj.job);
+    PyMem_Free(dj.frames);
+    PyMem_Free(dj.outputs);
+    PyMem_Free(raws);
+    PyMem_Free(offsets);
+    return data;
+}
+
+/*
+ * With threads > 1 compress() and decompress() spread the blocks of a
+ * container over the pool, about a megabyte of blocks per claim.
+ * Compressing, every block gets a slot in the result string with room for
+ * its worst case, and the slots are moved together afterwards.
+ * Decompressing, the entries are indexed first and every block is decoded
+ * into its place with no room past its end, so the threads never write
+ * over each other.
+ * */
+#define BLOCK_SLOT(block_size) (4 + (block_size) + FASTLZ_BOUND_SLACK)
+
+typedef struct {
+    batch_job job;
+    int level;
+    size_t block_size;
+    const char *input;
+    size_t length;
+    char *output;
+    size_t *offsets;
+    int failed;
+} blocks_job;
+
+static void
+blocks_start(blocks_job *bj, size_t block_size, size_t length)
+{
+    memset(bj, 0, sizeof(*bj));
+    bj->block_size = block_size;
+    bj->length = length;
+    bj->job.count = (Py_ssize_t)((length + block_size - 1) / block_size);
+    bj->job.chunk = FASTLZ_BLOCK_SIZE / block_size;
+}
+
+static void
+compress_blocks_run(void *arg, int worker)
+{
+    blocks_job *bj = (blocks_job *)arg;
+    size_t slot = BLOCK_SLOT(bj->block_size);
+    Py_ssize_t i, end;
+
+    while (batch_claim(&bj->job, &i, &end)) {
+        for (; i < end; i++) {
+            size_t pos = (size_t)i * bj->block_size;
+            size_t size = (bj->length - pos < bj->block_size) ? bj->length - pos
+                                                               : bj->block_size;
+            bj->offsets[i] = fastlz_compress_block(bj->level, bj->input + pos, size,
+                                                   bj->output + (size_t)i * slot, slot);
+        }
+    }
+}
+
+static PyObject *
+compress_blocks_threads(int level, size_t block_size, Py_ssize_t head, const char *input,
+                        Py_ssize_t length, int nthreads)
+{
+    blocks_job bj;
+    PyObject *result;
+    size_t slot = BLOCK_SLOT(block_size);
+    char *op;
+    Py_ssize_t i;
+    int nworkers;
+
+    blocks_start(&bj, block_size, (size_t)length);
+    if ((size_t)bj.job.count > (PY_SSIZE_T_MAX - head - FASTLZ_BLOCKS_HEADER) / slot)
+        return PyErr_NoMemory();
+    bj.offsets = PyMem_New(size_t, bj.job.count);
+    if (bj.offsets == NULL)
+        return PyErr_NoMemory();
+    result = PyString_FromStringAndSize(NULL, head + FASTLZ_BLOCKS_HEADER + bj.job.count * slot);
+    if (result == NULL) {
+        PyMem_Free(bj.offsets);
+        return NULL;
+    }
+    bj.level = compress_level(level, length);
+    bj.input = input;
+    bj.output = PyString_AS_STRING(result) + head + FASTLZ_BLOCKS_HEADER;
+    op = bj.output;
+
+    nworkers = batch_threads(&bj.job, nthreads);
+    BEGIN_CODEC(length)
+    pool_run(compress_blocks_run, &bj, nworkers);
+    for (i = 0; i < bj.job.count && bj.offsets[i] > 0; i++) {
+        memmove(op, bj.output + (size_t)i * slot, bj.offsets[i]);
+        op += bj.offsets[i];
+    }
+    END_CODEC
+    pool_release(nworkers);
+    batch_finish(&bj.job);
+    PyMem_Free(bj.offsets);
+
+    if (i < bj.job.count) {
+        Py_DECREF(result);
+        PyErr_SetString(FastlzError, "compression failed");
+        return NULL;
+    }
+    fastlz_blocks_write_header((size_t)length, block_size, PyString_AS_STRING(result) + head);
+    if (_PyString_Resize(&result, op - PyString_AS_STRING(result)) < 0)
+        return NULL;
+    return result;
+}
+
+static void
+decompress_blocks_run(void *arg, int worker)
+{
+    blocks_job *bj = (blocks_job *)arg;
+    Py_ssize_t i, end;
+
+    while (batch_claim(&bj->job, &i, &end)) {
+        for (; i < end; i++) {
+            size_t pos = (size_t)i * bj->block_size;
+            size_t size = (bj->length - pos < bj->block_size) ? bj->length - pos
+                                                               : bj->block_size;
+            if (!fastlz_decompress_block(bj->input + bj->offsets[i],
+                                         bj->offsets[i + 1] - bj->offsets[i],
+                                         bj->output + pos, size, size))
+                bj->failed = 1;
+        }
+    }
+}
+
+/*
+ * Decodes a container of content bytes into output. Call with the GIL
+ * held, it is released while decoding. Returns 0 with an exception set
+ * on failure.
+ * */
+static int
+decompress_blocks_threads(const char *input, Py_ssize_t isize, char *output, size_t content,
+                          int nthreads)
+{
+    blocks_job bj;
+    size_t block_size = fastlz_blocks_block_size(input, (size_t)isize);
+    int nworkers;
+
+    if (block_size == 0 || fastlz_blocks_content_size(input, (size_t)isize) != content) {
+        PyErr_SetString(FastlzError, "corrupt input");
+        return 0;
+    }
+    blocks_start(&bj, block_size, content);
+    bj.offsets = PyMem_New(size_t, bj.job.count + 1);
+    if (bj.offsets == NULL) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    bj.input = input;
+    bj.output = output;
+    if (!fastlz_blocks_index(input, (size_t)isize, bj.offsets, (size_t)bj.job.count))
+        bj.failed = 1;
+    else {
+        nworkers = batch_threads(&bj.job, nthreads);
+        BEGIN_CODEC(isize)
+        pool_run(decompress_blocks_run, &bj, nworkers);
+        END_CODEC
+        pool_release(nworkers);
+        batch_finish(&bj.job);
+    }
+    PyMem_Free(bj.offsets);
+    if (bj.failed) {
+        PyErr_SetString(FastlzError, "corrupt input");
+        return 0;
+    }
+    return 1;
+}
+
+static char compressor_doc[] =
+    "Compressor([level[, dict]]) -- Return a compressor object that keeps its hash table "
+    "between calls, which makes compressing many short strings faster.\n"
+    "With a dict (see train_dict) matches can also refer to it, which helps "
+    "a lot with short similar records. The dictionary is prepared only once.\n"
+    "Calls on a compressor object shared between threads run one at a time.\n"
+    ;
+
+static char compressor_compress_doc[] =
+    "compress(string) -- Compress string with the level given to the "
+    "constructor, returning a new string containing the compressed data.\n"
+    ;
+
+static PyObject *
+compressor_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"level", "dict", NULL};
+    CompressorObject *self;
+    Py_buffer dict_buffer = {NULL};
+    const char *dict;
+    int dict_len;
+    int level = -1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iz*", kwlist, &level,
+                                     &dict_buffer))
+        return NULL;
+    if (!check_level(level, 1)) {
+        PyBuffer_Release(&dict_buffer);
+        return NULL;
+    }
+    dict = (const char *)dict_buffer.buf;
+    dict_len = dict_tail(&dict, dict_buffer.len);
+
+    self = (CompressorObject *)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->level = level;
+        self->has_dict = (dict != NULL && dict_len > 0);
+        self->ctx = fastlz_ctx_create();
+        /* the dictionary is copied */
+        if (self->ctx == NULL || !INIT_OBJECT_LOCK(self)
+            || !fastlz_ctx_load_dict(self->ctx, dict, dict_len)) {
+            Py_DECREF(self);
+            self = (CompressorObject *)PyErr_NoMemory();
+        }
+    }
+    PyBuffer_Release(&dict_buffer);
+    return (PyObject *)self;
+}
+
+static void
+compressor_dealloc(CompressorObject *self)
+{
+    if (self->ctx)
+        fastlz_ctx_free(self->ctx);
+    FREE_OBJECT_LOCK(self)
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *
+compressor_compress(CompressorObject *self, PyObject *args)
+{
+    PyObject *result;
+    Py_buffer input;
+    if (!PyArg_ParseTuple(args, "s*", &input))
+        return NULL;
+    ENTER_OBJECT(self)
+    result = compress_with_ctx(self->ctx, self->level, self->has_dict, 0,
+                               (const char *)input.buf, input.len);
+    LEAVE_OBJECT(self)
+    PyBuffer_Release(&input);
+    return result;
+}
+
+static PyMethodDef compressor_methods[] =
+{
+    {"compress",             (PyCFunction)compressor_compress, METH_VARARGS, compressor_compress_doc},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject CompressorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "fastlz.Compressor",                    /* tp_name */
+    sizeof(CompressorObject),               /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)compressor_dealloc,         /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    compressor_doc,                         /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    compressor_methods,                     /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    0,                                      /* tp_init */
+    0,                                      /* tp_alloc */
+    compressor_new,                         /* tp_new */
+};
+
+/*
+ * CompressObj and DecompressObj wrap a fastlz_stream. Every compress() call
+ * becomes one block, or several for input larger than STREAM_BLOCK, written
+ * as an 8-byte header (compressed and original size, both 32-bit
+ * little-endian) followed by the compressed data, so the output can be cut
+ * anywhere before it is fed to DecompressObj.
+ * */
+#define STREAM_HEADER 8
+#define STREAM_BLOCK FASTLZ_BLOCK_SIZE
+
+typedef struct {
+    PyObject_HEAD
+    fastlz_stream *stream;
+    int level;
+    OBJECT_LOCK
+} CompressObject;
+
+typedef struct {
+    PyObject_HEAD
+    fastlz_stream *stream;
+    unsigned char *pending;     /* input not yet forming a whole block */
+    size_t pending_len;
+    size_t pending_size;
+    OBJECT_LOCK
+} DecompressObject;
+
+static PyTypeObject CompressType;
+static PyTypeObject DecompressType;
+
+static char compressobj_doc[] =
+    "CompressObj([level]) -- Return a compressor object for a stream of data. "
+    "The data of earlier compress() calls is used as history, so small pieces "
+    "compress about as well as all of it at once.\n"
+    "Levels 3 and 4 compress as level 2. Decompress the output with DecompressObj.\n"
+    ;
+
+static char compressobj_compress_doc[] =
+    "compress(string) -- Compress the next piece of the stream, returning a "
+    "string with the compressed data for it.\n"
+    ;
+
+static char compressobj_flush_doc[] =
+    "flush() -- Return the remaining compressed data. Nothing is held back, "
+    "so this is always an empty string.\n"
+    ;
+
+static PyObject *
+compressobj_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"level", NULL};
+    CompressObject *self;
+    int level = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &level))
+        return NULL;
+    if (!check_level(level, 0))
+        return NULL;
+
+    self = (CompressObject *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+    self->level = level;
+    self->stream = fastlz_stream_create();
+    if (self->stream == NULL || !INIT_OBJECT_LOCK(self)) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    return (PyObject *)self;
+}
+
+static void
+compressobj_dealloc(CompressObject *self)
+{
+    if (self->stream)
+        fastlz_stream_free(self->stream);
+    FREE_OBJECT_LOCK(self)
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *
+compressobj_compress(CompressObject *self, PyObject *args)
+{
+    PyObject *result;
+    Py_buffer input_buffer;
+    const char *input;
+    unsigned char *output;
+    Py_ssize_t length;
+    Py_ssize_t pos;
+    Py_ssize_t total = 0;
+    size_t bound;
+    int failed = 0;
+
+    if (!PyArg_ParseTuple(args, "s*", &input_buffer))
+        return NULL;
+    input = (const char *)input_buffer.buf;
+    length = input_buffer.len;
+
+    /* every block may grow by a fifth plus 66 bytes */
+    bound = (size_t)length + length / 5
+            + (STREAM_HEADER + 66) * ((size_t)length / STREAM_BLOCK + 1);
+    if (bound > PY_SSIZE_T_MAX) {
+        PyBuffer_Release(&input_buffer);
+        return PyErr_NoMemory();
+    }
+    result = PyString_FromStringAndSize(NULL, (Py_ssize_t)bound);
+    if (result == NULL) {
+        PyBuffer_Release(&input_buffer);
+        return NULL;
+    }
+    output = (unsigned char *)PyString_AS_STRING(result);
+
+    ENTER_OBJECT(self)
+    BEGIN_CODEC(length)
+    for (pos = 0; pos < length; pos += STREAM_BLOCK) {
+        int size = (length - pos < STREAM_BLOCK) ? (int)(length - pos) : STREAM_BLOCK;
+        int osize = fastlz_stream_compress(self->stream, self->level, input + pos, size,
+                                           output + total + STREAM_HEADER);
+        if (osize <= 0) {
+            failed = 1;
+            break;
+        }
+        write_u32(output + total, osize);
+        write_u32(output + total + 4, size);
+        total += STREAM_HEADER + osize;
+    }
+    END_CODEC
+    LEAVE_OBJECT(self)
+    PyBuffer_Release(&input_buffer);
+
+    if (failed) {
+        Py_DECREF(result);
+        return PyErr_NoMemory();
+    }
+    if (_PyString_Resize(&result, total) < 0)
+        return NULL;
+    return result;
+}
+
+static PyObject *
+compressobj_flush(CompressObject *self, PyObject *unused)
+{
+    return PyString_FromStringAndSize(NULL, 0);
+}
+
+static PyMethodDef compressobj_methods[] =
+{
+    {"compress",             (PyCFunction)compressobj_compress, METH_VARARGS, compressobj_compress_doc},
+    {"flush",                (PyCFunction)compressobj_flush, METH_NOARGS, compressobj_flush_doc},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject CompressType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "fastlz.CompressObj",                   /* tp_name */
+    sizeof(CompressObject),                 /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)compressobj_dealloc,        /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    compressobj_doc,                        /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    compressobj_methods,                    /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    0,                                      /* tp_init */
+    0,                                      /* tp_alloc */
+    compressobj_new,                        /* tp_new */
+};
+
+static char decompressobj_doc[] =
+    "DecompressObj() -- Return a decompressor object for the output of a "
+    "CompressObj, which may be fed in pieces of any size.\n"
+    ;
+
+static char decompressobj_decompress_doc[] =
+    "decompress(string) -- Decompress the next piece of the stream, returning "
+    "a string with all the data that is complete so far.\n"
+    ;
+
+static PyObject *
+decompressobj_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {NULL};
+    DecompressObject *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist))
+        return NULL;
+
+    self = (DecompressObject *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+    self->pending = NULL;
+    self->pending_len = 0;
+    self->pending_size = 0;
+    self->stream = fastlz_stream_create();
+    if (self->stream == NULL || !INIT_OBJECT_LOCK(self)) {
+        Py_DECREF(self);
         return PyErr_NoMemory();
+    }
+    return (PyObject *)self;
+}
+
+static void
+decompressobj_dealloc(DecompressObject *self)
+{
+    if (self->stream)
+        fastlz_stream_free(self->stream);
+    free(self->pending);
+    FREE_OBJECT_LOCK(self)
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* what went wrong while decoding without the GIL */
+#define STREAM_OK 0
+#define STREAM_NO_MEMORY 1
+#define STREAM_CORRUPT 2
+
+static int
+decompressobj_run(DecompressObject *self, const char *input, size_t length,
+                  unsigned char **output, size_t *osize)
+{
+    size_t pos = 0;
+    size_t output_size = 0;
+
+    if (length > PY_SSIZE_T_MAX - self->pending_len)
+        return STREAM_NO_MEMORY;
+    if (self->pending_len + length > self->pending_size) {
+        unsigned char *pending = (unsigned char *)realloc(self->pending,
+                                                          self->pending_len + length);
+        if (pending == NULL)
+            return STREAM_NO_MEMORY;
+        self->pending = pending;
+        self->pending_size = self->pending_len + length;
+    }
+    memcpy(self->pending + self->pending_len, input, length);
+    self->pending_len += length;
+
+    while (self->pending_len - pos >= STREAM_HEADER) {
+        unsigned long csize = readU32(self->pending + pos);
+        unsigned long usize = readU32(self->pending + pos + 4);
+        int r;
+
+        if (csize == 0 || usize == 0 || csize > INT_MAX || usize > INT_MAX
+            || usize > PY_SSIZE_T_MAX - *osize)
+            return STREAM_CORRUPT;
+        if (self->pending_len - pos - STREAM_HEADER < csize)
+            break;
+        if (*osize + usize > output_size) {
+            unsigned char *grown;
+            output_size = *osize + usize;
+            if (output_size < PY_SSIZE_T_MAX / 2)
+                output_size *= 2;
+            grown = (unsigned char *)realloc(*output, output_size);
+            if (grown == NULL)
+                return STREAM_NO_MEMORY;
+            *output = grown;
+        }
+        r = fastlz_stream_decompress(self->stream, self->pending + pos + STREAM_HEADER,
+                                     (int)csize, *output + *osize, (int)usize);
+        if (r != (int)usize)
+            return STREAM_CORRUPT;
+        *osize += r;
+        pos += STREAM_HEADER + csize;
+    }
+
+    /* keep the incomplete block for the next call */
+    memmove(self->pending, self->pending + pos, self->pending_len - pos);
+    self->pending_len -= pos;
+    return STREAM_OK;
+}
+
+static PyObject *
+decompressobj_decompress(DecompressObject *self, PyObject *args)
+{
+    PyObject *result = NULL;
+    Py_buffer input;
+    unsigned char *output = NULL;
+    size_t osize = 0;
+    int status = STREAM_CORRUPT;
+
+    if (!PyArg_ParseTuple(args, "s*", &input))
+        return NULL;
+
+    ENTER_OBJECT(self)
+    if (self->stream != NULL) {
+        BEGIN_CODEC(input.len)
+        status = decompressobj_run(self, (const char *)input.buf, input.len,
+                                   &output, &osize);
+        END_CODEC
+        /* blocks may have been decoded already, the stream can not go on */
+        if (status != STREAM_OK) {
+            fastlz_stream_free(self->stream);
+            self->stream = NULL;
+        }
+    }
+    LEAVE_OBJECT(self)
+    PyBuffer_Release(&input);
+
+    if (status == STREAM_OK)
+        result = PyString_FromStringAndSize((const char *)output, (Py_ssize_t)osize);
+    else if (status == STREAM_NO_MEMORY)
+        PyErr_NoMemory();
+    else
+        PyErr_SetString(FastlzError, "stream is corrupt");
+    free(output);
+    return result;
+}
+
+static PyMethodDef decompressobj_methods[] =
+{
+    {"decompress",           (PyCFunction)decompressobj_decompress, METH_VARARGS, decompressobj_decompress_doc},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject DecompressType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "fastlz.DecompressObj",                 /* tp_name */
+    sizeof(DecompressObject),               /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)decompressobj_dealloc,      /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    decompressobj_doc,                      /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    decompressobj_methods,                  /* tp_methods */
+    0,                                      /* tp_members */
+    0,                                      /* tp_getset */
+    0,                                      /* tp_base */
+    0,                                      /* tp_dict */
+    0,                                      /* tp_descr_get */
+    0,                                      /* tp_descr_set */
+    0,                                      /* tp_dictoffset */
+    0,                                      /* tp_init */
+    0,                                      /* tp_alloc */
+    decompressobj_new,                      /* tp_new */
+};
+
+/*
+ * train_dict() is a simplified cover algorithm: it scores every segment of
+ * the samples by how many samples contain each of its 8-byte substrings,
+ * takes the best segment of each stretch of the input, and stops counting
+ * substrings once they are in the dictionary. The best segments go last,
+ * closest to the data, where level 1 can still reach them.
+ * */
+#define TRAIN_SEGMENT   64
+#define TRAIN_DMER      8
+#define TRAIN_HASH_LOG  20
+#define TRAIN_HASH(p) ((unsigned int)(((p)[0] | ((p)[1] << 8) | ((p)[2] << 16) | \
+    ((unsigned int)(p)[3] << 24)) * 2654435761U ^ ((p)[4] | ((p)[5] << 8) | \
+    ((p)[6] << 16) | ((unsigned int)(p)[7] << 24)) * 2246822519U) >> (32 - TRAIN_HASH_LOG))
+
+typedef struct {
+    unsigned long score;
+    long start;
+} train_segment;
+
+static int
+train_segment_cmp(const void *a, const void *b)
+{
+    const train_segment *x = (const train_segment *)a;
+    const train_segment *y = (const train_segment *)b;
+    if (x->score != y->score)
+        return (x->score < y->score) ? -1 : 1;
+    return (x->start < y->start) ? -1 : (x->start > y->start);
+}
+
+static char fastlz_train_dict_doc[] =
+    "train_dict(samples[, size]) -- Build a dictionary of at most size bytes "
+    "(default 8192) from a sequence of sample strings, for Compressor(dict=...), "
+    "compress(..., dict=...) and decompress(..., dict=...).\n"
+    "Level 1 only reaches the last 8192 bytes of a dictionary, level 2 the "
+    "last 64 KB.\n"
+    ;
+
+static PyObject *
+_train_dict(PyObject *self, PyObject *args)
+{
+    PyObject *samples, *seq, *result = NULL;
+    Py_ssize_t count, i;
+    int size = 8192;
+    long total = 0, pos, nseg, epoch, used = 0, nchosen = 0;
+    unsigned char *data = NULL, *dict = NULL;
+    unsigned int *freq = NULL, *seen = NULL, *hashes = NULL;
+    train_segment *chosen = NULL;
+
+    if (!PyArg_ParseTuple(args, "O|i", &samples, &size))
+        return NULL;
+    if (size <= 0 || size > FASTLZ_DICT_MAX) {
+        PyErr_Format(PyExc_ValueError, "size must be between 1 and %d",
+                     FASTLZ_DICT_MAX);
+        return NULL;
+    }
+    seq = PySequence_Fast(samples, "samples must be a sequence of strings");
+    if (seq == NULL)
+        return NULL;
+    count = PySequence_Fast_GET_SIZE(seq);
+    for (i = 0; i < count; i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        if (!PyString_Check(item)) {
+            PyErr_SetString(PyExc_TypeError, "samples must be a sequence of strings");
+            goto done;
+        }
+        total += PyString_GET_SIZE(item);
+    }
 
-    if ((level != 1) || (level != 2)) {
-#if defined(DEBUG)
-		printf("in compressing\n");
-        osize = fastlz_compress(input, length, output);
-		printf("osize : %d\n", osize);
-#endif
-    } else {
-#if defined(DEBUG)
-        osize = fastlz_compress_level(level, input, length, output);
-		printf("osize : %d\n", osize);
-#endif
-	}
-    result = Py_BuildValue("s#", output, osize);
-    free(output);
+    data = (unsigned char *)malloc(total + 1);
+    hashes = (unsigned int *)malloc(sizeof(unsigned int) * (total + 1));
+    freq = (unsigned int *)calloc(1 << TRAIN_HASH_LOG, sizeof(unsigned int));
+    seen = (unsigned int *)calloc(1 << TRAIN_HASH_LOG, sizeof(unsigned int));
+    nseg = size / TRAIN_SEGMENT + 1;
+    chosen = (train_segment *)malloc(sizeof(train_segment) * nseg);
+    dict = (unsigned char *)malloc(size);
+    if (!data || !hashes || !freq || !seen || !chosen || !dict) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    /* count each substring once per sample, none crosses a sample boundary */
+    for (i = 0, pos = 0; i < count; i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        long len = PyString_GET_SIZE(item), k;
+        memcpy(data + pos, PyString_AS_STRING(item), len);
+        for (k = 0; k < len; k++) {
+            if (k + TRAIN_DMER > len) {
+                hashes[pos + k] = (unsigned int)-1;
+                continue;
+            }
+            hashes[pos + k] = TRAIN_HASH(data + pos + k);
+            if (seen[hashes[pos + k]] != (unsigned int)i + 1) {
+                seen[hashes[pos + k]] = (unsigned int)i + 1;
+                freq[hashes[pos + k]]++;
+            }
+        }
+        pos += len;
+    }
+
+    if (total <= size) {
+        /* everything fits */
+        result = PyString_FromStringAndSize((const char *)data, total);
+        goto done;
+    }
+
+    /* pick the best segment in each epoch */
+    epoch = total / nseg;
+    if (epoch < TRAIN_SEGMENT)
+        epoch = TRAIN_SEGMENT;
+    for (pos = 0; pos + TRAIN_SEGMENT <= total && nchosen < nseg; pos += epoch) {
+        long end = (pos + epoch < total) ? pos + epoch : total;
+        long best = -1, start, k;
+        unsigned long score = 0, best_score = 0;
+
+        for (k = pos; k < pos + TRAIN_SEGMENT - TRAIN_DMER + 1; k++)
+            if (hashes[k] != (unsigned int)-1)
+                score += freq[hashes[k]];
+        for (start = pos; ; start++) {
+            if (score > best_score) {
+                best_score = score;
+                best = start;
+            }
+            if (start + TRAIN_SEGMENT >= end)
+                break;
+            k = start + TRAIN_SEGMENT - TRAIN_DMER + 1;
+            if (hashes[start] != (unsigned int)-1)
+                score -= freq[hashes[start]];
+            if (hashes[k] != (unsigned int)-1)
+                score += freq[hashes[k]];
+        }
+        /* substrings seen in a single sample do not help */
+        if (best < 0 || best_score <= TRAIN_SEGMENT - TRAIN_DMER + 1)
+            continue;
+
+        chosen[nchosen].score = best_score;
+        chosen[nchosen].start = best;
+        nchosen++;
+        for (k = best; k < best + TRAIN_SEGMENT - TRAIN_DMER + 1; k++)
+            if (hashes[k] != (unsigned int)-1)
+                freq[hashes[k]] = 0;
+    }
+
+    /* best segments last, trim the worst ones if there are too many */
+    qsort(chosen, nchosen, sizeof(train_segment), train_segment_cmp);
+    for (i = nchosen - 1; i >= 0 && used + TRAIN_SEGMENT <= size; i--) {
+        used += TRAIN_SEGMENT;
+        memcpy(dict + size - used, data + chosen[i].start, TRAIN_SEGMENT);
+    }
+    result = PyString_FromStringAndSize((const char *)dict + size - used, used);
+
+done:
+    free(data);
+    free(hashes);
+    free(freq);
+    free(seen);
+    free(chosen);
+    free(dict);
+    Py_DECREF(seq);
     return result;
 }
+
+#ifdef WITH_THREAD
 /*
- * Decompress a block of compressed data and returns the size of the
- * decompressed block. If error occurs, e.g. the compressed data is
- * corrupted or the output buffer is not large enough, then 0 (zero)
- * will be returned instead.
- *
- * The input buffer and the output buffer can not overlap.
- *
- * Decompression is memory safe and guaranteed not to write the output buffer
- * more than what is specified in maxout.
- *
- *
- * int fastlz_decompress(const void* input, int length, void* output, int maxout);
- *
- *
+ * pack_file(threads=n) reads the blocks of the file in order into a ring
+ * of inflight slots, compresses them on the pool and writes their chunks
+ * in order, so the archive is the same as a serial one. The reader of a
+ * block takes its slot and the writer gives it back, which bounds the
+ * memory to inflight blocks. The thread that finishes the block next in
+ * line writes it and every finished block after it.
  * */
+typedef struct {
+    pack_block block;
+    PyThread_type_lock free;
+    int ready;
+} pack_slot;
 
-static char fastlz_decompress_doc[] =
-    "decompress(string) -- Decompress the string and returning the decompressed data.\n "
-    ;
-static PyObject *
-decompress(PyObject *self, PyObject *args)
+typedef struct {
+    FILE *in;
+    const unsigned char *map;
+    unsigned long long fsize;
+    FILE *f;
+    pack_index *index;
+    int method;
+    int level;
+    int nslots;
+    pack_slot *slots;
+    PyThread_type_lock read_lock;
+    PyThread_type_lock write_lock;
+    unsigned long next_read;
+    unsigned long next_write;
+    unsigned long long total_read;
+    int eof;
+    int writing;
+} pack_job;
+
+static void
+pack_blocks_run(void *arg, int worker)
 {
-    PyObject *result;
-    const char *input;
-    unsigned int isize;
-    unsigned char *output;
-    unsigned int osize;
-    if (!PyArg_ParseTuple(args, "s#", &input, &isize))
-        return NULL;
-#if defined(DEBUG)
-	printf("input : %s, isize : %d\n", input, isize);
-#endif
-    output = (unsigned char *)malloc(sizeof(unsigned char)
-                                     *(isize * 6 / 5));
-    if (output == NULL) {
-        return PyErr_NoMemory();
+    pack_job *pj = (pack_job *)arg;
+    pack_slot *slot;
+
+    for (;;) {
+        PyThread_acquire_lock(pj->read_lock, 1);
+        if (pj->eof) {
+            PyThread_release_lock(pj->read_lock);
+            break;
+        }
+        slot = &pj->slots[pj->next_read % pj->nslots];
+        PyThread_acquire_lock(slot->free, 1);
+        if (pj->map) {
+            unsigned long long left = pj->fsize - pj->total_read;
+            slot->block.input = pj->map + pj->total_read;
+            slot->block.bytes_read = (left < BLOCK_SIZE) ? left : BLOCK_SIZE;
+        }
+        else {
+            slot->block.input = slot->block.buffer;
+            slot->block.bytes_read = fread(slot->block.buffer, 1, BLOCK_SIZE, pj->in);
+        }
+        if (slot->block.bytes_read == 0) {
+            pj->eof = 1;
+            PyThread_release_lock(slot->free);
+            PyThread_release_lock(pj->read_lock);
+            break;
+        }
+        pj->next_read++;
+        pj->total_read += slot->block.bytes_read;
+        PyThread_release_lock(pj->read_lock);
+
+        pack_block_compress(&slot->block, pj->method, pj->level);
+
+        PyThread_acquire_lock(pj->write_lock, 1);
+        slot->ready = 1;
+        if (!pj->writing) {
+            pj->writing = 1;
+            for (;;) {
+                pack_slot *next = &pj->slots[pj->next_write % pj->nslots];
+                if (!next->ready)
+                    break;
+                next->ready = 0;
+                PyThread_release_lock(pj->write_lock);
+                pack_block_write(pj->f, &next->block, pj->index);
+                PyThread_acquire_lock(pj->write_lock, 1);
+                pj->next_write++;
+                PyThread_release_lock(next->free);
+            }
+            pj->writing = 0;
+        }
+        PyThread_release_lock(pj->write_lock);
+    }
+}
+
+/* runs on the caller and nworkers pool workers taken by _pack_file */
+static int
+pack_blocks_threads(FILE *in, const unsigned char *map, unsigned long long fsize, FILE *f,
+                    pack_index *index, int method, int level, int nworkers, int inflight,
+                    unsigned long long *total_read, char *error)
+{
+    pack_job pj;
+    int status = 0;
+    int i;
+
+    memset(&pj, 0, sizeof(pj));
+    pj.in = in;
+    pj.map = map;
+    pj.fsize = fsize;
+    pj.f = f;
+    pj.index = index;
+    pj.method = method;
+    pj.level = level;
+    pj.nslots = (inflight > 0) ? inflight : 2 * (nworkers + 1);
+    pj.slots = (pack_slot *)calloc(pj.nslots, sizeof(pack_slot));
+    pj.read_lock = PyThread_allocate_lock();
+    pj.write_lock = PyThread_allocate_lock();
+    if (pj.slots == NULL || pj.read_lock == NULL || pj.write_lock == NULL)
+        status = -1;
+    for (i = 0; status == 0 && i < pj.nslots; i++) {
+        pack_slot *slot = &pj.slots[i];
+        /* a mapped file is compressed where it lies */
+        if (map == NULL)
+            slot->block.buffer = (unsigned char *)malloc(BLOCK_SIZE);
+        slot->block.result = (unsigned char *)malloc(PACK_RESULT_SIZE);
+        slot->block.result_size = PACK_RESULT_SIZE;
+        slot->free = PyThread_allocate_lock();
+        if ((map == NULL && slot->block.buffer == NULL) || slot->block.result == NULL ||
+            slot->free == NULL)
+            status = -1;
+    }
+    if (status == 0) {
+        pool_run(pack_blocks_run, &pj, nworkers);
+        *total_read = pj.total_read;
+    }
+    else
+        snprintf(error, SIXPACK_ERROR_SIZE, "out of memory");
+
+    for (i = 0; pj.slots != NULL && i < pj.nslots; i++) {
+        free(pj.slots[i].block.buffer);
+        free(pj.slots[i].block.result);
+        if (pj.slots[i].free)
+            PyThread_free_lock(pj.slots[i].free);
     }
-#if defined(DEBUG)
-	printf("in decompressing\n");
-    osize = fastlz_decompress(input, isize, output, isize * 6 / 5);
-	printf("osize : %d\n", osize);
+    free(pj.slots);
+    if (pj.read_lock)
+        PyThread_free_lock(pj.read_lock);
+    if (pj.write_lock)
+        PyThread_free_lock(pj.write_lock);
+    return status;
+}
 #endif
-    result = Py_BuildValue("s#", output, osize);
-    return result;
+
+#ifdef SIXPACK_PARALLEL_UNPACK
+/*
+ * unpack_file(threads=n) takes the run of chunks 17 of a file at once. The
+ * chunk headers are read first to place every block in the archive and in
+ * the file, then the pool checks, decompresses and pwrites the blocks. A
+ * file that fails is cut where the serial loop would have stopped writing
+ * it, with the same message.
+ * */
+enum {
+    UNPACK_OK,
+    UNPACK_CHECKSUM,
+    UNPACK_CORRUPT,
+    UNPACK_METHOD,
+    UNPACK_NOMEM
+};
+
+typedef struct {
+    unsigned long long offset;
+    unsigned long long out_offset;
+    unsigned long size;
+    unsigned long checksum;
+    unsigned long extra;
+    int options;
+    int mapped;
+    int status;
+    unsigned long got;
+    unsigned long written;
+} unpack_chunk;
+
+typedef struct {
+    int in;
+    int out;
+    const unsigned char *map;
+    unpack_chunk *chunks;
+    size_t count;
+    size_t next;
+    size_t failed;
+    PyThread_type_lock lock;
+} unpack_job;
+
+static void
+unpack_pwrite(int fd, const unsigned char *buf, size_t length, unsigned long long offset)
+{
+    /* like the serial loop, a failed write shows up in the file and not here */
+    while (length > 0) {
+        ssize_t n = pwrite(fd, buf, length, (off_t)offset);
+        if (n <= 0)
+            break;
+        buf += n;
+        length -= n;
+        offset += n;
+    }
+}
+
+/* grows a buffer of a worker, returns 0 if out of memory */
+static int
+unpack_grow(unsigned char **buffer, unsigned long *bufsize, unsigned long size)
+{
+    if (size > *bufsize) {
+        free(*buffer);
+        *buffer = (unsigned char *)malloc(size);
+        *bufsize = (*buffer != NULL) ? size : 0;
+    }
+    return *buffer != NULL;
+}
+
+static void
+unpack_chunk_run(unpack_job *uj, unpack_chunk *chunk, unsigned char **compressed,
+                 unsigned long *compressed_bufsize, unsigned char **decompressed,
+                 unsigned long *decompressed_bufsize)
+{
+    unsigned long checksum = 1L;
+    const unsigned char *data;
+    ssize_t n;
+
+    switch (chunk->options) {
+    /* stored, copied a block at a time and checked afterwards */
+    case 0:
+        if (!chunk->mapped && !unpack_grow(decompressed, decompressed_bufsize, BLOCK_SIZE)) {
+            chunk->status = UNPACK_NOMEM;
+            return;
+        }
+        while (chunk->written < chunk->size) {
+            unsigned long r = chunk->size - chunk->written;
+            if (r > BLOCK_SIZE)
+                r = BLOCK_SIZE;
+            if (chunk->mapped) {
+                data = uj->map + chunk->offset + chunk->written;
+                n = r;
+            }
+            else {
+                data = *decompressed;
+                n = pread(uj->in, *decompressed, r, (off_t)(chunk->offset + chunk->written));
+            }
+            if (n <= 0)
+                break;
+            unpack_pwrite(uj->out, data, n, chunk->out_offset + chunk->written);
+            checksum = update_adler32(checksum, data, (int)n);
+            chunk->written += n;
+        }
+        break;
+
+    /* compressed using FastLZ */
+    case 1:
+        if ((!chunk->mapped && !unpack_grow(compressed, compressed_bufsize, chunk->size)) ||
+            !unpack_grow(decompressed, decompressed_bufsize, chunk->extra)) {
+            chunk->status = UNPACK_NOMEM;
+            return;
+        }
+        if (chunk->mapped) {
+            data = uj->map + chunk->offset;
+            n = chunk->size;
+        }
+        else {
+            data = *compressed;
+            n = pread(uj->in, *compressed, chunk->size, (off_t)chunk->offset);
+            if (n < 0)
+                n = 0;
+        }
+        checksum = update_adler32(1L, data, (int)n);
+        if (n != (ssize_t)chunk->size) {
+            chunk->status = UNPACK_CHECKSUM;
+            chunk->got = checksum;
+            return;
+        }
+        if (checksum == chunk->checksum) {
+            if (fastlz_decompress_fast(data, chunk->size, *decompressed, chunk->extra)
+                    != (int)chunk->extra) {
+                chunk->status = UNPACK_CORRUPT;
+                return;
+            }
+            unpack_pwrite(uj->out, *decompressed, chunk->extra, chunk->out_offset);
+        }
+        break;
+
+    default:
+        chunk->status = UNPACK_METHOD;
+        return;
+    }
+    if (checksum != chunk->checksum) {
+        chunk->status = UNPACK_CHECKSUM;
+        chunk->got = checksum;
+    }
+}
+
+static void
+unpack_chunks_run(void *arg, int worker)
+{
+    unpack_job *uj = (unpack_job *)arg;
+    unsigned char *compressed = NULL;
+    unsigned char *decompressed = NULL;
+    unsigned long compressed_bufsize = 0;
+    unsigned long decompressed_bufsize = 0;
+    size_t i;
+
+    for (;;) {
+        /* nothing after the first failed chunk is kept */
+        PyThread_acquire_lock(uj->lock, 1);
+        i = uj->next++;
+        if (i > uj->failed)
+            i = uj->count;
+        PyThread_release_lock(uj->lock);
+        if (i >= uj->count)
+            break;
+        unpack_chunk_run(uj, &uj->chunks[i], &compressed, &compressed_bufsize,
+                         &decompressed, &decompressed_bufsize);
+        if (uj->chunks[i].status != UNPACK_OK) {
+            PyThread_acquire_lock(uj->lock, 1);
+            if (i < uj->failed)
+                uj->failed = i;
+            PyThread_release_lock(uj->lock);
+        }
+    }
+    free(compressed);
+    free(decompressed);
+}
+
+/*
+ * Unpacks the chunks 17 from the one at *pos on, leaving *pos and
+ * *chunk_size at the last of them. Returns 0 when they are all written, 1
+ * when the file is to be skipped and -1 when the archive can not be read
+ * on, with the reason in error.
+ * */
+static int
+unpack_chunks_threads(FILE *in, const unsigned char *map, unsigned long long fsize,
+                      unsigned long long *pos, unsigned long *chunk_size, FILE *f,
+                      const char *output_file, int nworkers, char *error)
+{
+    unpack_job uj;
+    unpack_chunk *chunk;
+    unsigned long long out_offset;
+    size_t capacity = 0;
+    unsigned long long p = *pos;
+    int status = 0;
+
+    memset(&uj, 0, sizeof(uj));
+    uj.in = fileno(in);
+    uj.out = fileno(f);
+    uj.map = map;
+    /* the earlier runs of this file went out with pwrite too */
+    fflush(f);
+    out_offset = (unsigned long long)lseek(uj.out, 0, SEEK_END);
+
+    /* the offset map, from the chunk headers */
+    while (p < fsize) {
+        int id, options;
+        unsigned long size, checksum, extra;
+
+        SIXPACK_FSEEK(in, p, SEEK_SET);
+        read_chunk_header(in, &id, &options, &size, &checksum, &extra);
+        if (id != 17)
+            break;
+        if (uj.count == capacity) {
+            size_t grown = capacity ? 2 * capacity : 256;
+            unpack_chunk *chunks = (unpack_chunk *)realloc(uj.chunks, grown * sizeof(unpack_chunk));
+            if (chunks == NULL) {
+                snprintf(error, SIXPACK_ERROR_SIZE, "out of memory");
+                free(uj.chunks);
+                return -1;
+            }
+            uj.chunks = chunks;
+            capacity = grown;
+        }
+        chunk = &uj.chunks[uj.count++];
+        memset(chunk, 0, sizeof(*chunk));
+        chunk->offset = p + 16;
+        chunk->out_offset = out_offset;
+        chunk->size = size;
+        chunk->checksum = checksum;
+        chunk->extra = extra;
+        chunk->options = options;
+        chunk->mapped = map && p + 16 <= fsize && size <= fsize - p - 16;
+        out_offset += (options == 0) ? size : extra;
+        *pos = p;
+        *chunk_size = size;
+        p += 16 + size;
+    }
+
+    uj.failed = uj.count;
+    uj.lock = PyThread_allocate_lock();
+    if (uj.lock == NULL) {
+        snprintf(error, SIXPACK_ERROR_SIZE, "out of memory");
+        free(uj.chunks);
+        return -1;
+    }
+    pool_run(unpack_chunks_run, &uj, nworkers);
+    PyThread_free_lock(uj.lock);
+
+    if (uj.failed < uj.count) {
+        chunk = &uj.chunks[uj.failed];
+        status = 1;
+        switch (chunk->status) {
+        case UNPACK_CHECKSUM:
+            snprintf(error, SIXPACK_ERROR_SIZE,
+                     "checksum mismatch in %s, got %08lX expecting %08lX",
+                     output_file, chunk->got, chunk->checksum);
+            break;
+        case UNPACK_CORRUPT:
+            snprintf(error, SIXPACK_ERROR_SIZE, "decompression of %s failed", output_file);
+            break;
+        case UNPACK_METHOD:
+            snprintf(error, SIXPACK_ERROR_SIZE, "unknown compression method (%d) in %s",
+                     chunk->options, output_file);
+            break;
+        default:
+            snprintf(error, SIXPACK_ERROR_SIZE, "out of memory");
+            status = -1;
+            break;
+        }
+        /* a stored chunk is written before it is checked */
+        if (ftruncate(uj.out, (off_t)(chunk->out_offset + chunk->written)) != 0 && status > 0)
+            snprintf(error, SIXPACK_ERROR_SIZE, "%s failed and could not be truncated",
+                     output_file);
+    }
+    free(uj.chunks);
+    return status;
 }
+#endif
+
+static char fastlz_pack_file_doc[] =
+    "pack_file(level, input_file, archive_file[, threads[, inflight[, mmap[, "
+    "index]]]]) -- Compress input_file into a new 6pack archive. Raises fastlz.error on "
+    "failure. With threads > 1 the blocks are compressed on up to that many "
+    "threads and written in order, the archive is the same. At most inflight "
+    "blocks of 128 KB, twice the number of threads by default, are held at "
+    "a time. With mmap=True the file is compressed straight from a "
+    "mapping instead of being read, it must not shrink meanwhile. With "
+    "index=True the archive ends with an index of the blocks, 16 bytes per "
+    "128 KB, that read_range() uses to find them.\n"
+    ;
+
+static char fastlz_unpack_file_doc[] =
+    "unpack_file(archive_file[, threads[, mmap]]) -- Extract the files of a "
+    "6pack archive into the current directory. Files that already exist are "
+    "not overwritten; when a file is skipped fastlz.error is raised after the "
+    "others are extracted. With threads > 1 the blocks of a file are checked, "
+    "decompressed and written on up to that many threads. With mmap=True the "
+    "archive is decompressed straight from a mapping instead of being read.\n"
+    ;
 
 static PyObject *
-_pack_file(PyObject *self, PyObject *args)
+_pack_file(PyObject *self, PyObject *args, PyObject *kwds)
 {
+    static char *kwlist[] = {"level", "input_file", "archive_file", "threads", "inflight",
+                             "mmap", "index", NULL};
     int level;
+    int result;
+    int nthreads = 1;
+    int inflight = 0;
+    int use_mmap = 0;
+    int with_index = 0;
+    int nworkers;
     const char *input_file;
     const char *output_file;
-    if (!PyArg_ParseTuple(args, "iss", &level, &input_file, &output_file))
+    char error[SIXPACK_ERROR_SIZE];
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iss|iiii", kwlist, &level, &input_file,
+                                     &output_file, &nthreads, &inflight, &use_mmap,
+                                     &with_index))
         return NULL;
-    pack_file(level, input_file, output_file);
-    return NULL;
+    if (!check_level(level, 0))
+        return NULL;
+    nworkers = pool_acquire(nthreads);
+    Py_BEGIN_ALLOW_THREADS
+    result = pack_file(level, input_file, output_file, nworkers, inflight, use_mmap,
+                       with_index, error);
+    Py_END_ALLOW_THREADS
+    pool_release(nworkers);
+    if (result != 0) {
+        PyErr_SetString(FastlzError, error);
+        return NULL;
+    }
+    Py_RETURN_NONE;
 }
+
 static PyObject *
-_unpack_file(PyObject *self, PyObject *args)
+_unpack_file(PyObject *self, PyObject *args, PyObject *kwds)
 {
+    static char *kwlist[] = {"archive_file", "threads", "mmap", NULL};
+    int result;
+    int nthreads = 1;
+    int nworkers = 0;
+    int use_mmap = 0;
+    const char *archive_file;
+    char error[SIXPACK_ERROR_SIZE];
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|ii", kwlist, &archive_file, &nthreads,
+                                     &use_mmap))
+        return NULL;
+#ifdef SIXPACK_PARALLEL_UNPACK
+    nworkers = pool_acquire(nthreads);
+#endif
+    Py_BEGIN_ALLOW_THREADS
+    result = unpack_file(archive_file, nworkers, use_mmap, error);
+    Py_END_ALLOW_THREADS
+    pool_release(nworkers);
+    if (result != 0) {
+        PyErr_SetString(FastlzError, error);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static char fastlz_read_range_doc[] =
+    "read_range(archive_file, name, offset, length) -- Return up to length "
+    "bytes at offset of the file name in a 6pack archive, name as stored, "
+    "without its directory. Only the blocks that hold them are read and "
+    "decompressed, found through the index of pack_file(index=True) or else "
+    "by walking the chunk headers. Raises fastlz.error if name is not in the "
+    "archive or a block it needs is damaged.\n"
+    ;
 
+static PyObject *
+_read_range(PyObject *self, PyObject *args)
+{
+    PyObject *result;
     const char *archive_file;
-    if (!PyArg_ParseTuple(args, "s", &archive_file))
+    const char *name;
+    PY_LONG_LONG offset;
+    Py_ssize_t length;
+    sixpack_file sf;
+    int status;
+    char error[SIXPACK_ERROR_SIZE];
+
+    /* the offset can be past what a Py_ssize_t holds, the length can not */
+    if (!PyArg_ParseTuple(args, "ssLn:read_range", &archive_file, &name, &offset, &length))
         return NULL;
-    unpack_file(archive_file);
-    return NULL;
+    if (offset < 0 || length < 0) {
+        PyErr_SetString(PyExc_ValueError, "offset and length must not be negative");
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    status = sixpack_open(&sf, archive_file, name, error);
+    Py_END_ALLOW_THREADS
+    if (status != 0) {
+        PyErr_SetString(FastlzError, error);
+        return NULL;
+    }
+
+    if ((unsigned long long)offset >= sf.size)
+        offset = length = 0;
+    else if ((unsigned long long)length > sf.size - offset)
+        length = (Py_ssize_t)(sf.size - offset);
+    result = PyString_FromStringAndSize(NULL, length);
+    if (result != NULL && length > 0) {
+        Py_BEGIN_ALLOW_THREADS
+        status = sixpack_read(&sf, offset, length, (unsigned char *)PyString_AS_STRING(result),
+                              error);
+        Py_END_ALLOW_THREADS
+        if (status != 0) {
+            PyErr_SetString(FastlzError, error);
+            Py_CLEAR(result);
+        }
+    }
+    sixpack_close(&sf);
+    return result;
+}
+
+static char fastlz_cpu_features_doc[] =
+    "cpu_features() -- Return a tuple with the names of the instruction sets "
+    "the codec can use on this machine, e.g. ('sse2', 'sse4.2', 'avx2').\n"
+    ;
+
+static char fastlz_active_kernel_doc[] =
+    "active_kernel([name]) -- Return the name of the codec build in use, "
+    "'generic', 'sse2', 'sse4.2', 'avx2' or 'avx512'. With a name, make that "
+    "build the active one first, e.g. to compare or benchmark them; it must "
+    "be in this build of the module and supported by the CPU. All builds "
+    "give the same output.\n"
+    ;
+
+/* each instruction set needs the ones before it */
+static const struct {
+    int feature;
+    const char *name;
+} cpu_feature_names[] = {
+    {FASTLZ_CPU_SSE2, "sse2"},
+    {FASTLZ_CPU_SSE42, "sse4.2"},
+    {FASTLZ_CPU_AVX2, "avx2"},
+    {FASTLZ_CPU_AVX512, "avx512"},
+};
+
+#define CPU_FEATURE_NAMES (sizeof(cpu_feature_names) / sizeof(cpu_feature_names[0]))
+
+static PyObject *
+_cpu_features(PyObject *self, PyObject *unused)
+{
+    int features = fastlz_cpu_features();
+    PyObject *list, *result;
+    size_t i;
+
+    list = PyList_New(0);
+    if (list == NULL)
+        return NULL;
+    for (i = 0; i < CPU_FEATURE_NAMES; i++) {
+        PyObject *v;
+        if (!(features & cpu_feature_names[i].feature))
+            continue;
+        v = PyString_FromString(cpu_feature_names[i].name);
+        if (v == NULL || PyList_Append(list, v) < 0) {
+            Py_XDECREF(v);
+            Py_DECREF(list);
+            return NULL;
+        }
+        Py_DECREF(v);
+    }
+    result = PyList_AsTuple(list);
+    Py_DECREF(list);
+    return result;
+}
+
+/* the features a codec build needs, -1 for an unknown name */
+static int
+kernel_features(const char *name)
+{
+    int features = 0;
+    size_t i;
+
+    /* the portable build needs none, the others theirs and all before */
+    if (strcmp(name, "generic") == 0)
+        return 0;
+    for (i = 0; i < CPU_FEATURE_NAMES; i++) {
+        features |= cpu_feature_names[i].feature;
+        if (strcmp(name, cpu_feature_names[i].name) == 0)
+            return features;
+    }
+    return -1;
+}
+
+static PyObject *
+_active_kernel(PyObject *self, PyObject *args)
+{
+    const char *name = NULL;
+    const char *previous;
+    int features;
+
+    if (!PyArg_ParseTuple(args, "|s", &name))
+        return NULL;
+    if (name == NULL)
+        return PyString_FromString(fastlz_kernel_name());
+
+    features = kernel_features(name);
+    if (features < 0) {
+        PyErr_Format(PyExc_ValueError, "unknown codec build %s", name);
+        return NULL;
+    }
+    if ((features & ~fastlz_cpu_features()) != 0) {
+        PyErr_Format(PyExc_ValueError, "codec build %s is not supported by this CPU", name);
+        return NULL;
+    }
+    /* a module built without it picks another one, put the old one back */
+    previous = fastlz_kernel_name();
+    if (strcmp(fastlz_use_kernel(features), name) != 0) {
+        fastlz_use_kernel(kernel_features(previous));
+        PyErr_Format(PyExc_ValueError, "codec build %s is not in this module", name);
+        return NULL;
+    }
+    return PyString_FromString(name);
+}
+
+static char fastlz_stats_doc[] =
+    "stats() -- Return the codec statistics of this process as a dict. The "
+    "keys are (function, level) tuples, level None for decompression and "
+    "for batches that leave the level to the codec; only the pairs that "
+    "were called are there. Each value is a dict with calls, failures, "
+    "bytes_in and bytes_out of the calls that succeeded, and nanoseconds "
+    "and histogram, a tuple where item i counts the calls that took 2**i "
+    "to 2**(i + 1) - 1 ns, filled in only while stats_timing() is on.\n"
+    ;
+
+static char fastlz_reset_stats_doc[] =
+    "reset_stats() -- Set all codec statistics back to zero.\n"
+    ;
+
+static char fastlz_stats_timing_doc[] =
+    "stats_timing([enable]) -- Return whether the codec calls are timed for "
+    "stats(), after turning it on or off if enable is given. It is off by "
+    "default, reading the clock costs more than counting.\n"
+    ;
+
+static PyObject *
+stats_entry(codec_stats *stats)
+{
+    PyObject *histogram;
+    int i;
+
+    histogram = PyTuple_New(STAT_BUCKETS);
+    if (histogram == NULL)
+        return NULL;
+    for (i = 0; i < STAT_BUCKETS; i++) {
+        PyObject *v = PyLong_FromUnsignedLongLong(stats->histogram[i]);
+        if (v == NULL) {
+            Py_DECREF(histogram);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(histogram, i, v);
+    }
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:N}",
+                         "calls", stats->calls,
+                         "failures", stats->failures,
+                         "bytes_in", stats->bytes_in,
+                         "bytes_out", stats->bytes_out,
+                         "nanoseconds", stats->nanoseconds,
+                         "histogram", histogram);
+}
+
+static PyObject *
+_stats(PyObject *self, PyObject *unused)
+{
+    PyObject *result;
+    int function, level;
+
+    result = PyDict_New();
+    if (result == NULL)
+        return NULL;
+    for (function = 0; function < STAT_FUNCTIONS; function++) {
+        for (level = 0; level < STAT_LEVELS; level++) {
+            codec_stats *stats = &stats_table[function][level];
+            PyObject *key, *value;
+            int status;
+
+            if (stats->calls == 0)
+                continue;
+            if (level == 0)
+                key = Py_BuildValue("(sO)", stats_names[function], Py_None);
+            else
+                key = Py_BuildValue("(si)", stats_names[function], level);
+            value = stats_entry(stats);
+            status = (key != NULL && value != NULL) ? PyDict_SetItem(result, key, value) : -1;
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+            if (status < 0) {
+                Py_DECREF(result);
+                return NULL;
+            }
+        }
+    }
+    return result;
+}
+
+static PyObject *
+_reset_stats(PyObject *self, PyObject *unused)
+{
+    memset(stats_table, 0, sizeof(stats_table));
+    Py_RETURN_NONE;
 }
+
+static PyObject *
+_stats_timing(PyObject *self, PyObject *args)
+{
+    PyObject *enable = NULL;
+    int on;
+
+    if (!PyArg_ParseTuple(args, "|O:stats_timing", &enable))
+        return NULL;
+    if (enable != NULL) {
+        on = PyObject_IsTrue(enable);
+        if (on < 0)
+            return NULL;
+        stats_timing_on = on;
+    }
+    return PyBool_FromLong(stats_timing_on);
+}
+
 static PyMethodDef fastlz_methods[] =
 {
-    {"compress",             (PyCFunction)compress, METH_VARARGS, fastlz_compress_doc},
-    {"decompress",           (PyCFunction)decompress, METH_VARARGS, fastlz_decompress_doc},
-    {"pack_file",            (PyCFunction)_pack_file, METH_VARARGS, NULL},
-    {"unpack_file",          (PyCFunction)_unpack_file, METH_VARARGS, NULL},
+    {"compress",             (PyCFunction)compress, METH_VARARGS | METH_KEYWORDS, fastlz_compress_doc},
+    {"decompress",           (PyCFunction)decompress, METH_VARARGS | METH_KEYWORDS, fastlz_decompress_doc},
+    {"decompress_range",     (PyCFunction)decompress_range, METH_VARARGS, fastlz_decompress_range_doc},
+    {"decompressed_size",    (PyCFunction)_decompressed_size, METH_VARARGS, fastlz_decompressed_size_doc},
+    {"validate",             (PyCFunction)_validate, METH_VARARGS, fastlz_validate_doc},
+    {"compress_bound",       (PyCFunction)_compress_bound, METH_VARARGS, fastlz_compress_bound_doc},
+    {"compress_batch",       (PyCFunction)compress_batch, METH_VARARGS | METH_KEYWORDS, fastlz_compress_batch_doc},
+    {"decompress_batch",     (PyCFunction)decompress_batch, METH_VARARGS | METH_KEYWORDS, fastlz_decompress_batch_doc},
+    {"compress_into",        (PyCFunction)compress_into, METH_VARARGS | METH_KEYWORDS, fastlz_compress_into_doc},
+    {"decompress_into",      (PyCFunction)decompress_into, METH_VARARGS | METH_KEYWORDS, fastlz_decompress_into_doc},
+    {"train_dict",           (PyCFunction)_train_dict, METH_VARARGS, fastlz_train_dict_doc},
+    {"pack_file",            (PyCFunction)_pack_file, METH_VARARGS | METH_KEYWORDS, fastlz_pack_file_doc},
+    {"unpack_file",          (PyCFunction)_unpack_file, METH_VARARGS | METH_KEYWORDS, fastlz_unpack_file_doc},
+    {"read_range",           (PyCFunction)_read_range, METH_VARARGS, fastlz_read_range_doc},
+    {"cpu_features",         (PyCFunction)_cpu_features, METH_NOARGS, fastlz_cpu_features_doc},
+    {"active_kernel",        (PyCFunction)_active_kernel, METH_VARARGS, fastlz_active_kernel_doc},
+    {"stats",                (PyCFunction)_stats, METH_NOARGS, fastlz_stats_doc},
+    {"reset_stats",          (PyCFunction)_reset_stats, METH_NOARGS, fastlz_reset_stats_doc},
+    {"stats_timing",         (PyCFunction)_stats_timing, METH_VARARGS, fastlz_stats_timing_doc},
     {NULL, NULL, 0, NULL}
 };
 
@@ -882,21 +5035,57 @@ static char fastlz_doc[] =
     "using the fastlz library.\n\n"
     "compress(string) -- Compress a string, and returning a new string containing the compressed data.\n"
     "decompress(string) -- Decompress a string , and returning a new string containing the decompressed data.\n"
+    "compress_into(src, dst) -- Compress into a caller-owned buffer.\n"
+    "decompress_into(src, dst) -- Decompress into a caller-owned buffer.\n"
+    "decompress_range(string, offset, length) -- Decompress only a byte range.\n"
+    "validate(string) -- Check compressed data without decompressing it.\n"
+    "compress_batch(items) -- Compress a list of strings in one call.\n"
+    "decompress_batch(items) -- Decompress a list of strings in one call.\n"
+    "Compressor([level[, dict]]) -- Return a compressor object for compressing many strings.\n"
+    "train_dict(samples[, size]) -- Build a dictionary from sample strings.\n"
+    "CompressObj([level]) -- Return a compressor object for a stream of data.\n"
+    "DecompressObj() -- Return a decompressor object for a stream of data.\n"
+    "stats() -- Return call, byte and timing counters of the codec.\n"
     ;
 
 PyMODINIT_FUNC
 initfastlz(void)
 {
     PyObject *m, *dict, *v;
+    int features;
+
+    /* pick the best codec and checksum builds for this CPU, once */
+    features = fastlz_cpu_features();
+    fastlz_use_kernel(features);
+#if defined(ADLER32_SIMD)
+    if (features & FASTLZ_CPU_AVX2)
+        update_adler32_kernel = update_adler32_avx2;
+    else if (features & FASTLZ_CPU_SSE42)
+        update_adler32_kernel = update_adler32_ssse3;
+#endif
+    if (PyType_Ready(&CompressorType) < 0)
+        return;
+    if (PyType_Ready(&CompressType) < 0)
+        return;
+    if (PyType_Ready(&DecompressType) < 0)
+        return;
+
+    ctx_key = PyString_InternFromString("fastlz.compressor");
+    if (ctx_key == NULL)
+        return;
     m = Py_InitModule3("fastlz", fastlz_methods, fastlz_doc);
     if (m == NULL)
         return;
 
     dict = PyModule_GetDict(m);
 
-	FastlzError = PyErr_NewExecption("fastlz.error", NULL, NULL);
+	FastlzError = PyErr_NewException("fastlz.error", NULL, NULL);
 	PyDict_SetItemString(dict, "error", FastlzError);
 
+    PyDict_SetItemString(dict, "Compressor", (PyObject *)&CompressorType);
+    PyDict_SetItemString(dict, "CompressObj", (PyObject *)&CompressType);
+    PyDict_SetItemString(dict, "DecompressObj", (PyObject *)&DecompressType);
+
     v = PyString_FromString("Fu Haiping <email:haipingf@gmail.com>");
     PyDict_SetItemString(dict, "__author__", v);
     Py_DECREF(v);
@@ -71,47 +71,378 @@
 #undef FASTLZ_STRICT_ALIGN
 #elif defined(__I86__) /* Digital Mars */
 #undef FASTLZ_STRICT_ALIGN
+#elif defined(__x86_64__) || defined(__amd64__) || defined(_M_X64) || defined(_M_AMD64)
+#undef FASTLZ_STRICT_ALIGN
+#elif defined(__aarch64__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#undef FASTLZ_STRICT_ALIGN
+#elif defined(_M_ARM64) /* MSVC, always little-endian */
+#undef FASTLZ_STRICT_ALIGN
+#endif
+#endif
+
+/*
+ * Compare 64 bits at once when extending a match. Needs a little-endian
+ * 64-bit target and a way to count trailing zero bits.
+ */
+#if !defined(FASTLZ_STRICT_ALIGN) && !defined(FASTLZ_NO_WORD64)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__amd64__) || defined(__aarch64__))
+#define FASTLZ_WORD64
+#define FASTLZ_CTZ64(x) __builtin_ctzll(x)
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64) || defined(_M_ARM64))
+#include <intrin.h>
+#pragma intrinsic(_BitScanForward64)
+static __inline unsigned fastlz_ctz64(unsigned __int64 x)
+{
+  unsigned long r;
+  _BitScanForward64(&r, x);
+  return (unsigned)r;
+}
+#define FASTLZ_WORD64
+#define FASTLZ_CTZ64(x) fastlz_ctz64(x)
 #endif
 #endif
 
+#include <stdlib.h>
+#include <string.h>
+
 /*
  * FIXME: use preprocessor magic to set this on different platforms!
  */
 typedef unsigned char  flzuint8;
 typedef unsigned short flzuint16;
 typedef unsigned int   flzuint32;
+typedef unsigned long long flzuint64;
 
 /* prototypes */
 int fastlz_compress(const void* input, int length, void* output);
 int fastlz_compress_level(int level, const void* input, int length, void* output);
 int fastlz_decompress(const void* input, int length, void* output, int maxout);
+int fastlz_decompress_fast(const void* input, int length, void* output, int maxout);
+int fastlz_validate(const void* input, int length, int* out_size);
+int fastlz_validate_dict(int dict_len, const void* input, int length, int* out_size);
+int fastlz_compress_bounded(int level, const void* input, int length, void* output, int out_cap);
+int fastlz_compress_bounded_room(int level, const void* input, int length, void* output, int out_cap, size_t out_size);
+
+int fastlz_cpu_features(void);
+const char* fastlz_use_kernel(int features);
+const char* fastlz_kernel_name(void);
+
+typedef struct fastlz_ctx fastlz_ctx;
+fastlz_ctx* fastlz_ctx_create(void);
+int fastlz_compress_with_ctx(fastlz_ctx* ctx, int level, const void* input, int length, void* output);
+void fastlz_ctx_free(fastlz_ctx* ctx);
+int fastlz_ctx_load_dict(fastlz_ctx* ctx, const void* dict, int dict_len);
+int fastlz_compress_dict(int level, const void* dict, int dict_len, const void* input, int length, void* output);
+int fastlz_decompress_dict(const void* dict, int dict_len, const void* input, int length, void* output, int maxout);
+
+typedef struct fastlz_stream fastlz_stream;
+fastlz_stream* fastlz_stream_create(void);
+int fastlz_stream_compress(fastlz_stream* stream, int level, const void* input, int length, void* output);
+int fastlz_stream_decompress(fastlz_stream* stream, const void* input, int length, void* output, int maxout);
+void fastlz_stream_free(fastlz_stream* stream);
+size_t fastlz_blocks_bound(size_t length);
+size_t fastlz_compress_blocks(int level, const void* input, size_t length, void* output, size_t maxout);
+size_t fastlz_blocks_content_size(const void* input, size_t length);
+size_t fastlz_decompress_blocks(const void* input, size_t length, void* output, size_t maxout);
+size_t fastlz_blocks_write_header(size_t length, size_t block_size, void* output);
+size_t fastlz_compress_blocks_sized(int level, size_t block_size, const void* input, size_t length, void* output, size_t maxout);
+size_t fastlz_blocks_locate(const void* input, size_t length, size_t block);
+size_t fastlz_blocks_validate(const void* input, size_t length);
+void fastlz_shuffle(int itemsize, const void* input, size_t length, void* output);
+void fastlz_unshuffle(int itemsize, const void* input, size_t length, void* output);
+size_t fastlz_compress_block(int level, const void* input, size_t size, void* output, size_t maxout);
+size_t fastlz_blocks_block_size(const void* input, size_t length);
+size_t fastlz_blocks_index(const void* input, size_t length, size_t* offsets, size_t count);
+size_t fastlz_decompress_block(const void* input, size_t length, void* output, size_t size, size_t maxout);
+
+#define FASTLZ_CPU_SSE2    1
+#define FASTLZ_CPU_SSE42   2
+#define FASTLZ_CPU_AVX2    4
+#define FASTLZ_CPU_AVX512  8
+
+/* only the tail of a longer dictionary is kept */
+#define FASTLZ_DICT_MAX 65536
+
+/* covers the level 2 far window */
+#define FASTLZ_STREAM_HISTORY 73728
+
+/*
+ * fastlz_compress_bounded passes over literal runs faster the longer they
+ * get: every FASTLZ_SKIP_TRIGGER literals in a row make the step one byte
+ * longer, up to MAX_COPY. Such data is unlikely to compress anyway. Define
+ * FASTLZ_NO_SKIP to look at every position.
+ */
+#ifndef FASTLZ_SKIP_TRIGGER
+#define FASTLZ_SKIP_TRIGGER 64
+#endif
+
+/* how far fastlz_compress_bounded may write past the limit before it stops */
+#define FASTLZ_BOUND_SLACK 64
+
+#define FASTLZ_BLOCK_SIZE (1 << 20)
+#define FASTLZ_BLOCK_MIN (1 << 12)
+#define FASTLZ_BLOCKS_HEADER 16
+#define FASTLZ_BLOCK_STORED 0x80000000U
 
 #define MAX_COPY       32
 #define MAX_LEN       264  /* 256 + 8 */
 #define MAX_DISTANCE 8192
 
 #if !defined(FASTLZ_STRICT_ALIGN)
-#define FASTLZ_READU16(p) *((const flzuint16*)(p)) 
+/* memcpy is folded into a single (unaligned) load by the compiler */
+static FASTLZ_INLINE flzuint16 fastlz_readu16(const void* p)
+{
+  flzuint16 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+#define FASTLZ_READU16(p) fastlz_readu16(p)
 #else
 #define FASTLZ_READU16(p) ((p)[0] | (p)[1]<<8)
 #endif
 
+#if defined(FASTLZ_WORD64)
+
+static FASTLZ_INLINE flzuint64 fastlz_readu64(const void* p)
+{
+  flzuint64 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/*
+ * Returns the first position in [ip, limit) where ip and ref differ,
+ * or limit if they agree all the way. Both ranges must be readable.
+ */
+static FASTLZ_INLINE const flzuint8* fastlz_match_end(const flzuint8* ref,
+  const flzuint8* ip, const flzuint8* limit)
+{
+  while(ip + 8 <= limit)
+  {
+    flzuint64 diff = fastlz_readu64(ref) ^ fastlz_readu64(ip);
+    if(diff)
+      return ip + (FASTLZ_CTZ64(diff) >> 3);
+    ip += 8;
+    ref += 8;
+  }
+  while(ip < limit && *ref == *ip)
+  {
+    ip++;
+    ref++;
+  }
+  return ip;
+}
+
+/*
+ * Returns the first position in [ip, limit) whose byte is not x,
+ * or limit if the run goes all the way.
+ */
+static FASTLZ_INLINE const flzuint8* fastlz_run_end(flzuint8 x,
+  const flzuint8* ip, const flzuint8* limit)
+{
+  flzuint64 pattern = x * 0x0101010101010101ULL;
+  while(ip + 8 <= limit)
+  {
+    flzuint64 diff = fastlz_readu64(ip) ^ pattern;
+    if(diff)
+      return ip + (FASTLZ_CTZ64(diff) >> 3);
+    ip += 8;
+  }
+  while(ip < limit && *ip == x)
+    ip++;
+  return ip;
+}
+#endif
+
+/*
+ * Fixed-size copies for the wild-copy decompressor. These may read and write
+ * past the bytes that are actually needed, the callers leave enough room.
+ */
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define FASTLZ_COPY16(d,s) _mm_storeu_si128((__m128i*)(d), _mm_loadu_si128((const __m128i*)(s)))
+#else
+#define FASTLZ_COPY16(d,s) memcpy((d), (s), 16)
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define FASTLZ_COPY32(d,s) _mm256_storeu_si256((__m256i*)(d), _mm256_loadu_si256((const __m256i*)(s)))
+#else
+#define FASTLZ_COPY32(d,s) { FASTLZ_COPY16((d), (s)); FASTLZ_COPY16((flzuint8*)(d)+16, (const flzuint8*)(s)+16); }
+#endif
+#define FASTLZ_COPY8(d,s) memcpy((d), (s), 8)
+
+/*
+ * Far enough matches are copied in chunks of FASTLZ_WILD_CHUNK bytes with
+ * FASTLZ_WILD_COPY, and a match needs that much room past its end.
+ */
+#define FASTLZ_WILD_CHUNK 16
+#define FASTLZ_WILD_COPY(d,s) FASTLZ_COPY16(d,s)
+#define FASTLZ_WILD_SLACK FASTLZ_WILD_CHUNK
+
+/*
+ * Build the compressor and the wild-copy decompressor once more for each
+ * newer x86 instruction set, fastlz_use_kernel picks one at run time.
+ * Needs function target attributes and __builtin_cpu_supports.
+ */
+#if !defined(FASTLZ_NO_DISPATCH) && (defined(__x86_64__) || defined(__i386__))
+#if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 5))
+#define FASTLZ_DISPATCH
+#include <immintrin.h>
+#define FASTLZ_TARGET_SSE42  __attribute__((target("sse4.2,popcnt")))
+#define FASTLZ_TARGET_AVX2   __attribute__((target("avx2,bmi,bmi2,popcnt")))
+#define FASTLZ_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl,avx2,bmi,bmi2,popcnt")))
+#endif
+#endif
+
+#define FASTLZ_TARGET
+
+/*
+ * For a match closer than 8 bytes, once the first 8 bytes are expanded the
+ * output repeats with this period as well, and it is at least 8.
+ */
+static const flzuint8 fastlz_wild_period[8] = { 0, 8, 8, 9, 8, 10, 12, 14 };
+
 #define HASH_LOG  13
 #define HASH_SIZE (1<< HASH_LOG)
 #define HASH_MASK  (HASH_SIZE-1)
 #define HASH_FUNCTION(v,p) { v = FASTLZ_READU16(p); v ^= FASTLZ_READU16(p+1)^(v>>(16-HASH_LOG));v &= HASH_MASK; }
 
+/*
+ * Hash table entries are 32-bit tags: hbase plus the offset of the position
+ * in the input. A zeroed table with hbase 0 points everywhere at the start
+ * of the input. Between calls hbase moves past the previous input by
+ * HASH_GAP, which is more than the farthest match distance. Entries left over
+ * from an earlier call are below hbase and count as the start of the input,
+ * so a reused table compresses exactly like a zeroed one and the output does
+ * not depend on what the table saw before. With a dictionary the start of
+ * the input is no candidate: both stale and zeroed entries are out of reach
+ * there and the dictionary is tried instead.
+ */
+#define HASH_GAP (1 << 17)
+
+/* the largest hbase a context can compress at without its tags wrapping */
+#define HASH_LIMIT (0xffffffffU - 2 * HASH_GAP - FASTLZ_DICT_MAX)
+
+struct fastlz_ctx
+{
+  flzuint32 htab[HASH_SIZE];
+  flzuint32 hbase;
+
+  /* preset dictionary, see fastlz_ctx_load_dict */
+  flzuint32* dtab;    /* dictionary position plus one, 0 for none */
+  flzuint8* window;   /* the dictionary, followed by room for the input */
+  int dict_len;
+  int window_size;
+};
+
+
+/*
+ * A stream compresses each block right behind the history in its window.
+ * Tags keep counting across blocks, so the history is still in the hash
+ * table. When the window slides, hbase moves along with the data.
+ */
+struct fastlz_stream
+{
+  flzuint32 htab[HASH_SIZE];
+  flzuint32 hbase;
+  flzuint8* window;
+  int history;
+  int window_size;
+};
+
+/* the dictionary compressors with no dictionary table, for streams */
+static const flzuint32 fastlz_no_dict[HASH_SIZE];
+
 #undef FASTLZ_LEVEL
 #define FASTLZ_LEVEL 1
 
 #undef FASTLZ_COMPRESSOR
 #undef FASTLZ_DECOMPRESSOR
+#undef FASTLZ_FAST_DECOMPRESSOR
 #define FASTLZ_COMPRESSOR fastlz1_compress
 #define FASTLZ_DECOMPRESSOR fastlz1_decompress
-static FASTLZ_INLINE int FASTLZ_COMPRESSOR(const void* input, int length, void* output);
+#define FASTLZ_FAST_DECOMPRESSOR fastlz1_decompress_fast
+#define FASTLZ_VALIDATOR fastlz1_validate
+static FASTLZ_INLINE int FASTLZ_COMPRESSOR(flzuint32* htab, flzuint32 hbase, const void* input, int length, void* output);
 static FASTLZ_INLINE int FASTLZ_DECOMPRESSOR(const void* input, int length, void* output, int maxout);
+static FASTLZ_INLINE int FASTLZ_FAST_DECOMPRESSOR(const void* input, int length, void* output, int maxout);
+static FASTLZ_INLINE int FASTLZ_VALIDATOR(int dict_len, const void* input, int length);
+#include "fastlz.c"
+#undef FASTLZ_VALIDATOR
+
+#if defined(FASTLZ_DISPATCH)
+#undef FASTLZ_TARGET
+#define FASTLZ_TARGET FASTLZ_TARGET_SSE42
+#undef FASTLZ_COMPRESSOR
+#undef FASTLZ_DECOMPRESSOR
+#undef FASTLZ_FAST_DECOMPRESSOR
+#define FASTLZ_COMPRESSOR fastlz1_compress_sse42
+#define FASTLZ_DECOMPRESSOR fastlz1_decompress_sse42
+#define FASTLZ_FAST_DECOMPRESSOR fastlz1_decompress_fast_sse42
+#include "fastlz.c"
+
+#undef FASTLZ_TARGET
+#undef FASTLZ_WILD_CHUNK
+#undef FASTLZ_WILD_COPY
+#define FASTLZ_TARGET FASTLZ_TARGET_AVX2
+#define FASTLZ_WILD_CHUNK 32
+#define FASTLZ_WILD_COPY(d,s) _mm256_storeu_si256((__m256i*)(d), _mm256_loadu_si256((const __m256i*)(s)))
+#undef FASTLZ_COMPRESSOR
+#undef FASTLZ_DECOMPRESSOR
+#undef FASTLZ_FAST_DECOMPRESSOR
+#define FASTLZ_COMPRESSOR fastlz1_compress_avx2
+#define FASTLZ_DECOMPRESSOR fastlz1_decompress_avx2
+#define FASTLZ_FAST_DECOMPRESSOR fastlz1_decompress_fast_avx2
 #include "fastlz.c"
 
+#undef FASTLZ_TARGET
+#undef FASTLZ_WILD_CHUNK
+#undef FASTLZ_WILD_COPY
+#define FASTLZ_TARGET FASTLZ_TARGET_AVX512
+#define FASTLZ_WILD_CHUNK 64
+#define FASTLZ_WILD_COPY(d,s) _mm512_storeu_si512((void*)(d), _mm512_loadu_si512((const void*)(s)))
+#undef FASTLZ_COMPRESSOR
+#undef FASTLZ_DECOMPRESSOR
+#undef FASTLZ_FAST_DECOMPRESSOR
+#define FASTLZ_COMPRESSOR fastlz1_compress_avx512
+#define FASTLZ_DECOMPRESSOR fastlz1_decompress_avx512
+#define FASTLZ_FAST_DECOMPRESSOR fastlz1_decompress_fast_avx512
+#include "fastlz.c"
+
+#undef FASTLZ_TARGET
+#undef FASTLZ_WILD_CHUNK
+#undef FASTLZ_WILD_COPY
+#define FASTLZ_TARGET
+#define FASTLZ_WILD_CHUNK 16
+#define FASTLZ_WILD_COPY(d,s) FASTLZ_COPY16(d,s)
+#endif
+
+/* variants that can match into a preset dictionary, see fastlz_ctx_load_dict */
+#define FASTLZ_DICT
+#undef FASTLZ_COMPRESSOR
+#undef FASTLZ_DECOMPRESSOR
+#undef FASTLZ_FAST_DECOMPRESSOR
+#define FASTLZ_COMPRESSOR fastlz1_compress_dict
+#define FASTLZ_DECOMPRESSOR fastlz1_decompress_dict
+#define FASTLZ_FAST_DECOMPRESSOR fastlz1_decompress_dict
+static FASTLZ_INLINE int FASTLZ_COMPRESSOR(flzuint32* htab, flzuint32 hbase, const flzuint32* dtab, int dict_len, const void* input, int length, void* output);
+static FASTLZ_INLINE int FASTLZ_FAST_DECOMPRESSOR(const void* dict, int dict_len, const void* input, int length, void* output, int maxout);
+#include "fastlz.c"
+#undef FASTLZ_DICT
+
+/* stops once the output can not fit, see fastlz_compress_bounded */
+#define FASTLZ_BOUNDED
+#undef FASTLZ_COMPRESSOR
+#undef FASTLZ_DECOMPRESSOR
+#undef FASTLZ_FAST_DECOMPRESSOR
+#define FASTLZ_COMPRESSOR fastlz1_compress_bounded
+#define FASTLZ_DECOMPRESSOR fastlz1_decompress_bounded
+#define FASTLZ_FAST_DECOMPRESSOR fastlz1_decompress_fast_bounded
+static FASTLZ_INLINE int FASTLZ_COMPRESSOR(flzuint32* htab, flzuint32 hbase, const void* input, int length, void* output, int maxout);
+#include "fastlz.c"
+#undef FASTLZ_BOUNDED
+
 #undef FASTLZ_LEVEL
 #define FASTLZ_LEVEL 2
 
@@ -121,61 +452,1197 @@ static FASTLZ_INLINE int FASTLZ_DECOMPRESSOR(const void* input, int length, void
 
 #undef FASTLZ_COMPRESSOR
 #undef FASTLZ_DECOMPRESSOR
+#undef FASTLZ_FAST_DECOMPRESSOR
 #define FASTLZ_COMPRESSOR fastlz2_compress
 #define FASTLZ_DECOMPRESSOR fastlz2_decompress
-static FASTLZ_INLINE int FASTLZ_COMPRESSOR(const void* input, int length, void* output);
+#define FASTLZ_FAST_DECOMPRESSOR fastlz2_decompress_fast
+#define FASTLZ_VALIDATOR fastlz2_validate
+static FASTLZ_INLINE int FASTLZ_COMPRESSOR(flzuint32* htab, flzuint32 hbase, const void* input, int length, void* output);
 static FASTLZ_INLINE int FASTLZ_DECOMPRESSOR(const void* input, int length, void* output, int maxout);
+static FASTLZ_INLINE int FASTLZ_FAST_DECOMPRESSOR(const void* input, int length, void* output, int maxout);
+static FASTLZ_INLINE int FASTLZ_VALIDATOR(int dict_len, const void* input, int length);
+#include "fastlz.c"
+#undef FASTLZ_VALIDATOR
+
+#if defined(FASTLZ_DISPATCH)
+#undef FASTLZ_TARGET
+#define FASTLZ_TARGET FASTLZ_TARGET_SSE42
+#undef FASTLZ_COMPRESSOR
+#undef FASTLZ_DECOMPRESSOR
+#undef FASTLZ_FAST_DECOMPRESSOR
+#define FASTLZ_COMPRESSOR fastlz2_compress_sse42
+#define FASTLZ_DECOMPRESSOR fastlz2_decompress_sse42
+#define FASTLZ_FAST_DECOMPRESSOR fastlz2_decompress_fast_sse42
+#include "fastlz.c"
+
+#undef FASTLZ_TARGET
+#undef FASTLZ_WILD_CHUNK
+#undef FASTLZ_WILD_COPY
+#define FASTLZ_TARGET FASTLZ_TARGET_AVX2
+#define FASTLZ_WILD_CHUNK 32
+#define FASTLZ_WILD_COPY(d,s) _mm256_storeu_si256((__m256i*)(d), _mm256_loadu_si256((const __m256i*)(s)))
+#undef FASTLZ_COMPRESSOR
+#undef FASTLZ_DECOMPRESSOR
+#undef FASTLZ_FAST_DECOMPRESSOR
+#define FASTLZ_COMPRESSOR fastlz2_compress_avx2
+#define FASTLZ_DECOMPRESSOR fastlz2_decompress_avx2
+#define FASTLZ_FAST_DECOMPRESSOR fastlz2_decompress_fast_avx2
+#include "fastlz.c"
+
+#undef FASTLZ_TARGET
+#undef FASTLZ_WILD_CHUNK
+#undef FASTLZ_WILD_COPY
+#define FASTLZ_TARGET FASTLZ_TARGET_AVX512
+#define FASTLZ_WILD_CHUNK 64
+#define FASTLZ_WILD_COPY(d,s) _mm512_storeu_si512((void*)(d), _mm512_loadu_si512((const void*)(s)))
+#undef FASTLZ_COMPRESSOR
+#undef FASTLZ_DECOMPRESSOR
+#undef FASTLZ_FAST_DECOMPRESSOR
+#define FASTLZ_COMPRESSOR fastlz2_compress_avx512
+#define FASTLZ_DECOMPRESSOR fastlz2_decompress_avx512
+#define FASTLZ_FAST_DECOMPRESSOR fastlz2_decompress_fast_avx512
+#include "fastlz.c"
+
+#undef FASTLZ_TARGET
+#undef FASTLZ_WILD_CHUNK
+#undef FASTLZ_WILD_COPY
+#define FASTLZ_TARGET
+#define FASTLZ_WILD_CHUNK 16
+#define FASTLZ_WILD_COPY(d,s) FASTLZ_COPY16(d,s)
+#endif
+
+#define FASTLZ_DICT
+#undef FASTLZ_COMPRESSOR
+#undef FASTLZ_DECOMPRESSOR
+#undef FASTLZ_FAST_DECOMPRESSOR
+#define FASTLZ_COMPRESSOR fastlz2_compress_dict
+#define FASTLZ_DECOMPRESSOR fastlz2_decompress_dict
+#define FASTLZ_FAST_DECOMPRESSOR fastlz2_decompress_dict
+static FASTLZ_INLINE int FASTLZ_COMPRESSOR(flzuint32* htab, flzuint32 hbase, const flzuint32* dtab, int dict_len, const void* input, int length, void* output);
+static FASTLZ_INLINE int FASTLZ_FAST_DECOMPRESSOR(const void* dict, int dict_len, const void* input, int length, void* output, int maxout);
 #include "fastlz.c"
+#undef FASTLZ_DICT
+
+#define FASTLZ_BOUNDED
+#undef FASTLZ_COMPRESSOR
+#undef FASTLZ_DECOMPRESSOR
+#undef FASTLZ_FAST_DECOMPRESSOR
+#define FASTLZ_COMPRESSOR fastlz2_compress_bounded
+#define FASTLZ_DECOMPRESSOR fastlz2_decompress_bounded
+#define FASTLZ_FAST_DECOMPRESSOR fastlz2_decompress_fast_bounded
+static FASTLZ_INLINE int FASTLZ_COMPRESSOR(flzuint32* htab, flzuint32 hbase, const void* input, int length, void* output, int maxout);
+#include "fastlz.c"
+#undef FASTLZ_BOUNDED
+
+/*
+ * The compressor and the wild-copy decompressor are called through the
+ * active kernel. The last entry is the portable build and always matches.
+ */
+typedef struct
+{
+  const char* name;
+  int features;
+  int (*compress[2])(flzuint32* htab, flzuint32 hbase, const void* input, int length, void* output);
+  int (*decompress_fast[2])(const void* input, int length, void* output, int maxout);
+} fastlz_kernel;
+
+static const fastlz_kernel fastlz_kernels[] =
+{
+#if defined(FASTLZ_DISPATCH)
+  { "avx512", FASTLZ_CPU_SSE2 | FASTLZ_CPU_SSE42 | FASTLZ_CPU_AVX2 | FASTLZ_CPU_AVX512,
+    { fastlz1_compress_avx512, fastlz2_compress_avx512 },
+    { fastlz1_decompress_fast_avx512, fastlz2_decompress_fast_avx512 } },
+  { "avx2", FASTLZ_CPU_SSE2 | FASTLZ_CPU_SSE42 | FASTLZ_CPU_AVX2,
+    { fastlz1_compress_avx2, fastlz2_compress_avx2 },
+    { fastlz1_decompress_fast_avx2, fastlz2_decompress_fast_avx2 } },
+  { "sse4.2", FASTLZ_CPU_SSE2 | FASTLZ_CPU_SSE42,
+    { fastlz1_compress_sse42, fastlz2_compress_sse42 },
+    { fastlz1_decompress_fast_sse42, fastlz2_decompress_fast_sse42 } },
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+  { "sse2", 0,
+#else
+  { "generic", 0,
+#endif
+    { fastlz1_compress, fastlz2_compress },
+    { fastlz1_decompress_fast, fastlz2_decompress_fast } }
+};
+
+#define FASTLZ_KERNELS (int)(sizeof(fastlz_kernels) / sizeof(fastlz_kernels[0]))
+
+static const fastlz_kernel* fastlz_active = &fastlz_kernels[FASTLZ_KERNELS - 1];
+
+int fastlz_cpu_features(void)
+{
+  int features = 0;
+#if defined(FASTLZ_DISPATCH)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse2"))
+    features |= FASTLZ_CPU_SSE2;
+  if((features & FASTLZ_CPU_SSE2) && __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt"))
+    features |= FASTLZ_CPU_SSE42;
+  if((features & FASTLZ_CPU_SSE42) && __builtin_cpu_supports("avx2") &&
+     __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2"))
+    features |= FASTLZ_CPU_AVX2;
+  if((features & FASTLZ_CPU_AVX2) && __builtin_cpu_supports("avx512f") &&
+     __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl"))
+    features |= FASTLZ_CPU_AVX512;
+#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+  features |= FASTLZ_CPU_SSE2;
+#endif
+  return features;
+}
+
+const char* fastlz_use_kernel(int features)
+{
+  int i;
+  for(i = 0; i < FASTLZ_KERNELS; i++)
+    if((fastlz_kernels[i].features & ~features) == 0)
+      break;
+  fastlz_active = &fastlz_kernels[i];
+  return fastlz_active->name;
+}
+
+const char* fastlz_kernel_name(void)
+{
+  return fastlz_active->name;
+}
+
+/*
+ * Level 3 and 4 search hash chains over the whole level 2 window and defer
+ * a match by one byte when the next position has a better one (lazy
+ * matching). They are slower to compress, but the output is a plain level 2
+ * stream and is decompressed just as fast by fastlz2_decompress.
+ */
+#define HC_HASH_LOG    15
+#define HC_HASH_SIZE   (1 << HC_HASH_LOG)
+#define HC_WINDOW      (1 << 17)  /* larger than MAX_FARDISTANCE */
+#define HC_WINDOW_MASK (HC_WINDOW - 1)
+#define HC_HASH(p) (((flzuint32)((p)[0] | ((p)[1] << 8) | ((p)[2] << 16)) * 2654435761U) >> (32 - HC_HASH_LOG))
+
+typedef struct
+{
+  int head[HC_HASH_SIZE];
+  int prev[HC_WINDOW];
+} fastlz_hc;
+
+static FASTLZ_INLINE void fastlz_hc_insert(fastlz_hc* hc, const flzuint8* base, int pos)
+{
+  flzuint32 h = HC_HASH(base + pos);
+  hc->prev[pos & HC_WINDOW_MASK] = hc->head[h];
+  hc->head[h] = pos;
+}
+
+/* bytes saved by a match, far matches take two more bytes to encode */
+static FASTLZ_INLINE int fastlz_hc_gain(int len, int distance)
+{
+  if(!len)
+    return 0;
+  return len - ((distance - 1 < MAX_DISTANCE) ? 2 : 4);
+}
+
+/* returns the best match length at pos (0 for none), its distance in *distance */
+static int fastlz_hc_find(const fastlz_hc* hc, const flzuint8* base, int pos, int end,
+  int chain, int* distance)
+{
+  const flzuint8* ip = base + pos;
+  int cand = hc->head[HC_HASH(ip)];
+  int best_len = 0;
+  int best_gain = 0;
+
+  while(cand >= 0 && chain-- > 0)
+  {
+    const flzuint8* ref = base + cand;
+    if(pos - cand > MAX_FARDISTANCE)
+      break;
+
+    /* only a longer match can be better, the chain gets farther away */
+    if(ref[best_len] == ip[best_len])
+    {
+      int len;
+#if defined(FASTLZ_WORD64)
+      len = (int)(fastlz_match_end(ref, ip, base + end) - ip);
+#else
+      for(len = 0; pos + len < end && ref[len] == ip[len]; len++);
+#endif
+      if(fastlz_hc_gain(len, pos - cand) > best_gain)
+      {
+        best_gain = fastlz_hc_gain(len, pos - cand);
+        best_len = len;
+        *distance = pos - cand;
+        if(pos + len >= end)
+          break;
+      }
+    }
+    cand = hc->prev[cand & HC_WINDOW_MASK];
+  }
+
+  return best_len;
+}
+
+static flzuint8* fastlz_hc_literal(flzuint8* op, const flzuint8* ip, int count)
+{
+  while(count > 0)
+  {
+    int run = (count < MAX_COPY) ? count : MAX_COPY;
+    *op++ = run - 1;
+    memcpy(op, ip, run);
+    op += run;
+    ip += run;
+    count -= run;
+  }
+  return op;
+}
+
+/* same token layout as fastlz2_compress */
+static flzuint8* fastlz_hc_match(flzuint8* op, int match_len, int match_distance)
+{
+  /* length is biased, '1' means a match of 3 bytes */
+  flzuint32 len = match_len - 2;
+
+  /* distance is biased */
+  flzuint32 distance = match_distance - 1;
+
+  if(distance < MAX_DISTANCE)
+  {
+    if(len < 7)
+      *op++ = (len << 5) + (distance >> 8);
+    else
+    {
+      *op++ = (7 << 5) + (distance >> 8);
+      for(len-=7; len >= 255; len-= 255)
+        *op++ = 255;
+      *op++ = len;
+    }
+    *op++ = (distance & 255);
+  }
+  else
+  {
+    distance -= MAX_DISTANCE;
+    if(len < 7)
+      *op++ = (len << 5) + 31;
+    else
+    {
+      *op++ = (7 << 5) + 31;
+      for(len-=7; len >= 255; len-= 255)
+        *op++ = 255;
+      *op++ = len;
+    }
+    *op++ = 255;
+    *op++ = distance >> 8;
+    *op++ = distance & 255;
+  }
+  return op;
+}
+
+static int fastlz_hc_compress(const void* input, int length, void* output, int chain)
+{
+  const flzuint8* ip = (const flzuint8*) input;
+  flzuint8* op = (flzuint8*) output;
+  int limit = length - 12;
+  int anchor = 0;
+  int pos = 1;
+  fastlz_hc* hc;
+
+  /* too short to search */
+  if(length < 16)
+    return fastlz_compress_level(2, input, length, output);
+
+  hc = (fastlz_hc*) malloc(sizeof(fastlz_hc));
+  if(!hc)
+    return 0;
+  memset(hc->head, 0xff, sizeof(hc->head));
+
+  /* the stream always starts with a literal run */
+  fastlz_hc_insert(hc, ip, 0);
+
+  while(pos < limit)
+  {
+    int distance;
+    int len = fastlz_hc_find(hc, ip, pos, length, chain, &distance);
+    fastlz_hc_insert(hc, ip, pos);
+    if(!len)
+    {
+      pos++;
+      continue;
+    }
+
+    /* lazy matching: take the next position instead if it does better */
+    while(pos + 1 < limit)
+    {
+      int next_distance;
+      int next_len = fastlz_hc_find(hc, ip, pos + 1, length, chain, &next_distance);
+      if(fastlz_hc_gain(next_len, next_distance) <= fastlz_hc_gain(len, distance))
+        break;
+      pos++;
+      fastlz_hc_insert(hc, ip, pos);
+      len = next_len;
+      distance = next_distance;
+    }
+
+    op = fastlz_hc_literal(op, ip + anchor, pos - anchor);
+    op = fastlz_hc_match(op, len, distance);
+
+    for(anchor = pos + len, pos++; pos < anchor && pos < limit; pos++)
+      fastlz_hc_insert(hc, ip, pos);
+    pos = anchor;
+  }
+
+  /* left-over as literal copy */
+  op = fastlz_hc_literal(op, ip + anchor, length - anchor);
+  free(hc);
+
+  /* marker for fastlz2 */
+  *(flzuint8*)output |= (1 << 5);
+
+  return op - (flzuint8*)output;
+}
+
+int fastlz_compress(const void* input, int length, void* output)
+{
+  flzuint32 htab[HASH_SIZE];
+  memset(htab, 0, sizeof(htab));
+
+  /* for short block, choose fastlz1 */
+  if(length < 65536)
+    return fastlz_active->compress[0](htab, 0, input, length, output);
+
+  /* else... */
+  return fastlz_active->compress[1](htab, 0, input, length, output);
+}
+
+int fastlz_decompress(const void* input, int length, void* output, int maxout)
+{
+  /* magic identifier for compression level */
+  int level = ((*(const flzuint8*)input) >> 5) + 1;
+
+  if(level == 1)
+    return fastlz1_decompress(input, length, output, maxout);
+  if(level == 2)
+    return fastlz2_decompress(input, length, output, maxout);
+
+  /* unknown level, trigger error */
+  return 0;
+}
+
+int fastlz_decompress_fast(const void* input, int length, void* output, int maxout)
+{
+  /* magic identifier for compression level */
+  int level = ((*(const flzuint8*)input) >> 5) + 1;
+
+  if(level == 1)
+    return fastlz_active->decompress_fast[0](input, length, output, maxout);
+  if(level == 2)
+    return fastlz_active->decompress_fast[1](input, length, output, maxout);
+
+  /* unknown level, trigger error */
+  return 0;
+}
+
+int fastlz_validate(const void* input, int length, int* out_size)
+{
+  return fastlz_validate_dict(0, input, length, out_size);
+}
+
+int fastlz_validate_dict(int dict_len, const void* input, int length, int* out_size)
+{
+  int level;
+  int size = 0;
+
+  if(length > 0 && dict_len >= 0)
+  {
+    level = ((*(const flzuint8*)input) >> 5) + 1;
+    if(level == 1)
+      size = fastlz1_validate(dict_len, input, length);
+    else if(level == 2)
+      size = fastlz2_validate(dict_len, input, length);
+  }
+  if(out_size)
+    *out_size = size;
+  return size > 0;
+}
+
+int fastlz_compress_level(int level, const void* input, int length, void* output)
+{
+  flzuint32 htab[HASH_SIZE];
+
+  if(level == 1)
+  {
+    memset(htab, 0, sizeof(htab));
+    return fastlz_active->compress[0](htab, 0, input, length, output);
+  }
+  if(level == 2)
+  {
+    memset(htab, 0, sizeof(htab));
+    return fastlz_active->compress[1](htab, 0, input, length, output);
+  }
+  if(level == 3)
+    return fastlz_hc_compress(input, length, output, 16);
+  if(level == 4)
+    return fastlz_hc_compress(input, length, output, 256);
+
+  return 0;
+}
+
+/* room is how much may be written to output, at least out_cap */
+static int fastlz_bounded(int level, const void* input, int length, void* output, int out_cap, size_t room)
+{
+  flzuint32 htab[HASH_SIZE];
+  flzuint8* buffer = (flzuint8*) output;
+  int result;
+
+  if(length < 0 || out_cap <= 0 || level < 1 || level > 4)
+    return 0;
+
+  /*
+   * Unless there is room for the worst case, compress into a buffer with
+   * some slack: levels 1 and 2 write at most FASTLZ_BOUND_SLACK bytes past
+   * out_cap before they give up, levels 3 and 4 do not stop early.
+   */
+  if(room < (size_t)length + length / 16 + 66 &&
+     (level > 2 || room < (size_t)out_cap + FASTLZ_BOUND_SLACK))
+  {
+    if(level <= 2)
+      buffer = (flzuint8*) malloc(out_cap + FASTLZ_BOUND_SLACK);
+    else
+      buffer = (flzuint8*) malloc(length + length / 16 + 66);
+    if(!buffer)
+      return 0;
+  }
+
+  if(level == 1 || level == 2)
+  {
+    memset(htab, 0, sizeof(htab));
+    if(level == 1)
+      result = fastlz1_compress_bounded(htab, 0, input, length, buffer, out_cap);
+    else
+      result = fastlz2_compress_bounded(htab, 0, input, length, buffer, out_cap);
+  }
+  else
+    result = fastlz_compress_level(level, input, length, buffer);
+
+  if(result > out_cap)
+    result = 0;
+  if(buffer != output)
+  {
+    if(result)
+      memcpy(output, buffer, result);
+    free(buffer);
+  }
+  return result;
+}
+
+int fastlz_compress_bounded(int level, const void* input, int length, void* output, int out_cap)
+{
+  return fastlz_bounded(level, input, length, output, out_cap, out_cap > 0 ? out_cap : 0);
+}
+
+int fastlz_compress_bounded_room(int level, const void* input, int length, void* output, int out_cap, size_t out_size)
+{
+  if(out_size < (size_t)out_cap)
+    out_cap = (int)out_size;
+  return fastlz_bounded(level, input, length, output, out_cap, out_size);
+}
+
+static void fastlz_write_u32(flzuint8* p, flzuint32 v)
+{
+  p[0] = v & 255;
+  p[1] = (v >> 8) & 255;
+  p[2] = (v >> 16) & 255;
+  p[3] = (v >> 24) & 255;
+}
+
+static flzuint32 fastlz_read_u32(const flzuint8* p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((flzuint32)p[3] << 24);
+}
+
+size_t fastlz_blocks_bound(size_t length)
+{
+  /* a block is stored when it does not get smaller, any block size will fit */
+  return FASTLZ_BLOCKS_HEADER + length + 4 * ((length + FASTLZ_BLOCK_MIN - 1) / FASTLZ_BLOCK_MIN);
+}
+
+size_t fastlz_blocks_write_header(size_t length, size_t block_size, void* output)
+{
+  flzuint8* op = (flzuint8*) output;
+  int i;
+
+  op[0] = 'F';
+  op[1] = 'L';
+  op[2] = 'Z';
+  op[3] = 'B';
+  op[4] = 1;
+  for(i = 0; ((size_t)1 << i) < block_size; i++);
+  op[5] = i;
+  op[6] = 0;
+  op[7] = 0;
+  fastlz_write_u32(op + 8, (flzuint32)length);
+  fastlz_write_u32(op + 12, (flzuint32)((flzuint64)length >> 32));
+  return FASTLZ_BLOCKS_HEADER;
+}
+
+size_t fastlz_compress_block(int level, const void* input, size_t size, void* output, size_t maxout)
+{
+  flzuint8* op = (flzuint8*) output;
+  int chunk = 0;
+
+  if(level < 1 || level > 4 || size > FASTLZ_BLOCK_SIZE || maxout < 4)
+    return 0;
+  if(size > 16)
+  {
+    /* smaller than stored, and within the output buffer */
+    size_t room = maxout - 4;
+    int cap = (size - 1 < room) ? (int)size - 1 : (int)room;
+    if(cap > 0)
+      chunk = fastlz_bounded(level, input, (int)size, op + 4, cap, room);
+  }
+  if(chunk)
+    fastlz_write_u32(op, chunk);
+  else
+  {
+    if(maxout < 4 + size)
+      return 0;
+    fastlz_write_u32(op, (flzuint32)size | FASTLZ_BLOCK_STORED);
+    memcpy(op + 4, input, size);
+    chunk = (int)size;
+  }
+  return 4 + chunk;
+}
+
+size_t fastlz_compress_blocks(int level, const void* input, size_t length, void* output, size_t maxout)
+{
+  return fastlz_compress_blocks_sized(level, FASTLZ_BLOCK_SIZE, input, length, output, maxout);
+}
+
+size_t fastlz_compress_blocks_sized(int level, size_t block_size, const void* input, size_t length, void* output, size_t maxout)
+{
+  const flzuint8* ip = (const flzuint8*) input;
+  flzuint8* op = (flzuint8*) output;
+  flzuint8* op_end = op + maxout;
+  size_t pos;
+
+  if(level < 1 || level > 4 || maxout < FASTLZ_BLOCKS_HEADER)
+    return 0;
+  if(block_size < FASTLZ_BLOCK_MIN || block_size > FASTLZ_BLOCK_SIZE || (block_size & (block_size - 1)))
+    return 0;
+
+  op += fastlz_blocks_write_header(length, block_size, op);
+  for(pos = 0; pos < length; pos += block_size)
+  {
+    size_t size = (length - pos < block_size) ? length - pos : block_size;
+    size_t written = fastlz_compress_block(level, ip + pos, size, op, op_end - op);
+    if(!written)
+      return 0;
+    op += written;
+  }
+
+  return op - (flzuint8*)output;
+}
+
+/* checks the header, returns the block size or 0 */
+static size_t fastlz_blocks_header(const flzuint8* ip, size_t length, flzuint64* content)
+{
+  if(length < FASTLZ_BLOCKS_HEADER || ip[0] != 'F' || ip[1] != 'L' || ip[2] != 'Z' || ip[3] != 'B')
+    return 0;
+  if(ip[4] != 1 || ip[5] < 12 || ip[5] > 30)
+    return 0;
+  *content = fastlz_read_u32(ip + 8) | ((flzuint64)fastlz_read_u32(ip + 12) << 32);
+  return (size_t)1 << ip[5];
+}
+
+size_t fastlz_blocks_content_size(const void* input, size_t length)
+{
+  flzuint64 content;
+  if(!fastlz_blocks_header((const flzuint8*)input, length, &content))
+    return 0;
+  if(content != (size_t)content)
+    return 0;
+  return (size_t)content;
+}
+
+size_t fastlz_blocks_block_size(const void* input, size_t length)
+{
+  flzuint64 content;
+  return fastlz_blocks_header((const flzuint8*)input, length, &content);
+}
+
+size_t fastlz_blocks_index(const void* input, size_t length, size_t* offsets, size_t count)
+{
+  const flzuint8* ip = (const flzuint8*) input;
+  flzuint64 content;
+  size_t block_size = fastlz_blocks_header(ip, length, &content);
+  size_t pos = FASTLZ_BLOCKS_HEADER;
+  size_t i;
+
+  if(!block_size || content != (size_t)content)
+    return 0;
+  if(count != (size_t)((content + block_size - 1) / block_size))
+    return 0;
+
+  for(i = 0; i < count; i++)
+  {
+    flzuint32 chunk;
+    if(length - pos < 4)
+      return 0;
+    chunk = fastlz_read_u32(ip + pos) & ~FASTLZ_BLOCK_STORED;
+    if(length - pos - 4 < chunk)
+      return 0;
+    offsets[i] = pos;
+    pos += 4 + chunk;
+  }
+  offsets[count] = pos;
+  return count;
+}
+
+size_t fastlz_blocks_validate(const void* input, size_t length)
+{
+  const flzuint8* ip = (const flzuint8*) input;
+  flzuint64 content;
+  size_t block_size = fastlz_blocks_header(ip, length, &content);
+  size_t pos = FASTLZ_BLOCKS_HEADER;
+  flzuint64 done;
+
+  if(!block_size || content != (size_t)content)
+    return 0;
+
+  for(done = 0; done < content; done += block_size)
+  {
+    size_t size = (content - done < block_size) ? (size_t)(content - done) : block_size;
+    flzuint32 chunk;
+    int osize;
+
+    if(length - pos < 4)
+      return 0;
+    chunk = fastlz_read_u32(ip + pos);
+    pos += 4;
+    if(length - pos < (chunk & ~FASTLZ_BLOCK_STORED))
+      return 0;
+    if(chunk & FASTLZ_BLOCK_STORED)
+    {
+      chunk &= ~FASTLZ_BLOCK_STORED;
+      if(chunk != size)
+        return 0;
+    }
+    else if(!fastlz_validate(ip + pos, (int)chunk, &osize) || (size_t)osize != size)
+      return 0;
+    pos += chunk;
+  }
+
+  return (size_t)content;
+}
+
+size_t fastlz_blocks_locate(const void* input, size_t length, size_t block)
+{
+  const flzuint8* ip = (const flzuint8*) input;
+  flzuint64 content;
+  size_t block_size = fastlz_blocks_header(ip, length, &content);
+  size_t pos = FASTLZ_BLOCKS_HEADER;
+  size_t i;
+
+  if(!block_size || block >= (content + block_size - 1) / block_size)
+    return 0;
+
+  /* the sizes in front of the blocks are the index */
+  for(i = 0; i < block; i++)
+  {
+    if(length - pos < 4)
+      return 0;
+    pos += 4 + (fastlz_read_u32(ip + pos) & ~FASTLZ_BLOCK_STORED);
+    if(pos > length)
+      return 0;
+  }
+  if(length - pos < 4)
+    return 0;
+  return pos;
+}
+
+size_t fastlz_decompress_block(const void* input, size_t length, void* output, size_t size, size_t maxout)
+{
+  const flzuint8* ip = (const flzuint8*) input;
+  flzuint32 chunk;
+
+  if(length < 4 || size > maxout)
+    return 0;
+  chunk = fastlz_read_u32(ip);
+  ip += 4;
+  if(length - 4 < (chunk & ~FASTLZ_BLOCK_STORED))
+    return 0;
+
+  if(chunk & FASTLZ_BLOCK_STORED)
+  {
+    chunk &= ~FASTLZ_BLOCK_STORED;
+    if(chunk != size)
+      return 0;
+    memcpy(output, ip, size);
+  }
+  else
+  {
+    if(maxout > 0x7fffffff)
+      maxout = 0x7fffffff;
+    if(!chunk || (size_t)fastlz_decompress_fast(ip, chunk, output, (int)maxout) != size)
+      return 0;
+  }
+  return 4 + chunk;
+}
+
+size_t fastlz_decompress_blocks(const void* input, size_t length, void* output, size_t maxout)
+{
+  const flzuint8* ip = (const flzuint8*) input;
+  const flzuint8* ip_end = ip + length;
+  flzuint8* op = (flzuint8*) output;
+  flzuint64 content;
+  size_t block_size = fastlz_blocks_header(ip, length, &content);
+  size_t pos;
+
+  if(!block_size || content > maxout)
+    return 0;
+  ip += FASTLZ_BLOCKS_HEADER;
+
+  for(pos = 0; pos < content; pos += block_size)
+  {
+    size_t size = (content - pos < block_size) ? (size_t)(content - pos) : block_size;
+    /* the rest of the output is room for the wild copy */
+    size_t used = fastlz_decompress_block(ip, ip_end - ip, op + pos, size, maxout - pos);
+    if(!used)
+      return 0;
+    ip += used;
+  }
+
+  return (size_t)content;
+}
+
+/*
+ * Byte shuffle: byte k of every item goes to plane k, so the bytes that
+ * change slowly from one number to the next end up next to each other.
+ * SSE2 transposes 16 items at a time for item sizes 2, 4, 8 and 16, by
+ * splitting even and odd bytes apart log2(itemsize) times; unshuffling
+ * interleaves them again the same number of times.
+ */
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+static FASTLZ_INLINE size_t fastlz_shuffle_sse2(int itemsize, const flzuint8* ip, flzuint8* op, size_t count)
+{
+  const __m128i low = _mm_set1_epi16(0x00ff);
+  __m128i v[16], t[16];
+  int half = itemsize / 2;
+  size_t i;
+  int k, w;
+
+  for(i = 0; i + 16 <= count; i += 16)
+  {
+    for(k = 0; k < itemsize; k++)
+      v[k] = _mm_loadu_si128((const __m128i*)(ip + i * itemsize + 16 * k));
+    for(w = itemsize; w > 1; w >>= 1)
+    {
+      for(k = 0; k < half; k++)
+      {
+        t[k] = _mm_packus_epi16(_mm_and_si128(v[2 * k], low), _mm_and_si128(v[2 * k + 1], low));
+        t[k + half] = _mm_packus_epi16(_mm_srli_epi16(v[2 * k], 8), _mm_srli_epi16(v[2 * k + 1], 8));
+      }
+      for(k = 0; k < itemsize; k++)
+        v[k] = t[k];
+    }
+    for(k = 0; k < itemsize; k++)
+      _mm_storeu_si128((__m128i*)(op + k * count + i), v[k]);
+  }
+  return i;
+}
+
+static FASTLZ_INLINE size_t fastlz_unshuffle_sse2(int itemsize, const flzuint8* ip, flzuint8* op, size_t count)
+{
+  __m128i v[16], t[16];
+  int half = itemsize / 2;
+  size_t i;
+  int k, w;
+
+  for(i = 0; i + 16 <= count; i += 16)
+  {
+    for(k = 0; k < itemsize; k++)
+      v[k] = _mm_loadu_si128((const __m128i*)(ip + k * count + i));
+    for(w = itemsize; w > 1; w >>= 1)
+    {
+      for(k = 0; k < half; k++)
+      {
+        t[2 * k] = _mm_unpacklo_epi8(v[k], v[k + half]);
+        t[2 * k + 1] = _mm_unpackhi_epi8(v[k], v[k + half]);
+      }
+      for(k = 0; k < itemsize; k++)
+        v[k] = t[k];
+    }
+    for(k = 0; k < itemsize; k++)
+      _mm_storeu_si128((__m128i*)(op + i * itemsize + 16 * k), v[k]);
+  }
+  return i;
+}
+#endif
+
+void fastlz_shuffle(int itemsize, const void* input, size_t length, void* output)
+{
+  const flzuint8* ip = (const flzuint8*) input;
+  flzuint8* op = (flzuint8*) output;
+  size_t count, i = 0;
+  int k;
+
+  if(itemsize < 2)
+  {
+    memcpy(op, ip, length);
+    return;
+  }
+  count = length / itemsize;
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+  /* constant sizes, so that the transposes are unrolled */
+  switch(itemsize)
+  {
+    case 2: i = fastlz_shuffle_sse2(2, ip, op, count); break;
+    case 4: i = fastlz_shuffle_sse2(4, ip, op, count); break;
+    case 8: i = fastlz_shuffle_sse2(8, ip, op, count); break;
+    case 16: i = fastlz_shuffle_sse2(16, ip, op, count); break;
+  }
+#endif
+  for(k = 0; k < itemsize; k++)
+  {
+    const flzuint8* src = ip + i * itemsize + k;
+    flzuint8* dst = op + k * count;
+    size_t j;
+    for(j = i; j < count; j++, src += itemsize)
+      dst[j] = *src;
+  }
+  /* a partial item at the end stays as it is */
+  memcpy(op + count * itemsize, ip + count * itemsize, length - count * itemsize);
+}
+
+void fastlz_unshuffle(int itemsize, const void* input, size_t length, void* output)
+{
+  const flzuint8* ip = (const flzuint8*) input;
+  flzuint8* op = (flzuint8*) output;
+  size_t count, i = 0;
+  int k;
+
+  if(itemsize < 2)
+  {
+    memcpy(op, ip, length);
+    return;
+  }
+  count = length / itemsize;
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+  switch(itemsize)
+  {
+    case 2: i = fastlz_unshuffle_sse2(2, ip, op, count); break;
+    case 4: i = fastlz_unshuffle_sse2(4, ip, op, count); break;
+    case 8: i = fastlz_unshuffle_sse2(8, ip, op, count); break;
+    case 16: i = fastlz_unshuffle_sse2(16, ip, op, count); break;
+  }
+#endif
+  for(k = 0; k < itemsize; k++)
+  {
+    const flzuint8* src = ip + k * count;
+    flzuint8* dst = op + i * itemsize + k;
+    size_t j;
+    for(j = i; j < count; j++, dst += itemsize)
+      *dst = src[j];
+  }
+  memcpy(op + count * itemsize, ip + count * itemsize, length - count * itemsize);
+}
+
+fastlz_ctx* fastlz_ctx_create(void)
+{
+  fastlz_ctx* ctx = (fastlz_ctx*) malloc(sizeof(fastlz_ctx));
+  if(ctx)
+  {
+    memset(ctx->htab, 0, sizeof(ctx->htab));
+    ctx->hbase = 0;
+    ctx->dtab = 0;
+    ctx->window = 0;
+    ctx->dict_len = 0;
+    ctx->window_size = 0;
+  }
+  return ctx;
+}
+
+int fastlz_ctx_load_dict(fastlz_ctx* ctx, const void* dict, int dict_len)
+{
+  int pos;
+
+  free(ctx->dtab);
+  free(ctx->window);
+  ctx->dtab = 0;
+  ctx->window = 0;
+  ctx->dict_len = 0;
+  ctx->window_size = 0;
+  if(dict_len <= 0)
+    return 1;
+
+  if(dict_len > FASTLZ_DICT_MAX)
+  {
+    dict = (const flzuint8*)dict + dict_len - FASTLZ_DICT_MAX;
+    dict_len = FASTLZ_DICT_MAX;
+  }
+
+  ctx->dtab = (flzuint32*) calloc(HASH_SIZE, sizeof(flzuint32));
+  ctx->window = (flzuint8*) malloc(dict_len);
+  if(!ctx->dtab || !ctx->window)
+  {
+    free(ctx->dtab);
+    free(ctx->window);
+    ctx->dtab = 0;
+    ctx->window = 0;
+    return 0;
+  }
+  memcpy(ctx->window, dict, dict_len);
+  ctx->dict_len = dict_len;
+  ctx->window_size = dict_len;
+
+  /* later positions win, they are closer to the input */
+  for(pos = 0; pos + 3 <= dict_len; pos++)
+  {
+    flzuint32 hval;
+    HASH_FUNCTION(hval, ctx->window + pos);
+    ctx->dtab[hval] = pos + 1;
+  }
+
+  /* with the dictionary, a zeroed entry must not look like a position */
+  memset(ctx->htab, 0, sizeof(ctx->htab));
+  ctx->hbase = HASH_GAP;
+  return 1;
+}
+
+int fastlz_compress_with_ctx(fastlz_ctx* ctx, int level, const void* input, int length, void* output)
+{
+  int result;
+
+  if(length < 0)
+    return 0;
+
+  /* tags must not wrap around, start over when they would or already did */
+  if(ctx->hbase > HASH_LIMIT || (flzuint32)length > HASH_LIMIT - ctx->hbase)
+  {
+    memset(ctx->htab, 0, sizeof(ctx->htab));
+    ctx->hbase = ctx->dtab ? HASH_GAP : 0;
+  }
+
+  if(ctx->dtab && level >= 1 && level <= 4)
+  {
+    /* the input goes right behind the dictionary */
+    if(length > ctx->window_size - ctx->dict_len)
+    {
+      flzuint8* window = (flzuint8*) realloc(ctx->window, ctx->dict_len + length);
+      if(!window)
+        return 0;
+      ctx->window = window;
+      ctx->window_size = ctx->dict_len + length;
+    }
+    memcpy(ctx->window + ctx->dict_len, input, length);
+    if(level == 1)
+      result = fastlz1_compress_dict(ctx->htab, ctx->hbase, ctx->dtab, ctx->dict_len,
+        ctx->window + ctx->dict_len, length, output);
+    else
+      result = fastlz2_compress_dict(ctx->htab, ctx->hbase, ctx->dtab, ctx->dict_len,
+        ctx->window + ctx->dict_len, length, output);
+    ctx->hbase += ctx->dict_len + length + HASH_GAP;
+    return result;
+  }
+
+  if(level == 1)
+    result = fastlz_active->compress[0](ctx->htab, ctx->hbase, input, length, output);
+  else if(level == 2)
+    result = fastlz_active->compress[1](ctx->htab, ctx->hbase, input, length, output);
+  else
+    return fastlz_compress_level(level, input, length, output);
+
+  /* everything tagged so far is now out of reach */
+  ctx->hbase += length + HASH_GAP;
+  return result;
+}
+
+void fastlz_ctx_free(fastlz_ctx* ctx)
+{
+  if(ctx)
+  {
+    free(ctx->dtab);
+    free(ctx->window);
+  }
+  free(ctx);
+}
+
+int fastlz_compress_dict(int level, const void* dict, int dict_len, const void* input, int length, void* output)
+{
+  int result = 0;
+  fastlz_ctx* ctx = fastlz_ctx_create();
+  if(!ctx)
+    return 0;
+  if(fastlz_ctx_load_dict(ctx, dict, dict_len))
+    result = fastlz_compress_with_ctx(ctx, level, input, length, output);
+  fastlz_ctx_free(ctx);
+  return result;
+}
+
+int fastlz_decompress_dict(const void* dict, int dict_len, const void* input, int length, void* output, int maxout)
+{
+  /* magic identifier for compression level */
+  int level = ((*(const flzuint8*)input) >> 5) + 1;
+
+  /* the compressor only kept this much */
+  if(dict_len > FASTLZ_DICT_MAX)
+  {
+    dict = (const flzuint8*)dict + dict_len - FASTLZ_DICT_MAX;
+    dict_len = FASTLZ_DICT_MAX;
+  }
+  if(dict_len < 0)
+    dict_len = 0;
+
+  if(level == 1)
+    return fastlz1_decompress_dict(dict, dict_len, input, length, output, maxout);
+  if(level == 2)
+    return fastlz2_decompress_dict(dict, dict_len, input, length, output, maxout);
+
+  /* unknown level, trigger error */
+  return 0;
+}
+
+fastlz_stream* fastlz_stream_create(void)
+{
+  fastlz_stream* stream = (fastlz_stream*) malloc(sizeof(fastlz_stream));
+  if(stream)
+  {
+    /* a zeroed entry must not look like a position in the history */
+    memset(stream->htab, 0, sizeof(stream->htab));
+    stream->hbase = HASH_GAP;
+    stream->window = 0;
+    stream->history = 0;
+    stream->window_size = 0;
+  }
+  return stream;
+}
+
+/* makes room for length more bytes, keeping at least the history */
+static int fastlz_stream_reserve(fastlz_stream* stream, int length)
+{
+  if(length > stream->window_size - stream->history && stream->history > FASTLZ_STREAM_HISTORY)
+  {
+    int shift = stream->history - FASTLZ_STREAM_HISTORY;
+    memmove(stream->window, stream->window + shift, FASTLZ_STREAM_HISTORY);
+    stream->history = FASTLZ_STREAM_HISTORY;
+    stream->hbase += shift;
+  }
+  if(length > stream->window_size - stream->history)
+  {
+    /* twice the history, so sliding is rare */
+    int size = stream->history + length;
+    flzuint8* window;
+    if(size < 2 * FASTLZ_STREAM_HISTORY)
+      size = 2 * FASTLZ_STREAM_HISTORY;
+    window = (flzuint8*) realloc(stream->window, size);
+    if(!window)
+      return 0;
+    stream->window = window;
+    stream->window_size = size;
+  }
+  return 1;
+}
 
-int fastlz_compress(const void* input, int length, void* output)
+int fastlz_stream_compress(fastlz_stream* stream, int level, const void* input, int length, void* output)
 {
-  /* for short block, choose fastlz1 */
-  if(length < 65536)
-    return fastlz1_compress(input, length, output);
+  flzuint8* ip;
+  flzuint32 limit;
+  int result;
+
+  if(length <= 0 || level < 1 || level > 4)
+    return 0;
+  if(!fastlz_stream_reserve(stream, length))
+    return 0;
+
+  /* tags must not wrap around, forget the history when they would */
+  limit = 0xffffffffU - 2 * HASH_GAP - (flzuint32)stream->window_size;
+  if(stream->hbase > limit || (flzuint32)length > limit - stream->hbase)
+  {
+    memset(stream->htab, 0, sizeof(stream->htab));
+    stream->hbase = HASH_GAP;
+  }
 
-  /* else... */
-  return fastlz2_compress(input, length, output);
+  ip = stream->window + stream->history;
+  memcpy(ip, input, length);
+  if(level == 1)
+    result = fastlz1_compress_dict(stream->htab, stream->hbase, fastlz_no_dict, stream->history, ip, length, output);
+  else
+    result = fastlz2_compress_dict(stream->htab, stream->hbase, fastlz_no_dict, stream->history, ip, length, output);
+  stream->history += length;
+  return result;
 }
 
-int fastlz_decompress(const void* input, int length, void* output, int maxout)
+int fastlz_stream_decompress(fastlz_stream* stream, const void* input, int length, void* output, int maxout)
 {
   /* magic identifier for compression level */
   int level = ((*(const flzuint8*)input) >> 5) + 1;
+  int result;
 
   if(level == 1)
-    return fastlz1_decompress(input, length, output, maxout);
-  if(level == 2)
-    return fastlz2_decompress(input, length, output, maxout);
+    result = fastlz1_decompress_dict(stream->window, stream->history, input, length, output, maxout);
+  else if(level == 2)
+    result = fastlz2_decompress_dict(stream->window, stream->history, input, length, output, maxout);
+  else
+    result = 0;
+  if(result <= 0)
+    return 0;
 
-  /* unknown level, trigger error */
-  return 0;
+  /* the output becomes history */
+  if(result >= FASTLZ_STREAM_HISTORY)
+  {
+    stream->history = 0;
+    if(!fastlz_stream_reserve(stream, FASTLZ_STREAM_HISTORY))
+      return 0;
+    memcpy(stream->window, (flzuint8*)output + result - FASTLZ_STREAM_HISTORY, FASTLZ_STREAM_HISTORY);
+    stream->history = FASTLZ_STREAM_HISTORY;
+  }
+  else
+  {
+    if(!fastlz_stream_reserve(stream, result))
+      return 0;
+    memcpy(stream->window + stream->history, output, result);
+    stream->history += result;
+  }
+  return result;
 }
 
-int fastlz_compress_level(int level, const void* input, int length, void* output)
+void fastlz_stream_free(fastlz_stream* stream)
 {
-  if(level == 1)
-    return fastlz1_compress(input, length, output);
-  if(level == 2)
-    return fastlz2_compress(input, length, output);
-
-  return 0;
+  if(stream)
+    free(stream->window);
+  free(stream);
 }
 
 #else /* !defined(FASTLZ_COMPRESSOR) && !defined(FASTLZ_DECOMPRESSOR) */
 
-static FASTLZ_INLINE int FASTLZ_COMPRESSOR(const void* input, int length, void* output)
+#if defined(FASTLZ_DICT)
+static FASTLZ_INLINE FASTLZ_TARGET int FASTLZ_COMPRESSOR(flzuint32* htab, flzuint32 hbase,
+  const flzuint32* dtab, int dict_len, const void* input, int length, void* output)
+#elif defined(FASTLZ_BOUNDED)
+static FASTLZ_INLINE FASTLZ_TARGET int FASTLZ_COMPRESSOR(flzuint32* htab, flzuint32 hbase,
+  const void* input, int length, void* output, int maxout)
+#else
+static FASTLZ_INLINE FASTLZ_TARGET int FASTLZ_COMPRESSOR(flzuint32* htab, flzuint32 hbase, const void* input, int length, void* output)
+#endif
 {
   const flzuint8* ip = (const flzuint8*) input;
+#if defined(FASTLZ_DICT)
+  /* the dictionary sits right before the input, tags count from its start */
+  const flzuint8* ibase = ip - dict_len;
+#else
+  const flzuint8* ibase = ip;
+#endif
   const flzuint8* ip_bound = ip + length - 2;
   const flzuint8* ip_limit = ip + length - 12;
   flzuint8* op = (flzuint8*) output;
 
-  const flzuint8* htab[HASH_SIZE];
-  const flzuint8** hslot;
   flzuint32 hval;
+  flzuint32 atag;
 
   flzuint32 copy;
 
+#if defined(FASTLZ_BOUNDED) && !defined(FASTLZ_NO_SKIP)
+  /* literals since the last match, shifted down this gives the step */
+  flzuint32 misses = 0;
+#endif
+
   /* sanity check */
   if(FASTLZ_UNEXPECT_CONDITIONAL(length < 4))
   {
@@ -192,10 +1659,6 @@ static FASTLZ_INLINE int FASTLZ_COMPRESSOR(const void* input, int length, void*
       return 0;
   }
 
-  /* initializes hash table */
-  for (hslot = htab; hslot < htab + HASH_SIZE; hslot++)
-    *hslot = ip;
-
   /* we start with literal copy */
   copy = 2;
   *op++ = MAX_COPY-1;
@@ -211,6 +1674,12 @@ static FASTLZ_INLINE int FASTLZ_COMPRESSOR(const void* input, int length, void*
     /* minimum match length */
     flzuint32 len = 3;
 
+#if defined(FASTLZ_BOUNDED)
+    /* all but a pending literal control byte stays, this can not fit any more */
+    if(FASTLZ_UNEXPECT_CONDITIONAL(op - (flzuint8*)output > maxout + 1))
+      return 0;
+#endif
+
     /* comparison starting-point */
     const flzuint8* anchor = ip;
 
@@ -227,14 +1696,26 @@ static FASTLZ_INLINE int FASTLZ_COMPRESSOR(const void* input, int length, void*
 
     /* find potential match */
     HASH_FUNCTION(hval,ip);
-    hslot = htab + hval;
-    ref = htab[hval];
+    atag = hbase + (flzuint32)(anchor - ibase);
 
     /* calculate distance to the match */
-    distance = anchor - ref;
+#if defined(FASTLZ_DICT)
+    distance = atag - htab[hval];
+    /* nothing recent within reach, try the dictionary */
+#if FASTLZ_LEVEL==1
+    if(distance >= MAX_DISTANCE && dtab[hval])
+#else
+    if(distance >= MAX_FARDISTANCE && dtab[hval])
+#endif
+      distance = (flzuint32)(anchor - ibase) + 1 - dtab[hval];
+#else
+    /* an entry from an earlier call points at the start, as a zeroed one */
+    distance = atag - (htab[hval] < hbase ? hbase : htab[hval]);
+#endif
+    ref = anchor - distance;
 
     /* update hash table */
-    *hslot = anchor;
+    htab[hval] = atag;
 
     /* is this a match? check the first 3 bytes */
     if(distance==0 || 
@@ -264,6 +1745,21 @@ static FASTLZ_INLINE int FASTLZ_COMPRESSOR(const void* input, int length, void*
     /* distance is biased */
     distance--;
 
+#if defined(FASTLZ_WORD64)
+    if(!distance)
+    {
+      /* zero distance means a run */
+      const flzuint8* end = fastlz_run_end(ip[-1], ref, ip_bound - 1);
+      ip = (end < ip_bound - 1) ? end + 1 : ip_bound;
+    }
+    else
+    {
+      /* the first 8 bytes are safe because the outer check against ip limit */
+      const flzuint8* limit = (ip + 8 > ip_bound) ? ip + 8 : ip_bound;
+      const flzuint8* end = fastlz_match_end(ref, ip, limit);
+      ip = (end < limit) ? end + 1 : limit;
+    }
+#else
     if(!distance)
     {
       /* zero distance means a run */
@@ -287,6 +1783,7 @@ static FASTLZ_INLINE int FASTLZ_COMPRESSOR(const void* input, int length, void*
         if(*ref++ != *ip++) break;
       break;
     }
+#endif
 
     /* if we have copied something, adjust the copy count */
     if(copy)
@@ -314,6 +1811,10 @@ static FASTLZ_INLINE int FASTLZ_COMPRESSOR(const void* input, int length, void*
       }
       else
       {
+#if defined(FASTLZ_BOUNDED)
+        if(FASTLZ_UNEXPECT_CONDITIONAL(op + (len-7)/255 - (flzuint8*)output > maxout))
+          return 0;
+#endif
         *op++ = (7 << 5) + (distance >> 8);
         for(len-=7; len >= 255; len-= 255)
           *op++ = 255;
@@ -334,6 +1835,10 @@ static FASTLZ_INLINE int FASTLZ_COMPRESSOR(const void* input, int length, void*
       }
       else
       {
+#if defined(FASTLZ_BOUNDED)
+        if(FASTLZ_UNEXPECT_CONDITIONAL(op + (len-7)/255 - (flzuint8*)output > maxout))
+          return 0;
+#endif
         distance -= MAX_DISTANCE;
         *op++ = (7 << 5) + 31;
         for(len-=7; len >= 255; len-= 255)
@@ -346,6 +1851,10 @@ static FASTLZ_INLINE int FASTLZ_COMPRESSOR(const void* input, int length, void*
     }
 #else
 
+#if defined(FASTLZ_BOUNDED)
+    if(FASTLZ_UNEXPECT_CONDITIONAL(op + 3*(len/(MAX_LEN-2)) - (flzuint8*)output > maxout))
+      return 0;
+#endif
     if(FASTLZ_UNEXPECT_CONDITIONAL(len > MAX_LEN-2))
       while(len > MAX_LEN-2)
       {
@@ -370,16 +1879,41 @@ static FASTLZ_INLINE int FASTLZ_COMPRESSOR(const void* input, int length, void*
 
     /* update the hash at match boundary */
     HASH_FUNCTION(hval,ip);
-    htab[hval] = ip++;
+    htab[hval] = hbase + (flzuint32)(ip++ - ibase);
     HASH_FUNCTION(hval,ip);
-    htab[hval] = ip++;
+    htab[hval] = hbase + (flzuint32)(ip++ - ibase);
 
     /* assuming literal copy */
     *op++ = MAX_COPY-1;
 
+#if defined(FASTLZ_BOUNDED) && !defined(FASTLZ_NO_SKIP)
+    misses = 0;
+#endif
+
     continue;
 
     literal:
+#if defined(FASTLZ_BOUNDED) && !defined(FASTLZ_NO_SKIP)
+    {
+      /* the longer nothing matches, the more bytes are passed over at once */
+      flzuint32 step = 1 + misses++ / FASTLZ_SKIP_TRIGGER;
+      if(step > MAX_COPY)
+        step = MAX_COPY;
+      if(step > (flzuint32)(ip_limit - anchor))
+        step = ip_limit - anchor;
+      do
+      {
+        *op++ = *anchor++;
+        copy++;
+        if(FASTLZ_UNEXPECT_CONDITIONAL(copy == MAX_COPY))
+        {
+          copy = 0;
+          *op++ = MAX_COPY-1;
+        }
+      } while(--step);
+      ip = anchor;
+    }
+#else
       *op++ = *anchor++;
       ip = anchor;
       copy++;
@@ -388,6 +1922,7 @@ static FASTLZ_INLINE int FASTLZ_COMPRESSOR(const void* input, int length, void*
         copy = 0;
         *op++ = MAX_COPY-1;
       }
+#endif
   }
 
   /* left-over as literal copy */
@@ -417,7 +1952,9 @@ static FASTLZ_INLINE int FASTLZ_COMPRESSOR(const void* input, int length, void*
   return op - (flzuint8*)output;
 }
 
-static FASTLZ_INLINE int FASTLZ_DECOMPRESSOR(const void* input, int length, void* output, int maxout)
+/* the dictionary variants only need the compressor and the wild-copy decompressor */
+#if !defined(FASTLZ_DICT) && !defined(FASTLZ_BOUNDED)
+static FASTLZ_INLINE FASTLZ_TARGET int FASTLZ_DECOMPRESSOR(const void* input, int length, void* output, int maxout)
 {
   const flzuint8* ip = (const flzuint8*) input;
   const flzuint8* ip_limit  = ip + length;
@@ -441,14 +1978,32 @@ static FASTLZ_INLINE int FASTLZ_DECOMPRESSOR(const void* input, int length, void
       ref -= ofs;
       if (len == 7-1)
 #if FASTLZ_LEVEL==1
+      {
+#ifdef FASTLZ_SAFE
+        if (FASTLZ_UNEXPECT_CONDITIONAL(ip >= ip_limit))
+          return 0;
+#endif
         len += *ip++;
+      }
+#ifdef FASTLZ_SAFE
+      if (FASTLZ_UNEXPECT_CONDITIONAL(ip >= ip_limit))
+        return 0;
+#endif
       ref -= *ip++;
 #else
         do
         {
+#ifdef FASTLZ_SAFE
+          if (FASTLZ_UNEXPECT_CONDITIONAL(ip >= ip_limit))
+            return 0;
+#endif
           code = *ip++;
           len += code;
         } while (code==255);
+#ifdef FASTLZ_SAFE
+      if (FASTLZ_UNEXPECT_CONDITIONAL(ip >= ip_limit))
+        return 0;
+#endif
       code = *ip++;
       ref -= code;
 
@@ -456,6 +2011,10 @@ static FASTLZ_INLINE int FASTLZ_DECOMPRESSOR(const void* input, int length, void
       if(FASTLZ_UNEXPECT_CONDITIONAL(code==255))
       if(FASTLZ_EXPECT_CONDITIONAL(ofs==(31 << 8)))
       {
+#ifdef FASTLZ_SAFE
+        if (FASTLZ_UNEXPECT_CONDITIONAL(ip + 2 > ip_limit))
+          return 0;
+#endif
         ofs = (*ip++) << 8;
         ofs += *ip++;
         ref = op - ofs - MAX_DISTANCE;
@@ -487,10 +2046,6 @@ static FASTLZ_INLINE int FASTLZ_DECOMPRESSOR(const void* input, int length, void
       }
       else
       {
-#if !defined(FASTLZ_STRICT_ALIGN)
-        const flzuint16* p;
-        flzuint16* q;
-#endif
         /* copy from reference */
         ref--;
         *op++ = *ref++;
@@ -505,19 +2060,18 @@ static FASTLZ_INLINE int FASTLZ_DECOMPRESSOR(const void* input, int length, void
           len--;
         }
 
-        /* copy 16-bit at once */
-        q = (flzuint16*) op;
-        op += len;
-        p = (const flzuint16*) ref;
+        /* copy 16-bit at once, reference is at least 2 bytes behind */
         for(len>>=1; len > 4; len-=4)
         {
-          *q++ = *p++;
-          *q++ = *p++;
-          *q++ = *p++;
-          *q++ = *p++;
+          memcpy(op, ref, 2); op += 2; ref += 2;
+          memcpy(op, ref, 2); op += 2; ref += 2;
+          memcpy(op, ref, 2); op += 2; ref += 2;
+          memcpy(op, ref, 2); op += 2; ref += 2;
         }
         for(; len; --len)
-          *q++ = *p++;
+        {
+          memcpy(op, ref, 2); op += 2; ref += 2;
+        }
 #else
         for(; len; --len)
           *op++ = *ref++;
@@ -547,5 +2101,278 @@ static FASTLZ_INLINE int FASTLZ_DECOMPRESSOR(const void* input, int length, void
 
   return op - (flzuint8*)output;
 }
+#endif
+
+#if !defined(FASTLZ_BOUNDED)
+#if defined(FASTLZ_DICT)
+static FASTLZ_INLINE FASTLZ_TARGET int FASTLZ_FAST_DECOMPRESSOR(const void* dict, int dict_len,
+  const void* input, int length, void* output, int maxout)
+#else
+static FASTLZ_INLINE FASTLZ_TARGET int FASTLZ_FAST_DECOMPRESSOR(const void* input, int length, void* output, int maxout)
+#endif
+{
+  const flzuint8* ip = (const flzuint8*) input;
+  const flzuint8* ip_limit  = ip + length;
+  flzuint8* op = (flzuint8*) output;
+  flzuint8* op_limit = op + maxout;
+  flzuint32 ctrl = (*ip++) & 31;
+  int loop = 1;
+
+  do
+  {
+    const flzuint8* ref = op;
+    flzuint32 len = ctrl >> 5;
+    flzuint32 ofs = (ctrl & 31) << 8;
+
+    if(ctrl >= 32)
+    {
+#if FASTLZ_LEVEL==2
+      flzuint8 code;
+#endif
+      len--;
+      ref -= ofs;
+      if (len == 7-1)
+#if FASTLZ_LEVEL==1
+      {
+#ifdef FASTLZ_SAFE
+        if (FASTLZ_UNEXPECT_CONDITIONAL(ip >= ip_limit))
+          return 0;
+#endif
+        len += *ip++;
+      }
+#ifdef FASTLZ_SAFE
+      if (FASTLZ_UNEXPECT_CONDITIONAL(ip >= ip_limit))
+        return 0;
+#endif
+      ref -= *ip++;
+#else
+        do
+        {
+#ifdef FASTLZ_SAFE
+          if (FASTLZ_UNEXPECT_CONDITIONAL(ip >= ip_limit))
+            return 0;
+#endif
+          code = *ip++;
+          len += code;
+        } while (code==255);
+#ifdef FASTLZ_SAFE
+      if (FASTLZ_UNEXPECT_CONDITIONAL(ip >= ip_limit))
+        return 0;
+#endif
+      code = *ip++;
+      ref -= code;
+
+      /* match from 16-bit distance */
+      if(FASTLZ_UNEXPECT_CONDITIONAL(code==255))
+      if(FASTLZ_EXPECT_CONDITIONAL(ofs==(31 << 8)))
+      {
+#ifdef FASTLZ_SAFE
+        if (FASTLZ_UNEXPECT_CONDITIONAL(ip + 2 > ip_limit))
+          return 0;
+#endif
+        ofs = (*ip++) << 8;
+        ofs += *ip++;
+        ref = op - ofs - MAX_DISTANCE;
+      }
+#endif
+
+#ifdef FASTLZ_SAFE
+      if (FASTLZ_UNEXPECT_CONDITIONAL(op + len + 3 > op_limit))
+        return 0;
+
+#if defined(FASTLZ_DICT)
+      if (FASTLZ_UNEXPECT_CONDITIONAL(ref-1 < (flzuint8 *)output && (flzuint8 *)output - (ref-1) > dict_len))
+        return 0;
+#else
+      if (FASTLZ_UNEXPECT_CONDITIONAL(ref-1 < (flzuint8 *)output))
+        return 0;
+#endif
+#endif
+
+      if(FASTLZ_EXPECT_CONDITIONAL(ip < ip_limit))
+        ctrl = *ip++;
+      else
+        loop = 0;
+
+      ref--;
+      len += 3;
+
+#if defined(FASTLZ_DICT)
+      if(FASTLZ_UNEXPECT_CONDITIONAL(ref < (flzuint8 *)output))
+      {
+        /* starts in the dictionary and may run on into the output */
+        const flzuint8* dict_end = (const flzuint8*)dict + dict_len;
+        const flzuint8* dref = dict_end - ((flzuint8*)output - ref);
+        for(; len && dref < dict_end; --len)
+          *op++ = *dref++;
+        for(ref = (flzuint8*)output; len; --len)
+          *op++ = *ref++;
+      }
+      else
+#endif
+      if(FASTLZ_EXPECT_CONDITIONAL((flzuint32)(op_limit - op) >= len + FASTLZ_WILD_SLACK))
+      {
+        /* enough room to overshoot, copy whole chunks */
+        flzuint8* end = op + len;
+        flzuint32 distance = (flzuint32)(op - ref);
+
+        if(distance >= FASTLZ_WILD_CHUNK)
+        {
+          do
+          {
+            FASTLZ_WILD_COPY(op, ref);
+            op += FASTLZ_WILD_CHUNK;
+            ref += FASTLZ_WILD_CHUNK;
+          } while(op < end);
+        }
+        else if(distance >= 16)
+        {
+          do
+          {
+            FASTLZ_COPY16(op, ref);
+            op += 16;
+            ref += 16;
+          } while(op < end);
+        }
+        else
+        {
+          if(distance < 8)
+          {
+            /* expand the pattern, then copy it from far enough behind */
+            op[0] = ref[0]; op[1] = ref[1]; op[2] = ref[2]; op[3] = ref[3];
+            op[4] = ref[4]; op[5] = ref[5]; op[6] = ref[6]; op[7] = ref[7];
+            op += 8;
+            ref = op - fastlz_wild_period[distance];
+          }
+          while(op < end)
+          {
+            FASTLZ_COPY8(op, ref);
+            op += 8;
+            ref += 8;
+          }
+        }
+        op = end;
+      }
+      else
+      {
+        /* close to the end of the output, copy exactly */
+        for(; len; --len)
+          *op++ = *ref++;
+      }
+    }
+    else
+    {
+      ctrl++;
+#ifdef FASTLZ_SAFE
+      if (FASTLZ_UNEXPECT_CONDITIONAL(op + ctrl > op_limit))
+        return 0;
+      if (FASTLZ_UNEXPECT_CONDITIONAL(ip + ctrl > ip_limit))
+        return 0;
+#endif
+
+      /* a literal run is at most MAX_COPY (32) bytes */
+      if(FASTLZ_EXPECT_CONDITIONAL(op_limit - op >= MAX_COPY && ip_limit - ip >= MAX_COPY))
+      {
+        FASTLZ_COPY32(op, ip);
+        op += ctrl;
+        ip += ctrl;
+      }
+      else
+      {
+        *op++ = *ip++;
+        for(--ctrl; ctrl; ctrl--)
+          *op++ = *ip++;
+      }
+
+      loop = FASTLZ_EXPECT_CONDITIONAL(ip < ip_limit);
+      if(loop)
+        ctrl = *ip++;
+    }
+  }
+  while(FASTLZ_EXPECT_CONDITIONAL(loop));
+
+  return op - (flzuint8*)output;
+}
+#endif
+
+/*
+ * Walks the tokens like FASTLZ_DECOMPRESSOR with all of its FASTLZ_SAFE
+ * checks, but only counts the output. Matches may reach dict_len bytes
+ * back before the start. The output only grows, so running past the
+ * largest size is checked once at the end. Returns the decompressed size,
+ * 0 if corrupted.
+ */
+#if defined(FASTLZ_VALIDATOR)
+static FASTLZ_INLINE int FASTLZ_VALIDATOR(int dict_len, const void* input, int length)
+{
+  const flzuint8* ip = (const flzuint8*) input;
+  const flzuint8* ip_limit  = ip + length;
+  flzuint64 op = 0;
+  flzuint32 ctrl = (*ip++) & 31;
+
+  for(;;)
+  {
+    if(ctrl >= 32)
+    {
+      flzuint32 len = (ctrl >> 5) - 1;
+      flzuint32 distance = (ctrl & 31) << 8;
+#if FASTLZ_LEVEL==1
+      if(len == 7-1)
+      {
+        if(FASTLZ_UNEXPECT_CONDITIONAL(ip >= ip_limit))
+          return 0;
+        len += *ip++;
+      }
+      if(FASTLZ_UNEXPECT_CONDITIONAL(ip >= ip_limit))
+        return 0;
+      distance += *ip++;
+#else
+      flzuint8 code;
+      if(len == 7-1)
+        do
+        {
+          if(FASTLZ_UNEXPECT_CONDITIONAL(ip >= ip_limit))
+            return 0;
+          code = *ip++;
+          len += code;
+        } while(code == 255);
+      if(FASTLZ_UNEXPECT_CONDITIONAL(ip >= ip_limit))
+        return 0;
+      code = *ip++;
+      distance += code;
+
+      /* match from 16-bit distance */
+      if(FASTLZ_UNEXPECT_CONDITIONAL(code == 255) && distance == (31 << 8) + 255)
+      {
+        if(FASTLZ_UNEXPECT_CONDITIONAL(ip + 2 > ip_limit))
+          return 0;
+        distance = (ip[0] << 8) + ip[1] + MAX_DISTANCE;
+        ip += 2;
+      }
+#endif
+      /* the same as ref - 1 < output */
+      if(FASTLZ_UNEXPECT_CONDITIONAL(distance + 1 > op + dict_len))
+        return 0;
+      op += (flzuint32)(len + 3);
+    }
+    else
+    {
+      ctrl++;
+      if(FASTLZ_UNEXPECT_CONDITIONAL(ctrl > (flzuint32)(ip_limit - ip)))
+        return 0;
+      ip += ctrl;
+      op += ctrl;
+    }
+
+    if(FASTLZ_UNEXPECT_CONDITIONAL(ip >= ip_limit))
+      break;
+    ctrl = *ip++;
+  }
+
+  if(op > 0x7fffffff)
+    return 0;
+  return (int)op;
+}
+#endif
 
 #endif /* !defined(FASTLZ_COMPRESSOR) && !defined(FASTLZ_DECOMPRESSOR) */
@@ -35,6 +35,8 @@
 
 #define FASTLZ_VERSION_STRING "0.1.0"
 
+#include <stddef.h>
+
 #if defined (__cplusplus)
 extern "C" {
 #endif
@@ -69,6 +71,34 @@ int fastlz_compress(const void* input, int length, void* output);
 
 int fastlz_decompress(const void* input, int length, void* output, int maxout); 
 
+/**
+  Same as fastlz_decompress, but copies literals and matches in whole 16 or
+  32 byte chunks as long as the output buffer has room for it, and switches
+  to an exact copy near the end. The decompressed data and the return value
+  are identical to fastlz_decompress.
+
+  Decompression is memory safe and never writes past maxout, but the bytes
+  between the returned size and maxout may be overwritten.
+ */
+
+int fastlz_decompress_fast(const void* input, int length, void* output, int maxout);
+
+/**
+  Checks a block of compressed data without decompressing it. The tokens
+  are walked with every check fastlz_decompress makes, but nothing is
+  written, so this is several times faster and needs no output buffer.
+  Returns 1 and the decompressed size in *out_size if fastlz_decompress
+  would succeed with that much room, 0 if the data is corrupted. out_size
+  may be NULL.
+
+  fastlz_validate_dict does the same for data compressed with a
+  dictionary of dict_len bytes, see fastlz_compress_dict.
+ */
+
+int fastlz_validate(const void* input, int length, int* out_size);
+
+int fastlz_validate_dict(int dict_len, const void* input, int length, int* out_size);
+
 /**
   Compress a block of data in the input buffer and returns the size of 
   compressed block. The size of input buffer is specified by length. The 
@@ -83,9 +113,13 @@ int fastlz_decompress(const void* input, int length, void* output, int maxout);
   The input buffer and the output buffer can not overlap.
 
   Compression level can be specified in parameter level. At the moment, 
-  only level 1 and level 2 are supported.
+  level 1 to level 4 are supported.
   Level 1 is the fastest compression and generally useful for short data.
   Level 2 is slightly slower but it gives better compression ratio.
+  Level 3 and level 4 search much harder for matches and are a lot slower,
+  level 4 more so. They produce level 2 data, so decompression is exactly
+  as fast as for level 2. Both return 0 if their search tables (about
+  640 KB) can not be allocated.
 
   Note that the compressed data, regardless of the level, can always be
   decompressed using the function fastlz_decompress above.
@@ -93,6 +127,235 @@ int fastlz_decompress(const void* input, int length, void* output, int maxout);
 
 int fastlz_compress_level(int level, const void* input, int length, void* output);
 
+/**
+  Like fastlz_compress_level, but the output buffer only has room for
+  out_cap bytes. Returns 0 if the compressed data would not fit, and for
+  levels 1 and 2 it stops as soon as that is certain. Those also pass over
+  long literal runs with a growing step, so data that does not compress
+  (JPEG, gzip) is given up on much faster. The caller can then store the
+  input as it is. Building with FASTLZ_NO_SKIP turns the skipping off.
+
+  Unless out_cap leaves room for the worst case (the input size plus 1/16
+  plus 66 bytes), the data is compressed into a temporary buffer first.
+*/
+
+int fastlz_compress_bounded(int level, const void* input, int length, void* output, int out_cap);
+
+/**
+  Like fastlz_compress_bounded, for an output buffer of out_size bytes
+  that is larger than out_cap. With FASTLZ_BOUND_SLACK bytes to spare past
+  out_cap (levels 1 and 2), or room for the worst case, the data is
+  compressed straight into it.
+*/
+
+#define FASTLZ_BOUND_SLACK 64
+
+int fastlz_compress_bounded_room(int level, const void* input, int length, void* output, int out_cap, size_t out_size);
+
+/**
+  The compressor and fastlz_decompress_fast are built several times for
+  newer x86 instruction sets. fastlz_cpu_features returns the instruction
+  sets this CPU (and the operating system) supports, as FASTLZ_CPU_* bits.
+  fastlz_use_kernel makes the best build needing no more than the given
+  features the active one and returns its name, fastlz_kernel_name returns
+  the name of the active build. Until fastlz_use_kernel is called, the
+  portable build is used. Do not call it while other threads compress.
+
+  The output is the same whichever build is active.
+*/
+
+#define FASTLZ_CPU_SSE2    1
+#define FASTLZ_CPU_SSE42   2
+#define FASTLZ_CPU_AVX2    4
+#define FASTLZ_CPU_AVX512  8
+
+int fastlz_cpu_features(void);
+
+const char* fastlz_use_kernel(int features);
+
+const char* fastlz_kernel_name(void);
+
+/**
+  Compression context, holding the hash table between calls so that it
+  does not have to be set up again for every block. This pays off for
+  short blocks, where initializing the table costs more than compressing.
+
+  fastlz_ctx_create returns 0 if the context can not be allocated.
+
+  fastlz_compress_with_ctx behaves like fastlz_compress_level. Positions
+  remembered from earlier calls are never used as matches, so the output
+  may differ slightly but is decompressed with fastlz_decompress as usual.
+  A context must not be used by two threads at the same time.
+*/
+
+typedef struct fastlz_ctx fastlz_ctx;
+
+fastlz_ctx* fastlz_ctx_create(void);
+
+int fastlz_compress_with_ctx(fastlz_ctx* ctx, int level, const void* input, int length, void* output);
+
+void fastlz_ctx_free(fastlz_ctx* ctx);
+
+/**
+  Preset dictionary. Short records that look alike (JSON, protobuf, log
+  lines) hardly compress on their own, but a match can also point back
+  into a dictionary of typical content that both sides know in advance.
+
+  fastlz_ctx_load_dict sets up the dictionary for all following calls of
+  fastlz_compress_with_ctx on that context, it is indexed only once. Only
+  the last FASTLZ_DICT_MAX bytes are used, level 1 reaches back just 8 KB
+  into it, and levels 3 and 4 compress as level 2 when a dictionary is
+  loaded. A dict_len of 0 drops the dictionary. Returns 0 if the
+  dictionary can not be allocated, 1 otherwise.
+
+  fastlz_compress_dict is the same for a single block, it indexes the
+  dictionary on every call. Returns 0 if it runs out of memory.
+
+  Data compressed with a dictionary must be decompressed with
+  fastlz_decompress_dict and exactly the same dictionary. It is decoded
+  like fastlz_decompress_fast, the output buffer needs no extra room but
+  decompression is faster with some.
+*/
+
+#define FASTLZ_DICT_MAX 65536
+
+int fastlz_ctx_load_dict(fastlz_ctx* ctx, const void* dict, int dict_len);
+
+int fastlz_compress_dict(int level, const void* dict, int dict_len, const void* input, int length, void* output);
+
+int fastlz_decompress_dict(const void* dict, int dict_len, const void* input, int length, void* output, int maxout);
+
+/**
+  Streaming. fastlz_stream_compress compresses one block of a stream, the
+  last FASTLZ_STREAM_HISTORY bytes of the earlier blocks serve as history
+  that matches can refer to, so a stream of small blocks compresses about
+  as well as one large block. Levels 3 and 4 compress as level 2. The
+  output buffer needs the same room as for fastlz_compress. Returns 0 if
+  the history can not be allocated.
+
+  fastlz_stream_decompress decompresses the blocks of a stream, in the
+  same order, into buffers of their own. Returns 0 on error, like
+  fastlz_decompress. After an error the stream can not be used any more.
+
+  A stream is used either to compress or to decompress, never both, and
+  by one thread at a time.
+*/
+
+#define FASTLZ_STREAM_HISTORY 73728
+
+typedef struct fastlz_stream fastlz_stream;
+
+fastlz_stream* fastlz_stream_create(void);
+
+int fastlz_stream_compress(fastlz_stream* stream, int level, const void* input, int length, void* output);
+
+int fastlz_stream_decompress(fastlz_stream* stream, const void* input, int length, void* output, int maxout);
+
+void fastlz_stream_free(fastlz_stream* stream);
+
+/**
+  Block container, for data of any size. The input is cut into blocks of
+  FASTLZ_BLOCK_SIZE bytes that are compressed independently, each one can
+  be decompressed on its own. A block that does not compress is stored.
+
+  Layout, all numbers little-endian:
+    header  "FLZB", version (1), log2 of the block size, 2 bytes flags (0),
+            decompressed size (64-bit)
+    blocks  32-bit size of the data that follows, the top bit set if the
+            block is stored; then the data, a fastlz block or the bytes as
+            they are. Only the last block may be shorter than the block size.
+
+  fastlz_blocks_bound returns how large the output buffer of
+  fastlz_compress_blocks must be at most. fastlz_compress_blocks returns
+  the size of the container, or 0 if maxout is too small or the level is
+  not 1 to 4.
+
+  fastlz_compress_blocks_sized does the same with blocks of block_size
+  bytes, a power of two from FASTLZ_BLOCK_MIN to FASTLZ_BLOCK_SIZE.
+  Smaller blocks compress a little worse, but a byte range can be read
+  by decompressing only the blocks that hold it.
+
+  fastlz_blocks_content_size returns the decompressed size stored in the
+  header, 0 if this is not a container. fastlz_decompress_blocks returns
+  the decompressed size, or 0 if the container is corrupted or maxout is
+  too small.
+
+  fastlz_blocks_validate checks every block of a container like
+  fastlz_validate and returns the decompressed size, or 0 if the
+  container is corrupted.
+
+  fastlz_blocks_locate returns where the entry of the given block starts
+  in the container, found by skipping over the sizes in front of the
+  blocks before it, or 0 if the container is corrupted or has fewer
+  blocks. The entry can then be given to fastlz_decompress_block below.
+*/
+
+#define FASTLZ_BLOCK_SIZE (1 << 20)
+#define FASTLZ_BLOCK_MIN (1 << 12)
+#define FASTLZ_BLOCKS_HEADER 16
+
+size_t fastlz_blocks_bound(size_t length);
+
+size_t fastlz_compress_blocks(int level, const void* input, size_t length, void* output, size_t maxout);
+
+size_t fastlz_compress_blocks_sized(int level, size_t block_size, const void* input, size_t length, void* output, size_t maxout);
+
+size_t fastlz_blocks_content_size(const void* input, size_t length);
+
+size_t fastlz_decompress_blocks(const void* input, size_t length, void* output, size_t maxout);
+
+size_t fastlz_blocks_validate(const void* input, size_t length);
+
+size_t fastlz_blocks_locate(const void* input, size_t length, size_t block);
+
+/**
+  The blocks of a container can also be handled one at a time, so that
+  they can be spread over threads.
+
+  fastlz_blocks_write_header writes the header for length bytes of data
+  in blocks of block_size bytes, FASTLZ_BLOCKS_HEADER bytes, and returns
+  its size. fastlz_compress_block writes the entry of one block of at
+  most FASTLZ_BLOCK_SIZE bytes, its 32-bit size and the data, and returns
+  how many bytes it wrote, or 0 if maxout is too small. An output of
+  size + 4 + FASTLZ_BOUND_SLACK bytes is always enough and lets the
+  compressor work without a scratch buffer.
+
+  fastlz_blocks_block_size returns the block size of a container, 0 if it
+  is not one. fastlz_blocks_index fills offsets[0..count] with where the
+  entry of every block starts, and where the last one ends; count must be
+  the number of blocks, the decompressed size divided by the block size
+  and rounded up. It returns count, or 0 if the container is corrupted.
+
+  fastlz_decompress_block decompresses the entry at input, size bytes
+  that must be exactly the block's decompressed size, into output of
+  maxout bytes. It returns how many bytes of the input the entry took, or
+  0 if it is corrupted. Decompressing is faster when there is room past
+  the end of the block, but blocks decompressed in parallel into one
+  buffer must each get maxout = size.
+*/
+size_t fastlz_blocks_write_header(size_t length, size_t block_size, void* output);
+
+size_t fastlz_compress_block(int level, const void* input, size_t size, void* output, size_t maxout);
+
+size_t fastlz_blocks_block_size(const void* input, size_t length);
+
+size_t fastlz_blocks_index(const void* input, size_t length, size_t* offsets, size_t count);
+
+size_t fastlz_decompress_block(const void* input, size_t length, void* output, size_t size, size_t maxout);
+
+/**
+  Byte shuffle filter for arrays of numbers. fastlz_shuffle stores byte 0
+  of every item of itemsize bytes first, then byte 1 of every item, and so
+  on; a partial item at the end is copied as it is. The high bytes of
+  neighbouring values are often equal, and only in this order does the
+  compressor see them as runs, so typed arrays compress much better after
+  it. fastlz_unshuffle undoes it. The output can not overlap the input.
+  Item sizes 2, 4, 8 and 16 are transposed with SSE2 where available.
+*/
+void fastlz_shuffle(int itemsize, const void* input, size_t length, void* output);
+
+void fastlz_unshuffle(int itemsize, const void* input, size_t length, void* output);
+
 #if defined (__cplusplus)
 }
 #endif
@@ -1,7 +1,8 @@
 import sys
 from distutils.core import setup, Extension
 
-extra_compile_args = ['-I./fastlz/', '-fPIC', '--std=gnu99', '-Wall', '-g', '-D_GNU_SOURCE']
+# no -march here: instruction set specific code is picked at run time
+extra_compile_args = ['-I./fastlz/', '-fPIC', '--std=gnu99', '-Wall', '-g', '-O2', '-D_GNU_SOURCE']
 extra_link_args = ['-L./fastlz/', '-static', '-lfastlz']
 
 setup(
@@ -0,0 +1,306 @@
+"""Tests of the 6pack archive functions; run with the built module on sys.path:
+
+    PYTHONPATH=build/lib.linux-x86_64-2.7 python tests/test_6pack.py
+
+The large file test packs a sparse file of a little over 4 GB, which takes
+no real disk space, but extracting it writes 4 GB, twice one after the other.
+It is skipped with less than 5 GB free.
+"""
+import os
+import random
+import shutil
+import struct
+import tempfile
+import unittest
+import zlib
+
+import fastlz
+
+BLOCK = 128 * 1024
+G4 = 1 << 32
+
+
+def text(rnd, n):
+    words = ["alpha", "beta", "gamma", "delta", "7", "\n"]
+    return "".join(rnd.choice(words) for i in range(n // 4 + 1))[:n]
+
+
+def noise(rnd, n):
+    return "".join(chr(rnd.getrandbits(8)) for i in range(n))
+
+
+def chunks(archive):
+    """(position, id, options, size, checksum, extra) of every chunk"""
+    result = []
+    pos = 8
+    while pos + 16 <= len(archive):
+        header = struct.unpack("<HHIII", archive[pos:pos + 16])
+        result.append((pos,) + header)
+        pos += 16 + header[2]
+    return result
+
+
+class ArchiveTest(unittest.TestCase):
+
+    def setUp(self):
+        self.cwd = os.getcwd()
+        self.dir = tempfile.mkdtemp()
+        os.chdir(self.dir)
+
+    def tearDown(self):
+        os.chdir(self.cwd)
+        shutil.rmtree(self.dir)
+
+    def write(self, name, data):
+        with open(name, "wb") as f:
+            f.write(data)
+
+    def read(self, name):
+        with open(name, "rb") as f:
+            return f.read()
+
+    def pack(self, name, **kw):
+        if os.path.exists("t.6pk"):
+            os.remove("t.6pk")
+        fastlz.pack_file(1, name, "t.6pk", **kw)
+        return self.read("t.6pk")
+
+    def unpack(self, archive, **kw):
+        """the error and the files unpack_file leaves in an empty directory"""
+        self.write("t.6pk", archive)
+        out = tempfile.mkdtemp(dir=self.dir)
+        os.chdir(out)
+        try:
+            fastlz.unpack_file(os.path.join(self.dir, "t.6pk"), **kw)
+            error = None
+        except fastlz.error as e:
+            error = str(e)
+        files = dict((n, self.read(n)) for n in os.listdir("."))
+        os.chdir(self.dir)
+        shutil.rmtree(out)
+        return error, files
+
+
+class SmallArchiveTest(ArchiveTest):
+
+    def setUp(self):
+        ArchiveTest.setUp(self)
+        rnd = random.Random(5)
+        self.files = {
+            "empty.txt": "",
+            "tiny.txt": "abc",
+            "one.txt": text(rnd, BLOCK),
+            "onemore.txt": text(rnd, BLOCK + 1),
+            "mixed.bin": text(rnd, 3 * BLOCK) + noise(rnd, 2 * BLOCK + 3) + text(rnd, BLOCK),
+            "long.txt": text(rnd, 20 * BLOCK + 17),
+        }
+        for name, data in self.files.items():
+            self.write(name, data)
+
+    def test_pack_modes_agree(self):
+        # the threads and the mapping do not change the archive
+        for name in sorted(self.files):
+            serial = self.pack(name)
+            for kw in ({"threads": 2}, {"threads": 4, "inflight": 1}, {"threads": 9, "inflight": 100},
+                       {"mmap": True}, {"threads": 3, "mmap": True}):
+                self.assertEqual(self.pack(name, **kw), serial, (name, kw))
+            self.assertEqual(self.unpack(serial), (None, {name: self.files[name]}))
+
+    def test_index(self):
+        for name in sorted(self.files):
+            plain = self.pack(name)
+            indexed = self.pack(name, index=True)
+            for kw in ({"threads": 3}, {"mmap": True}):
+                kw["index"] = True
+                self.assertEqual(self.pack(name, **kw), indexed, (name, kw))
+
+            # chunk 18 after the blocks, chunk 19 at the end pointing at it
+            self.assertTrue(indexed.startswith(plain))
+            pos, cid, options, size, checksum, extra = chunks(indexed)[-1]
+            self.assertEqual((pos, cid, size), (len(indexed) - 24, 19, 8))
+            self.assertEqual(struct.unpack("<Q", indexed[-8:])[0], len(plain))
+            pos, cid, options, size, checksum, count = chunks(indexed)[-2]
+            self.assertEqual((pos, cid, size), (len(plain), 18, 8 + 16 * count))
+            body = indexed[pos + 16:pos + 16 + size]
+            self.assertEqual(checksum, zlib.adler32(body) & 0xffffffff)
+            self.assertEqual(struct.unpack("<Q", body[:8])[0], 8)
+            blocks = []
+            offset = 0
+            for pos, cid, options, size, checksum, extra in chunks(plain):
+                if cid == 17:
+                    blocks.append((offset, pos))
+                    offset += extra if options else size
+            self.assertEqual([struct.unpack("<QQ", body[8 + 16 * i:24 + 16 * i])
+                              for i in range(count)], blocks)
+
+            # older readers skip the new chunks
+            for kw in ({}, {"threads": 3}):
+                self.assertEqual(self.unpack(indexed, **kw), (None, {name: self.files[name]}))
+
+    def test_read_range(self):
+        rnd = random.Random(7)
+        archives = {}
+        for name in self.files:
+            archives[name] = (self.pack(name), self.pack(name, index=True))
+        names = sorted(self.files)
+        # several files in one archive, the index at the end is for the last
+        self.write("all.6pk", "".join([archives[names[0]][0]] +
+                                      [archives[n][1][8:] for n in names[1:]]))
+        for name in names:
+            self.write("plain.6pk", archives[name][0])
+            self.write("indexed.6pk", archives[name][1])
+            data = self.files[name]
+            cases = [(0, 0), (0, len(data)), (0, len(data) + 10), (len(data), 5),
+                     (len(data) + 100, 5), (max(len(data) - 1, 0), 10)]
+            cases += [(k * BLOCK + d, n) for k in range(21) for d in (-1, 0, 1)
+                      for n in (1, BLOCK, 2 * BLOCK + 7) if k * BLOCK + d >= 0]
+            cases += [(rnd.randrange(len(data) + 1), rnd.randrange(3 * BLOCK)) for i in range(20)]
+            for archive in ("plain.6pk", "indexed.6pk", "all.6pk"):
+                for offset, length in cases:
+                    self.assertEqual(fastlz.read_range(archive, name, offset, length),
+                                     data[offset:offset + length], (archive, name, offset, length))
+
+        self.assertRaises(fastlz.error, fastlz.read_range, "indexed.6pk", "nope.txt", 0, 1)
+        self.assertRaises(fastlz.error, fastlz.read_range, "long.txt", "long.txt", 0, 1)
+        self.assertRaises(ValueError, fastlz.read_range, "indexed.6pk", names[-1], -1, 1)
+
+    def test_damaged_range(self):
+        # a damaged archive gives the right bytes or fastlz.error
+        rnd = random.Random(9)
+        name = "mixed.bin"
+        data = self.files[name]
+        indexed = self.pack(name, index=True)
+        for i in range(200):
+            damaged = bytearray(indexed)
+            for j in range(rnd.choice([1, 2, 3])):
+                if rnd.random() < 0.3:
+                    pos = len(damaged) - rnd.randrange(1, 60)
+                else:
+                    pos = rnd.randrange(8, len(damaged))
+                damaged[pos] ^= 1 << rnd.randrange(8)
+            if rnd.random() < 0.2:
+                damaged = damaged[:rnd.randrange(8, len(damaged))]
+            self.write("bad.6pk", str(damaged))
+            offset = rnd.randrange(len(data))
+            length = rnd.randrange(2 * BLOCK)
+            try:
+                result = fastlz.read_range("bad.6pk", name, offset, length)
+            except fastlz.error:
+                continue
+            self.assertEqual(result, data[offset:offset + length])
+
+    def test_unpack_modes_agree(self):
+        # threads and the mapping stop a damaged file where the serial loop does
+        rnd = random.Random(11)
+        archives = [self.pack(name) for name in ("long.txt", "mixed.bin", "tiny.txt", "empty.txt")]
+        multi = archives[0] + "".join(a[8:] for a in archives[1:])
+        cases = [multi, multi[:len(archives[0]) - 100], multi[:len(archives[0]) - 3],
+                 archives[0][:8 + 30], archives[0][:8 + 16 + 20]]
+        blocks = [c for c in chunks(multi) if c[1] == 17]
+        for pos, cid, options, size, checksum, extra in (blocks[3], blocks[-2]):
+            damaged = bytearray(multi)
+            damaged[pos + 16 + size // 2] ^= 1
+            cases.append(str(damaged))
+            damaged = bytearray(multi)
+            damaged[pos + 2] = 5
+            cases.append(str(damaged))
+        for i in range(30):
+            damaged = bytearray(multi)
+            damaged[rnd.randrange(8, len(damaged))] ^= 1 << rnd.randrange(8)
+            cases.append(str(damaged))
+
+        for archive in cases:
+            serial = self.unpack(archive)
+            for kw in ({"threads": 2}, {"threads": 5}, {"mmap": True}, {"threads": 3, "mmap": True}):
+                self.assertEqual(self.unpack(archive, **kw), serial, kw)
+        error, files = self.unpack(multi)
+        self.assertEqual((error, sorted(files)), (None, ["empty.txt", "long.txt", "mixed.bin", "tiny.txt"]))
+
+    def test_errors(self):
+        self.assertRaises(fastlz.error, fastlz.pack_file, 1, "nope.txt", "t.6pk", threads=4)
+        self.assertFalse(os.path.exists("t.6pk"))
+        self.assertRaises(ValueError, fastlz.pack_file, 5, "tiny.txt", "t.6pk")
+        self.assertFalse(os.path.exists("t.6pk"))
+        self.pack("tiny.txt")
+        self.assertRaises(fastlz.error, fastlz.pack_file, 1, "tiny.txt", "t.6pk")
+        self.assertRaises(fastlz.error, fastlz.pack_file, 1, "t.6pk", "u.6pk")
+        self.assertRaises(fastlz.error, fastlz.unpack_file, "tiny.txt")
+        # an existing file is skipped, not overwritten
+        self.write("tiny.txt", "keep")
+        self.assertRaises(fastlz.error, fastlz.unpack_file, "t.6pk")
+        self.assertEqual(self.read("tiny.txt"), "keep")
+
+
+class LargeArchiveTest(ArchiveTest):
+
+    def setUp(self):
+        ArchiveTest.setUp(self)
+        stat = os.statvfs(self.dir)
+        if stat.f_bavail * stat.f_frsize < 5 * G4 // 4:
+            self.skipTest("needs 5 GB of free disk")
+        self.size = G4 + 300 * 1024 + 7
+        self.marks = {12345: "near the start", 1 << 31: "at 2 GB " * 10,
+                      G4 - 100: "across the 4 GB line " * 20, self.size - 50: "x" * 50}
+        # sparse, only the marks take disk space
+        with open("big.bin", "wb") as f:
+            f.truncate(self.size)
+            for offset, data in self.marks.items():
+                f.seek(offset)
+                f.write(data)
+
+    def expect(self, offset, length):
+        result = bytearray(max(0, min(length, self.size - offset)))
+        for mark, data in self.marks.items():
+            start = max(offset, mark)
+            end = min(offset + len(result), mark + len(data))
+            if start < end:
+                result[start - offset:end - offset] = data[start - mark:end - mark]
+        return str(result)
+
+    def same_file(self, a, b):
+        with open(a, "rb") as fa:
+            with open(b, "rb") as fb:
+                while True:
+                    da = fa.read(1 << 20)
+                    if da != fb.read(1 << 20):
+                        return False
+                    if not da:
+                        return True
+
+    def test_large_file(self):
+        fastlz.pack_file(1, "big.bin", "big.6pk", index=True)
+        size = os.path.getsize("big.6pk")
+        with open("big.6pk", "rb") as f:
+            head = f.read(8 + 16 + 10)
+        # the file entry holds all 64 bits of the size
+        self.assertEqual(struct.unpack("<Q", head[24:32])[0], self.size)
+
+        fastlz.pack_file(1, "big.bin", "threads.6pk", threads=3, mmap=True, index=True)
+        self.assertTrue(self.same_file("big.6pk", "threads.6pk"))
+        os.remove("threads.6pk")
+
+        cases = [(G4 - 150, 600), (G4 - 1, 2), (G4, 10), (G4 + 5000, 200000),
+                 (self.size - 60, 100), (self.size, 5), (1 << 31, 200), (12340, 30)]
+        for offset, length in cases:
+            self.assertEqual(fastlz.read_range("big.6pk", "big.bin", offset, length),
+                             self.expect(offset, length), offset)
+
+        # without the index the chunk headers are walked
+        with open("big.6pk", "r+b") as f:
+            f.truncate(size - 24)
+        for offset, length in cases[:4]:
+            self.assertEqual(fastlz.read_range("big.6pk", "big.bin", offset, length),
+                             self.expect(offset, length), offset)
+
+        os.mkdir("out")
+        os.chdir("out")
+        for kw in ({}, {"threads": 3, "mmap": True}):
+            fastlz.unpack_file("../big.6pk", **kw)
+            self.assertEqual(os.path.getsize("big.bin"), self.size)
+            self.assertTrue(self.same_file("big.bin", "../big.bin"), kw)
+            os.remove("big.bin")
+        os.chdir(self.dir)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,726 @@
+"""Tests of the fastlz codec; run with the built module on sys.path:
+
+    PYTHONPATH=build/lib.linux-x86_64-2.7 python tests/test_fastlz.py
+"""
+import array
+import hashlib
+import random
+import struct
+import threading
+import unittest
+import zlib
+
+import fastlz
+
+# from fastlz.c: how far apart the hash tags of two calls on a context are
+HASH_GAP = 1 << 17
+
+
+def text(rnd, n):
+    words = ["alpha", "beta", "gamma", "delta", "7", "\n"]
+    result = []
+    size = 0
+    while size < n:
+        result.append(rnd.choice(words))
+        size += len(result[-1])
+    return "".join(result)[:n]
+
+
+def noise(rnd, n):
+    return "".join(chr(rnd.getrandbits(8)) for i in range(n))
+
+
+def outcome(f, *args, **kw):
+    """the result of f, None if it raised fastlz.error"""
+    try:
+        return f(*args, **kw)
+    except fastlz.error:
+        return None
+
+
+def mutations(rnd, data, count, start=0):
+    """count copies of data with a byte changed from start on, or cut short"""
+    result = []
+    for i in range(count):
+        if i % 4 == 3:
+            result.append(data[:rnd.randrange(start, len(data))])
+        else:
+            pos = rnd.randrange(start, len(data))
+            byte = chr(ord(data[pos]) ^ (1 << rnd.randrange(8)))
+            result.append(data[:pos] + byte + data[pos + 1:])
+    return result
+
+
+class CompressorTest(unittest.TestCase):
+
+    def test_stable_output(self):
+        # the hash table a thread or Compressor keeps between calls must not
+        # show in the output: same input, same bytes, whatever came before
+        rnd = random.Random(1)
+        samples = [text(rnd, n) for n in (100, 3000, 7000, 20000)]
+        others = [text(rnd, 5000), "\0" * 4000, text(rnd, 1500)[::-1]]
+
+        for level in (1, 2):
+            results = []
+
+            def run():
+                for s in samples:
+                    first = fastlz.compress(s, level)
+                    for other in others:
+                        fastlz.compress(other, level)
+                    results.append((first, fastlz.compress(s, level)))
+
+            # a new thread starts out with a fresh context
+            thread = threading.Thread(target=run)
+            thread.start()
+            thread.join()
+            for first, again in results:
+                self.assertEqual(first, again)
+
+            for s in samples:
+                expected = fastlz.compress(s, level)
+                c = fastlz.Compressor(level)
+                self.assertEqual(c.compress(s), expected)
+                for other in others:
+                    c.compress(other)
+                self.assertEqual(c.compress(s), expected)
+
+    def test_tags_wrap(self):
+        # Every call moves the hash tags of a context on by its length plus
+        # HASH_GAP. Drive them once around 2**32 so the next input starts at
+        # the tag the first one did. Its hash entries are still there, the
+        # zero fillers only touch one, and must not be taken as matches: the
+        # same bytes lie just before the input, where those matches point.
+        rnd = random.Random(2)
+        words = ["alpha", "beta", "gamma", "delta", "7", "\n"]
+        data = "".join(rnd.choice(words) for i in range(600))[:2048]
+        c = fastlz.Compressor(1)
+        self.assertEqual(fastlz.decompress(c.compress(data)), data)
+
+        # fillers below 2048 bytes stay on the context
+        advance = 2 ** 32 - HASH_GAP
+        calls = advance // (HASH_GAP + 1024)
+        total = advance - calls * HASH_GAP
+        for i in range(calls):
+            length = total // calls + (i < total % calls)
+            self.assertEqual(len(fastlz.decompress(c.compress("\0" * length))), length)
+
+        buf = bytearray(data * 2)
+        view = memoryview(buf)[len(data):]
+        self.assertEqual(fastlz.decompress(c.compress(view)), data)
+
+
+
+class BatchTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        rnd = random.Random(18)
+        result = []
+        for i in range(2000):
+            kind = rnd.randrange(4)
+            if kind == 0:
+                result.append("".join(records(rnd, rnd.randrange(1, 30))))
+            elif kind == 1:
+                result.append(text(rnd, rnd.randrange(0, 10000)))
+            elif kind == 2:
+                result.append(noise(rnd, rnd.randrange(0, 200)))
+            else:
+                result.append(text(rnd, rnd.randrange(0, 100)))
+        cls.items = result
+
+    def test_same_as_compress(self):
+        # whichever thread takes an item, and whatever it did before, the
+        # bytes are those of compress()
+        items = self.items
+        rnd = random.Random(19)
+        for level in (None, 1, 2, 4):
+            args = () if level is None else (level,)
+            expected = [fastlz.compress(x, *args) for x in items]
+            for threads in (1, 4, 3):
+                self.assertTrue(fastlz.compress_batch(items, *args, threads=threads) == expected)
+                data, offsets = fastlz.compress_batch(items, *args, threads=threads,
+                                                      contiguous=True)
+                self.assertEqual(len(offsets), len(items) + 1)
+                self.assertTrue([data[offsets[i]:offsets[i + 1]] for i in range(len(items))]
+                                == expected)
+                # leave the thread and pool contexts with other tags
+                fastlz.compress_batch([text(rnd, 3000) for i in range(50)], threads=threads)
+                fastlz.compress(text(rnd, 5000))
+
+    def test_round_trip(self):
+        items = self.items + [text(random.Random(20), BLOCK_SIZE + 100), ""]
+        for threads in (1, 4):
+            compressed = fastlz.compress_batch(items, threads=threads)
+            self.assertTrue(fastlz.decompress_batch(compressed, threads=threads) == items)
+            data, offsets = fastlz.decompress_batch(compressed, threads=threads, contiguous=True)
+            self.assertTrue([data[offsets[i]:offsets[i + 1]] for i in range(len(items))]
+                            == items)
+            views = [memoryview(bytearray(x)) for x in items[:100]]
+            self.assertTrue(fastlz.compress_batch(views, threads=threads) == compressed[:100])
+
+
+class LevelTest(unittest.TestCase):
+
+    def test_levels(self):
+        rnd = random.Random(5)
+        for s in ["", "abc", text(rnd, 5000), text(rnd, 100000), noise(rnd, 3000)]:
+            for level in (1, 2, 3, 4):
+                self.assertEqual(fastlz.decompress(fastlz.compress(s, level)), s)
+                self.assertEqual(fastlz.decompress(fastlz.Compressor(level).compress(s)), s)
+            self.assertEqual(fastlz.decompress(fastlz.compress(s)), s)
+
+    def test_bad_levels(self):
+        items = ["abc" * 100, "xyz"]
+        for level in (0, 5, 9, 99, -2):
+            self.assertRaises(ValueError, fastlz.compress, items[0], level)
+            self.assertRaises(ValueError, fastlz.compress, items[0], level=level, frame=True)
+            self.assertRaises(ValueError, fastlz.compress_into, items[0], bytearray(400), level)
+            self.assertRaises(ValueError, fastlz.compress_batch, items, level)
+            self.assertRaises(ValueError, fastlz.compress_batch, items, level, 4, True)
+            self.assertRaises(ValueError, fastlz.Compressor, level)
+            self.assertRaises(ValueError, fastlz.CompressObj, level)
+        self.assertRaises(ValueError, fastlz.CompressObj, -1)
+
+
+def records(rnd, n):
+    """n small JSON-like records, the kind of data a dictionary helps"""
+    names = ["alpha", "beta", "gamma", "delta"]
+    return ['{"id": %d, "name": "%s", "tags": ["%s", "%s"]}\n' %
+            (rnd.randrange(1000), rnd.choice(names), rnd.choice(names), rnd.choice(names))
+            for i in range(n)]
+
+
+class DictTest(unittest.TestCase):
+
+    def setUp(self):
+        rnd = random.Random(6)
+        self.dict = fastlz.train_dict(records(rnd, 500))
+        self.other = fastlz.train_dict(records(random.Random(7), 500))
+        self.samples = ["".join(records(rnd, n)) for n in (1, 3, 20, 400)]
+
+    def test_train_dict(self):
+        samples = records(random.Random(8), 3000)
+        self.assertTrue(0 < len(self.dict) <= 8192)
+        # built from 64-byte segments, a smaller size gives an empty dict
+        for size in (1, 100, 4096, 65536):
+            self.assertTrue(len(fastlz.train_dict(samples, size)) <= size)
+        self.assertTrue(len(fastlz.train_dict(samples, 100)) > 0)
+        for size in (0, -1, 65537):
+            self.assertRaises(ValueError, fastlz.train_dict, samples, size)
+        self.assertRaises(TypeError, fastlz.train_dict, ["abc", 7])
+        self.assertRaises(TypeError, fastlz.train_dict, 7)
+
+    def test_round_trip(self):
+        for level in (1, 2, 3, 4):
+            c = fastlz.Compressor(level, self.dict)
+            plain = with_dict = 0
+            for s in self.samples:
+                data = fastlz.compress(s, level, self.dict)
+                self.assertEqual(fastlz.decompress(data, self.dict), s)
+                self.assertEqual(c.compress(s), data)
+                for checksum in (False, True):
+                    framed = fastlz.compress(s, level, self.dict, frame=True, checksum=checksum)
+                    self.assertEqual(fastlz.decompress(framed, self.dict), s)
+                if len(s) < 500:
+                    plain += len(fastlz.compress(s, level))
+                    with_dict += len(data)
+            # a dict is for small inputs
+            self.assertTrue(with_dict < plain)
+
+    def test_long_dict(self):
+        # only the last 64 KB of a dictionary count
+        rnd = random.Random(9)
+        big = noise(rnd, 100000) + self.dict
+        for s in self.samples:
+            for frame in (False, True):
+                data = fastlz.compress(s, 2, big, frame=frame)
+                self.assertEqual(data, fastlz.compress(s, 2, big[-65536:], frame=frame))
+                self.assertEqual(fastlz.decompress(data, big), s)
+                self.assertEqual(fastlz.decompress(data, big[-65536:]), s)
+
+    def test_wrong_dict(self):
+        for s in self.samples:
+            for level in (1, 2):
+                # raw data only fails where it reaches before the start
+                data = fastlz.compress(s, level, self.dict)
+                self.assertRaises(fastlz.error, fastlz.decompress, data)
+                self.assertRaises(fastlz.error, fastlz.validate, data)
+
+                framed = fastlz.compress(s, level, self.dict, frame=True)
+                for wrong in (None, self.other, self.dict[:-1], self.dict + "x", ""):
+                    args = (framed,) if wrong is None else (framed, wrong)
+                    self.assertRaises(fastlz.error, fastlz.decompress, *args)
+                    self.assertRaises(fastlz.error, fastlz.validate, *args)
+                self.assertRaises(fastlz.error, fastlz.decompress_into, framed,
+                                  bytearray(len(s)))
+                self.assertRaises(fastlz.error, fastlz.decompress_batch, [framed])
+
+
+# from fastlz-module.c: CompressObj cuts larger pieces into blocks of this size
+STREAM_BLOCK = 1 << 20
+
+
+def stream_blocks(data):
+    """(compressed size, original size) from the header of every stream block"""
+    result = []
+    pos = 0
+    while pos < len(data):
+        csize, usize = struct.unpack("<II", data[pos:pos + 8])
+        result.append((csize, usize))
+        pos += 8 + csize
+    return result
+
+
+class StreamTest(unittest.TestCase):
+
+    def compress(self, pieces, level=1):
+        c = fastlz.CompressObj(level)
+        data = "".join(c.compress(p) for p in pieces)
+        return data + c.flush()
+
+    def feed(self, data, cuts):
+        """decompress data fed in pieces of the given sizes, round and round"""
+        d = fastlz.DecompressObj()
+        result = []
+        pos = i = 0
+        while pos < len(data):
+            result.append(d.decompress(data[pos:pos + cuts[i % len(cuts)]]))
+            pos += cuts[i % len(cuts)]
+            i += 1
+        return "".join(result)
+
+    def test_round_trip(self):
+        rnd = random.Random(10)
+        pieces = [text(rnd, n) for n in (0, 1, 5, 100, 3000, 70000, 7)]
+        pieces += [noise(rnd, 5000), text(rnd, 40000)]
+        for level in (1, 2, 3, 4):
+            data = self.compress(pieces, level)
+            self.assertEqual(self.feed(data, [len(data)]), "".join(pieces))
+            for cuts in ([1], [7], [8], [9, 1, 3], [rnd.randrange(1, 20000) for i in range(9)]):
+                self.assertEqual(self.feed(data, cuts), "".join(pieces))
+
+    def test_history(self):
+        # small pieces match against the earlier ones
+        pieces = records(random.Random(11), 300)
+        data = self.compress(pieces)
+        self.assertEqual(self.feed(data, [100]), "".join(pieces))
+        blocks = stream_blocks(data)
+        self.assertEqual([usize for csize, usize in blocks], map(len, pieces))
+        alone = sum(len(fastlz.compress(p)) for p in pieces)
+        self.assertTrue(sum(csize for csize, usize in blocks) < alone // 2)
+
+    def test_large(self):
+        rnd = random.Random(12)
+        big = text(rnd, 2 * STREAM_BLOCK + 12345)
+        pieces = ["start", big, big[:STREAM_BLOCK], "end"]
+        for level in (1, 2):
+            data = self.compress(pieces, level)
+            sizes = [usize for csize, usize in stream_blocks(data)]
+            self.assertEqual(sizes, [5, STREAM_BLOCK, STREAM_BLOCK, 12345, STREAM_BLOCK, 3])
+            self.assertEqual(self.feed(data, [65536, 1, 300000]), "".join(pieces))
+
+    def test_corrupt(self):
+        rnd = random.Random(13)
+        pieces = [text(rnd, 2000) for i in range(5)]
+        data = self.compress(pieces)
+        blocks = stream_blocks(data)
+        first = 8 + blocks[0][0]
+        second = first + 8 + blocks[1][0]
+
+        def patch(pos, csize, usize):
+            return data[:pos] + struct.pack("<II", csize, usize) + data[pos + 8:]
+
+        csize, usize = blocks[1]
+        for bad in (patch(first, csize, usize + 1), patch(first, csize, usize - 1),
+                    patch(first, 0, usize), patch(first, csize, 0),
+                    patch(first, csize, 1 << 31),
+                    data[:first + 8] + "\xff" * 20 + data[first + 28:]):
+            d = fastlz.DecompressObj()
+            self.assertEqual(d.decompress(bad[:first]), pieces[0])
+            self.assertRaises(fastlz.error, d.decompress, bad[first:second])
+            # and stays broken, even for good data
+            self.assertRaises(fastlz.error, d.decompress, data[second:])
+            self.assertRaises(fastlz.error, d.decompress, "")
+
+        # a block cut short waits for the rest
+        d = fastlz.DecompressObj()
+        self.assertEqual(d.decompress(data[:second - 1]), pieces[0])
+        self.assertEqual(d.decompress(data[second - 1:]), "".join(pieces[1:]))
+
+
+def varint(n):
+    result = ""
+    while n >= 0x80:
+        result += chr(n & 0x7f | 0x80)
+        n >>= 7
+    return result + chr(n)
+
+
+class FrameTest(unittest.TestCase):
+
+    def samples(self):
+        rnd = random.Random(15)
+        result = [text(rnd, n) for n in (0, 1, 5, 127, 128, 16383, 16384, 100000)]
+        return result + [noise(rnd, 3000), text(rnd, BLOCK_SIZE + 5)]
+
+    def test_round_trip(self):
+        for s in self.samples():
+            for level in (1, 2, 3, 4):
+                for checksum in (False, True):
+                    c = fastlz.compress(s, level, frame=True, checksum=checksum)
+                    flags = level | (0x08 if checksum else 0)
+                    head = "\x8c" + chr(flags) + varint(len(s))
+                    self.assertEqual(c[:len(head)], head)
+                    self.assertEqual(fastlz.decompressed_size(c), len(s))
+                    self.assertEqual(fastlz.validate(c), len(s))
+                    self.assertTrue(fastlz.decompress(c) == s)
+                    buf = bytearray(len(s) + 10)
+                    self.assertEqual(fastlz.decompress_into(c, buf), len(s))
+                    self.assertTrue(buf[:len(s)] == s)
+                    if s:
+                        self.assertRaises(fastlz.error, fastlz.decompress_into, c,
+                                          bytearray(len(s) - 1))
+        self.assertEqual(fastlz.compress("", frame=True), "\x8c\x01\x00")
+
+    def test_checksum(self):
+        for s in self.samples()[1:]:
+            c = fastlz.compress(s, frame=True, checksum=True)
+            pos = 2 + len(varint(len(s)))
+            self.assertEqual(c[pos:pos + 4], struct.pack("<I", zlib.adler32(s) & 0xffffffff))
+            bad = c[:pos] + chr(ord(c[pos]) ^ 1) + c[pos + 1:]
+            self.assertRaises(fastlz.error, fastlz.decompress, bad)
+            self.assertRaises(fastlz.error, fastlz.decompress_into, bad, bytearray(len(s)))
+            self.assertRaises(fastlz.error, fastlz.decompress_batch, [bad])
+            # validate() does not decompress, so it can not see the checksum
+            self.assertEqual(fastlz.validate(bad), len(s))
+
+        # a changed byte of stored data decodes, only the checksum can tell
+        s = self.samples()[-2]
+        c = fastlz.compress(s, frame=True, checksum=True)
+        self.assertEqual(c[2 + len(varint(len(s))) + 4], "\xe0")
+        bad = c[:-1] + chr(ord(c[-1]) ^ 1)
+        self.assertRaises(fastlz.error, fastlz.decompress, bad)
+
+    def test_bad_header(self):
+        s = text(random.Random(16), 20000)
+        c = fastlz.compress(s, frame=True, checksum=True)
+        size = varint(len(s))
+        for bad in ("\x8c", "\x8c\x01", c[:3], c[:2 + len(size) + 3],
+                    # a size that does not end, or runs past 64 bits
+                    "\x8c\x01" + "\xff" * 12, "\x8c\x01" + "\x80" * 10 + "\x01",
+                    # a flag this version does not know, a shuffle without item size
+                    "\x8c\x41\x00", "\x8c\x81\x00", "\x8c\x11\x05"):
+            self.assertRaises(fastlz.error, fastlz.decompress, bad)
+            self.assertRaises(fastlz.error, fastlz.decompressed_size, bad)
+            self.assertRaises(fastlz.error, fastlz.validate, bad)
+        # the stored size must match the body
+        for length in (len(s) - 1, len(s) + 1, 0, len(s) * 300):
+            bad = c[:2] + varint(length) + c[2 + len(size):]
+            self.assertRaises(fastlz.error, fastlz.decompress, bad)
+            self.assertRaises(fastlz.error, fastlz.validate, bad)
+        self.assertRaises(fastlz.error, fastlz.decompress, c[:-1])
+
+    def test_stored(self):
+        rnd = random.Random(17)
+        for s in ["a", "ab", "abc", noise(rnd, 100), noise(rnd, 70000)]:
+            c = fastlz.compress(s)
+            self.assertEqual(c, "\xe0" + s)
+            self.assertEqual(fastlz.decompress(c), s)
+            self.assertEqual(fastlz.decompressed_size(c), len(s))
+            self.assertEqual(fastlz.validate(c), len(s))
+            self.assertEqual(fastlz.decompress_range(c, 1, 10), s[1:11])
+            buf = bytearray(len(s))
+            self.assertEqual(fastlz.decompress_into(c, buf), len(s))
+            self.assertEqual(buf, s)
+            self.assertRaises(fastlz.error, fastlz.decompress_into, c, bytearray(len(s) - 1))
+        self.assertEqual(fastlz.compress(""), "")
+        self.assertEqual(fastlz.decompress(""), "")
+        self.assertEqual(fastlz.decompress("\xe0"), "")
+
+
+class ShuffleTest(unittest.TestCase):
+
+    def check(self, c, s, itemsize):
+        """c is framed with the given shuffle item size and decodes to s"""
+        head = varint(len(s))
+        self.assertEqual(c[0], "\x8c")
+        self.assertEqual(ord(c[1]) & 0x10, 0x10)
+        self.assertEqual(ord(c[2 + len(head)]), itemsize)
+        self.assertEqual(fastlz.decompressed_size(c), len(s))
+        self.assertEqual(fastlz.validate(c), len(s))
+        self.assertTrue(fastlz.decompress(c) == s)
+        buf = bytearray("\xa5" * (len(s) + 16))
+        self.assertEqual(fastlz.decompress_into(c, memoryview(buf)[:len(s)]), len(s))
+        self.assertTrue(buf[:len(s)] == s)
+        self.assertEqual(buf[len(s):], "\xa5" * 16)
+        self.assertEqual(fastlz.decompress_range(c, 3, 50), s[3:53])
+
+    def test_arrays(self):
+        for typecode in "hHilfd":
+            a = array.array(typecode, [i % 30000 for i in range(20000)])
+            s = a.tostring()
+            for level in (1, 2, 4):
+                c = fastlz.compress(a, level, shuffle=True)
+                self.check(c, s, a.itemsize)
+                self.assertTrue(len(c) < len(fastlz.compress(a, level)))
+                self.assertTrue(fastlz.compress(a, level, shuffle=a.itemsize) == c)
+        # bytes have nothing to shuffle
+        for data in ("abcdefg" * 10, bytearray("abcdefg" * 10), array.array("b", [1, 2] * 40)):
+            self.assertEqual(fastlz.compress(data, shuffle=True), fastlz.compress(data))
+            self.assertEqual(fastlz.compress(data, shuffle=1), fastlz.compress(data))
+
+    def test_item_sizes(self):
+        rnd = random.Random(23)
+        ramp = "".join(struct.pack("<Q", i * 7919) for i in range(10000))
+        for itemsize in (2, 3, 4, 7, 8, 16, 255):
+            for length in (0, 1, itemsize - 1, itemsize, itemsize + 1, 1000,
+                           itemsize * 300, itemsize * 300 + itemsize // 2 + 1, 80000):
+                s = ramp[:length]
+                for checksum in (False, True):
+                    c = fastlz.compress(s, shuffle=itemsize, checksum=checksum)
+                    if s:
+                        self.check(c, s, itemsize)
+                    else:
+                        self.assertEqual(fastlz.decompress(c), "")
+        # the trailing partial item is kept as it is
+        s = ramp[:8 * 1000 + 5] + noise(rnd, 3)
+        self.check(fastlz.compress(s, 1, shuffle=8), s, 8)
+
+    def test_batch_and_large(self):
+        ramp = "".join(struct.pack("<I", i * 13) for i in range(300000)) + "xy"
+        items = [ramp[:n] for n in (5, 1000, 4003, 100000, len(ramp))]
+        compressed = [fastlz.compress(x, shuffle=4) for x in items]
+        self.check(compressed[-1], ramp, 4)
+        self.assertEqual(fastlz.compress(ramp, shuffle=4, threads=4), compressed[-1])
+        self.assertTrue(fastlz.decompress(compressed[-1], threads=4) == ramp)
+        for threads in (1, 4):
+            self.assertTrue(fastlz.decompress_batch(compressed, threads=threads) == items)
+            data, offsets = fastlz.decompress_batch(compressed, threads=threads,
+                                                    contiguous=True)
+            self.assertTrue(data == "".join(items))
+
+    def test_bad_item_size(self):
+        for itemsize in (0, -1, 256, 1 << 40):
+            self.assertRaises((ValueError, OverflowError), fastlz.compress, "abc",
+                              shuffle=itemsize)
+        self.assertRaises(TypeError, fastlz.compress, "abc", shuffle="x")
+
+
+# from fastlz.h: larger inputs go into a container of blocks this size
+BLOCK_SIZE = 1 << 20
+
+
+def container(data):
+    """(block size, decompressed size, [(size, stored) of every block])"""
+    magic, version, log, flags, size = struct.unpack("<4sBBHQ", data[:16])
+    assert (magic, version, flags) == ("FLZB", 1, 0)
+    blocks = []
+    pos = 16
+    while pos < len(data):
+        entry = struct.unpack("<I", data[pos:pos + 4])[0]
+        blocks.append((entry & 0x7fffffff, entry >> 31))
+        pos += 4 + (entry & 0x7fffffff)
+    return 1 << log, size, blocks
+
+
+class BlocksTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        rnd = random.Random(14)
+        chunk = text(rnd, 300000)
+        # a block of digests does not compress
+        digests = "".join(hashlib.md5(str(i)).digest() for i in range(BLOCK_SIZE // 16))
+        cls.big = (chunk * 7)[:2 * BLOCK_SIZE] + digests + chunk + "tail"
+        cls.small = text(rnd, 30000) + noise(rnd, 9000) + text(rnd, 2000)
+
+    def check(self, c, s, block_size):
+        size, length, blocks = container(c)
+        self.assertEqual((size, length), (block_size, len(s)))
+        self.assertEqual(len(blocks), (len(s) + block_size - 1) // block_size)
+        self.assertEqual(fastlz.decompressed_size(c), len(s))
+        self.assertEqual(fastlz.validate(c), len(s))
+        for threads in (1, 2, 4):
+            self.assertTrue(fastlz.decompress(c, threads=threads) == s)
+        buf = bytearray(len(s))
+        self.assertEqual(fastlz.decompress_into(c, buf), len(s))
+        self.assertTrue(buf == s)
+        self.assertRaises(fastlz.error, fastlz.decompress_into, c, bytearray(len(s) - 1))
+        return blocks
+
+    def test_large(self):
+        s = self.big
+        for level in (1, 2):
+            c = fastlz.compress(s, level)
+            self.assertTrue(fastlz.compress(s, level, threads=4) == c)
+            blocks = self.check(c, s, BLOCK_SIZE)
+            # the block of noise is stored as it is
+            self.assertEqual([stored for size, stored in blocks], [0, 0, 1, 0])
+        framed = fastlz.compress(s, frame=True, checksum=True, threads=3)
+        self.assertTrue(fastlz.decompress(framed, threads=2) == s)
+        self.assertEqual(fastlz.decompressed_size(framed), len(s))
+
+    def test_block_edges(self):
+        # up to one block is no container, exact multiples fill the last one
+        s = self.big
+        self.assertNotEqual(fastlz.compress(s[:BLOCK_SIZE])[:4], "FLZB")
+        for length in (BLOCK_SIZE + 1, 2 * BLOCK_SIZE, 3 * BLOCK_SIZE - 1):
+            self.check(fastlz.compress(s[:length]), s[:length], BLOCK_SIZE)
+        for length in (4097, 8192, 12288, 40000):
+            s = self.small[:length]
+            self.check(fastlz.compress(s, block_size=4096), s, 4096)
+        self.assertNotEqual(fastlz.compress(self.small[:4096], block_size=4096)[:4], "FLZB")
+
+    def test_block_size(self):
+        s = self.small
+        for block_size in (4096, 8192, 16384):
+            for level in (1, 2, 3, 4):
+                c = fastlz.compress(s, level, block_size=block_size)
+                self.check(c, s, block_size)
+                self.assertTrue(fastlz.compress(s, level, block_size=block_size, threads=4) == c)
+        for block_size in (1, 2048, 4095, 4097, 12288, 2 * BLOCK_SIZE, -4096):
+            self.assertRaises(ValueError, fastlz.compress, s, block_size=block_size)
+
+    def test_range(self):
+        for s, block_size in ((self.small, 4096), (self.big, BLOCK_SIZE)):
+            for frame in (False, True):
+                c = fastlz.compress(s, block_size=block_size, frame=frame)
+                edges = [0, 1, block_size - 1, block_size, block_size + 1,
+                         3 * block_size - 2, len(s) - 1, len(s), len(s) + 10]
+                for offset in edges:
+                    for length in (0, 1, 2, 3, block_size, 2 * block_size + 3, len(s)):
+                        self.assertTrue(fastlz.decompress_range(c, offset, length) ==
+                                        s[offset:offset + length], (offset, length))
+        self.assertRaises(ValueError, fastlz.decompress_range, c, -1, 10)
+
+    def test_corrupt(self):
+        s = self.small
+        c = fastlz.compress(s, block_size=4096)
+        size, length, blocks = container(c)
+        for bad in (c[:-1], c[:16 + 4 + blocks[0][0]], c[:12] + "\0\0\0\1" + c[16:],
+                    c[:16] + "\xff\xff\0\0" + c[20:], c[:5] + "\x0b" + c[6:]):
+            self.assertRaises(fastlz.error, fastlz.decompress, bad)
+            self.assertRaises(fastlz.error, fastlz.decompress, bad, threads=4)
+            self.assertRaises(fastlz.error, fastlz.validate, bad)
+            self.assertRaises(fastlz.error, fastlz.decompress_range, bad, 0, len(s))
+
+
+class ValidateTest(unittest.TestCase):
+
+    def inputs(self):
+        """(compressed, dict) in every format"""
+        rnd = random.Random(21)
+        d = fastlz.train_dict(records(rnd, 300))
+        s = text(rnd, 30000)
+        result = [(fastlz.compress(s, level), None) for level in (1, 2, 3)]
+        result += [(fastlz.compress(s[:n]), None) for n in (0, 1, 3, 4, 20, 200)]
+        result += [(fastlz.compress(noise(rnd, 500)), None),
+                   (fastlz.compress(s, frame=True), None),
+                   (fastlz.compress(s, 2, frame=True, block_size=4096), None),
+                   (fastlz.compress(s, block_size=4096), None),
+                   (fastlz.compress(s * 40), None)]
+        r = "".join(records(rnd, 40))
+        result += [(fastlz.compress(r, level, d), d) for level in (1, 2)]
+        result += [(fastlz.compress(r, 2, d, frame=True), d)]
+        return result
+
+    def decompressed_length(self, c, d):
+        args = (c,) if d is None else (c, d)
+        r = outcome(fastlz.decompress, *args)
+        return None if r is None else len(r)
+
+    def validated(self, c, d):
+        args = (c,) if d is None else (c, d)
+        return outcome(fastlz.validate, *args)
+
+    def test_valid(self):
+        for c, d in self.inputs():
+            self.assertEqual(self.validated(c, d), self.decompressed_length(c, d))
+            self.assertNotEqual(self.validated(c, d), None)
+
+    def test_mutated(self):
+        rnd = random.Random(22)
+        for c, d in self.inputs():
+            if len(c) < 2:
+                continue
+            for bad in mutations(rnd, c, 200):
+                self.assertEqual(self.validated(bad, d), self.decompressed_length(bad, d))
+                if d is not None:
+                    self.assertEqual(self.validated(bad, d[:-1] + "?"),
+                                     self.decompressed_length(bad, d[:-1] + "?"))
+
+
+class DecoderTest(unittest.TestCase):
+
+    def setUp(self):
+        self.kernel = fastlz.active_kernel()
+
+    def tearDown(self):
+        fastlz.active_kernel(self.kernel)
+
+    def kernels(self):
+        """make each codec build this machine runs the active one in turn"""
+        for name in ("generic",) + fastlz.cpu_features():
+            try:
+                fastlz.active_kernel(name)
+            except ValueError:
+                continue
+            yield name
+
+    def samples(self):
+        rnd = random.Random(3)
+        edge = text(rnd, 300)
+        result = [edge[:n] for n in range(40)]
+        # matches overlapping their own output, from offset 1 on
+        result += [("abcdefghij"[:k] * (9000 // k + 1))[:9000 + k] for k in range(1, 11)]
+        result += ["a" * 70000, "x" + "\0" * 3000 + "y"]
+        # a match that runs to the very last byte of the output
+        body = text(rnd, 5000)
+        result += [body + body[1000:1000 + n] for n in (3, 4, 12, 13, 300)]
+        result += [text(rnd, 200000), noise(rnd, 300) * 40]
+        return result
+
+    def decode_into(self, data, size):
+        """decompress_into a buffer of size bytes, checking nothing past it changed"""
+        buf = bytearray("\xa5" * (size + 64))
+        n = outcome(fastlz.decompress_into, data, memoryview(buf)[:size])
+        self.assertEqual(buf[size:], "\xa5" * 64)
+        return None if n is None else str(buf[:n])
+
+    def test_round_trip(self):
+        for level in (1, 2, 3, 4):
+            expected = [fastlz.compress(s, level) for s in self.samples()]
+            for kernel in self.kernels():
+                for s, c in zip(self.samples(), expected):
+                    self.assertEqual(fastlz.compress(s, level), c, kernel)
+                    self.assertEqual(fastlz.decompress(c), s, kernel)
+                    self.assertEqual(self.decode_into(c, len(s)), s, kernel)
+                    self.assertEqual(self.decode_into(c, len(s) + 100), s, kernel)
+                    if s:
+                        self.assertEqual(self.decode_into(c, len(s) - 1), None, kernel)
+
+    def test_corrupt(self):
+        rnd = random.Random(4)
+        for s in self.samples()[40:]:
+            for level in (1, 2):
+                c = fastlz.compress(s, level)
+                if c[0] == "\xe0":
+                    continue
+                # the first byte tells the format and level, leave it be
+                for bad in mutations(rnd, c, 24, 1):
+                    results = []
+                    for kernel in self.kernels():
+                        r = outcome(fastlz.decompress, bad)
+                        results.append(r)
+                        if r is None:
+                            self.assertEqual(self.decode_into(bad, len(bad) * 256 + 256), None)
+                        else:
+                            self.assertEqual(self.decode_into(bad, len(r)), r)
+                            if r:
+                                self.assertEqual(self.decode_into(bad, len(r) - 1), None)
+                    self.assertEqual(results, [results[0]] * len(results))
+
+
+if __name__ == "__main__":
+    unittest.main()